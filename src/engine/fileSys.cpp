@@ -194,6 +194,8 @@ void FileSys::readSetting(void* settings, IniLine& il) {
 		sets.port = std::move(il.val);
 	else if (!SDL_strcasecmp(il.prp.c_str(), iniKeywordPlayerName))
 		sets.playerName = std::move(il.val);
+	else if (!SDL_strcasecmp(il.prp.c_str(), iniKeywordChannel))
+		sets.channel = std::move(il.val);
 	else if (!SDL_strcasecmp(il.prp.c_str(), iniKeywordLastConfig))
 		sets.lastConfig = std::move(il.val);
 }
@@ -315,6 +317,7 @@ void FileSys::saveSettings(const Settings& sets, const InputSys* input) {
 	IniLine::write(text, iniKeywordAddress, sets.address);
 	IniLine::write(text, iniKeywordPort, sets.port);
 	IniLine::write(text, iniKeywordPlayerName, sets.playerName);
+	IniLine::write(text, iniKeywordChannel, sets.channel);
 	IniLine::write(text, iniKeywordLastConfig, sets.lastConfig);
 	text += linend;
 
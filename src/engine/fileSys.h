@@ -81,6 +81,7 @@ private:
 	static constexpr char iniKeywordAddress[] = "address";
 	static constexpr char iniKeywordPort[] = "port";
 	static constexpr char iniKeywordPlayerName[] = "player_name";
+	static constexpr char iniKeywordChannel[] = "channel";
 	static constexpr char iniKeywordLastConfig[] = "last_config";
 
 	static constexpr char iniKeyKey[] = "K";
@@ -0,0 +1,457 @@
+#include "loadgen.h"
+#include "utils/text.h"
+using namespace Com;
+
+constexpr char wsGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+constexpr uint wsResponseMax = 4096;
+constexpr uint gameConfigSize = 48;	// the content of a configuration only matters to the clients
+constexpr uint8 globalText[] = "loadgen";
+
+static thread_local pair<Bot*, Loadgen*> receiving;	// bot whose data is being processed, for answering websocket pings through its queue
+
+static bool connectPending() {
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EINPROGRESS;
+#endif
+}
+
+static ullong stampNow() {
+	return ullong(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_clock::now().time_since_epoch()).count());
+}
+
+// STATS
+
+void Stats::addLatency(ullong us) {
+	uint shift = 0;
+	for (; (us >> shift) >= latencyPrecision * 2; ++shift);
+	uint bucket = shift ? shift * latencyPrecision + uint(us >> shift) : uint(us);
+	++latencies[std::min(bucket, latencyBuckets - 1)];
+}
+
+ullong Stats::latencyValue(uint bucket) {
+	if (bucket < latencyPrecision * 2)
+		return bucket;
+	uint shift = bucket / latencyPrecision - 1;
+	return ullong(bucket - shift * latencyPrecision) << shift;
+}
+
+// BOT
+
+Bot::Bot(uint bid, bool websocket) :
+	id(bid),
+	webs(websocket)
+{}
+
+void Bot::tick(Loadgen& lg, steady_clock::time_point now) {
+	if (stage == Stage::idle) {
+		if (now >= wake && lg.mayConnect(now))
+			connect(lg, now);
+		return;
+	}
+	if (now - progress > stallTimeout && !(lg.script.idle && stage == Stage::lobby))	// idle bots only hear from the server for pings
+		fail(lg, lg.stats.stalls);
+	else if (moveDue && now >= wake) {
+		moveDue = false;
+		try {
+			sendStamp(lg, Code::move);
+		} catch (const Error&) {
+			fail(lg, lg.stats.failures);
+		}
+	}
+}
+
+void Bot::connect(Loadgen& lg, steady_clock::time_point now) {
+	++cycle;
+	progress = now;
+	const addrinfo* addr = lg.script.address(id);
+	if (fd = createSocket(addr->ai_family, 0); fd == INVALID_SOCKET) {
+		fail(lg, lg.stats.failures);
+		return;
+	}
+	if (noblockSocket(fd, true) || (::connect(fd, addr->ai_addr, socklent(addr->ai_addrlen)) && !connectPending())) {
+		fail(lg, lg.stats.failures);
+		return;
+	}
+	try {
+		lg.poller.add(fd, this, true);
+	} catch (const Error&) {
+		closeSocket(fd);
+		fail(lg, lg.stats.failures);
+		return;
+	}
+	lg.poller.setOut(fd, true);
+	stage = Stage::connecting;
+}
+
+void Bot::connected(Loadgen& lg) {
+	lg.poller.setOut(fd, false);
+	if (!webs) {
+		sendVersion(lg);
+		setStage(Stage::validating);
+		return;
+	}
+
+	uint8 nonce[16];
+	for (uint8& it : nonce)
+		it = uint8(lg.randGen());
+	wsKey = encodeBase64(string(reinterpret_cast<char*>(nonce), sizeof(nonce)));
+	string request = "GET / HTTP/1.1\r\n"
+		"Host: " + string(lg.script.address(id)->ai_family == AF_INET6 ? "[::1]" : "127.0.0.1") + "\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: " + wsKey + "\r\n"
+		"Sec-WebSocket-Version: 13\r\n\r\n";
+	sendq.insert(sendq.end(), request.begin(), request.end());
+	flush(lg);
+	setStage(Stage::upgrading);
+}
+
+bool Bot::upgraded(Loadgen& lg) {
+	const uint8* dat = recvb.getData();
+	uint dlim = recvb.getDlim();
+	if (dlim && dat[0] == uint8(Code::full)) {	// the server rejects before reading the handshake
+		fail(lg, lg.stats.rejects);
+		return false;
+	}
+
+	string word = "\r\n\r\n";
+	const uint8* rend = std::search(dat, dat + dlim, word.begin(), word.end());
+	if (rend == dat + dlim) {
+		if (dlim > wsResponseMax)
+			throw Error(msgProtocolError);
+		return false;
+	}
+	string response(reinterpret_cast<const char*>(dat), sizet(rend - dat));
+	if (response.compare(0, 12, "HTTP/1.1 101") || response.find(encodeBase64(digestSha1(wsKey + wsGuid))) == string::npos)
+		throw Error(msgProtocolError);
+	recvb.clear();	// the server doesn't send anything else until it got the version
+	sendVersion(lg);
+	setStage(Stage::validating);
+	return true;
+}
+
+void Bot::event(Loadgen& lg, uint8 events) {
+	if (stage == Stage::idle)
+		return;
+
+	progress = steady_clock::now();
+	try {
+		if (stage == Stage::connecting) {
+			if (!(events & (Poller::EV_OUT | Poller::EV_DISCONNECT)))
+				return;
+			int err = 0;
+			socklent len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &len) || err) {
+				fail(lg, lg.stats.failures);
+				return;
+			}
+			connected(lg);
+		} else if ((events & Poller::EV_OUT) && sendPos < sendq.size())
+			flush(lg);
+
+		if (events & (Poller::EV_IN | Poller::EV_DISCONNECT)) {
+			bool fin = recvb.recvData(fd, true);
+			if (stage == Stage::upgrading && !upgraded(lg)) {
+				if (fin && stage != Stage::idle)
+					fail(lg, lg.stats.failures);
+				return;
+			}
+			receiving = pair(this, &lg);
+			while (stage != Stage::idle)
+				if (const uint8* data = recvb.recv(fd, webs, replyControl)) {
+					process(lg, data);
+					if (stage != Stage::idle)
+						recvb.clearCur(webs);
+				} else
+					break;
+			if (fin && stage != Stage::idle)
+				fail(lg, lg.stats.failures);
+		}
+	} catch (const Error&) {
+		fail(lg, lg.stats.failures);
+	}
+}
+
+void Bot::process(Loadgen& lg, const uint8* data) {
+	uint len = read16(data + 1);
+	Stats::add(lg.stats.received, 1);
+	Stats::add(lg.stats.receivedBytes, len);
+	switch (Code(data[0])) {
+	case Code::full:
+		fail(lg, lg.stats.rejects);
+		break;
+	case Code::version:
+		throw Error("Server expected version " + readText(data));
+	case Code::rlistcon:
+		if (stage != Stage::validating)
+			throw Error(msgProtocolError);
+		Stats::add(lg.stats.connects, 1);
+		Stats::add(lg.stats.online, 1);
+		for (uint i = 0; i < lg.script.burst; ++i) {
+			uint8 msg[dataHeadSize + sizeof(globalText) - 1] = { uint8(Code::glmessage) };
+			write16(msg + 1, sizeof(msg));
+			std::copy_n(globalText, sizeof(globalText) - 1, msg + dataHeadSize);
+			sendMessage(lg, msg, sizeof(msg));
+		}
+		if (!lg.script.channels.empty())
+			sendChannel(lg);	// the server handles it before the room gets created
+		if (isHost() && !lg.script.idle) {
+			room = "lg" + toStr(id) + '.' + toStr(cycle);
+			sendName(lg, Code::rnew, room);
+			setStage(Stage::hosting);
+		} else {
+			setStage(Stage::lobby);
+			checkRooms(lg, data + dataHeadSize + sizeof(uint16), data + len);
+		}
+		break;
+	case Code::rlist:
+		if (stage == Stage::lobby)
+			checkRooms(lg, data + dataHeadSize, data + len);
+		break;
+	case Code::channel:
+		if (!data[dataHeadSize])
+			fail(lg, lg.stats.failures);
+		else if (stage == Stage::lobby)
+			checkRooms(lg, data + dataHeadSize + 1, data + len);
+		break;
+	case Code::rnew:
+		if (stage == Stage::lobby && readName(data + dataHeadSize) == lg.partner(id).getRoom())
+			join(lg, lg.partner(id).getRoom());
+		break;
+	case Code::ropen:
+		if (stage == Stage::lobby && data[dataHeadSize] && readName(data + dataHeadSize + 1) == lg.partner(id).getRoom())
+			join(lg, lg.partner(id).getRoom());
+		break;
+	case Code::rdelta:
+		if (stage == Stage::lobby)
+			checkDelta(lg, data + dataHeadSize + sizeof(uint32), data + len);
+		break;
+	case Code::cnrnew:
+		if (data[dataHeadSize] != uint8(CncrnewCode::ok))
+			fail(lg, lg.stats.failures);
+		break;
+	case Code::hello: {
+		uint8 cnjoin[dataHeadSize + 1] = { uint8(Code::cnjoin) };
+		write16(cnjoin + 1, sizeof(cnjoin));
+		cnjoin[dataHeadSize] = 1;
+		sendMessage(lg, cnjoin, sizeof(cnjoin));
+		uint8 config[dataHeadSize + gameConfigSize] = { uint8(Code::config) };
+		write16(config + 1, sizeof(config));
+		sendMessage(lg, config, sizeof(config));
+		setStage(Stage::playing);
+		rounds = 0;
+		sendStamp(lg, Code::move);
+		break; }
+	case Code::cnjoin:
+		setStage(data[dataHeadSize] ? Stage::playing : Stage::lobby);
+		break;
+	case Code::move:
+		lg.stats.addLatency((stampNow() - read64(data + dataHeadSize)) / 1000);
+		sendStamp(lg, Code::record);
+		break;
+	case Code::record:
+		lg.stats.addLatency((stampNow() - read64(data + dataHeadSize)) / 1000);
+		if (++rounds >= lg.script.rounds) {
+			Stats::add(lg.stats.games, 1);
+			close(lg);	// the guest gets a leave and reconnects as well
+		} else if (lg.script.interval) {
+			moveDue = true;
+			wake = progress + std::chrono::milliseconds(lg.script.interval);
+		} else
+			sendStamp(lg, Code::move);
+		break;
+	case Code::ping:
+		sendMessage(lg, data, len);
+		break;
+	case Code::leave:
+		close(lg);
+	}
+}
+
+void Bot::checkRooms(Loadgen& lg, const uint8* list, const uint8* end) {
+	const string& name = lg.partner(id).getRoom();
+	if (name.empty() || end - list < pdift(sizeof(uint16)))
+		return;
+	list += sizeof(uint16);	// the room count isn't needed when the end is known
+	while (list < end) {
+		uint8 nlen = *list & 0x7F;
+		if (end - list <= nlen)
+			return;
+		if ((*list & 0x80) && !name.compare(0, string::npos, reinterpret_cast<const char*>(list + 1), nlen)) {
+			join(lg, name);
+			return;
+		}
+		list += 1 + nlen;
+	}
+}
+
+void Bot::checkDelta(Loadgen& lg, const uint8* list, const uint8* end) {
+	const string& name = lg.partner(id).getRoom();
+	if (name.empty())
+		return;
+	while (list < end) {
+		uint8 nlen = *list & roomDeltaLength;
+		if (end - list <= nlen)
+			return;
+		if ((*list & roomDeltaOpen) && !name.compare(0, string::npos, reinterpret_cast<const char*>(list + 1), nlen)) {
+			join(lg, name);
+			return;
+		}
+		list += 1 + nlen;
+	}
+}
+
+void Bot::join(Loadgen& lg, const string& name) {
+	sendName(lg, Code::join, name);
+	setStage(Stage::joining);
+}
+
+void Bot::setStage(Stage stg) {
+	stage = stg;
+	progress = steady_clock::now();
+}
+
+void Bot::sendVersion(Loadgen& lg) {
+	uint8 vlen = uint8(strlen(commonVersion));
+	vector<uint8> data(dataHeadSize + sizeof(uint8) + vlen + sizeof(uint8) + sizeof(uint8));	// empty name, so the server picks one
+	data[0] = uint8(Code::version);
+	write16(data.data() + 1, uint16(data.size()));
+	data[dataHeadSize] = vlen;
+	std::copy_n(commonVersion, vlen, data.begin() + dataHeadSize + 1);
+	data.back() = CAP_ROOM_DELTA | CAP_PING;
+	sendMessage(lg, data.data(), uint(data.size()));
+}
+
+void Bot::sendChannel(Loadgen& lg) {
+	sendName(lg, Code::channel, lg.script.channels[id / 2 % lg.script.channels.size()]);	// both bots of a pair need to be in the same channel
+}
+
+void Bot::sendName(Loadgen& lg, Code code, const string& name) {
+	vector<uint8> data(dataHeadSize + sizeof(uint8) + name.length());
+	data[0] = uint8(code);
+	write16(data.data() + 1, uint16(data.size()));
+	data[dataHeadSize] = uint8(name.length());
+	std::copy(name.begin(), name.end(), data.begin() + dataHeadSize + 1);
+	sendMessage(lg, data.data(), uint(data.size()));
+}
+
+void Bot::sendStamp(Loadgen& lg, Code code) {
+	uint8 data[dataHeadSize + sizeof(uint64)] = { uint8(code) };
+	write16(data + 1, sizeof(data));
+	write64(data + dataHeadSize, stampNow());
+	sendMessage(lg, data, sizeof(data));
+}
+
+void Bot::sendMessage(Loadgen& lg, const uint8* data, uint len) {
+	if (webs) {
+		uint8 frame[wsHeadMax];
+		uint hlen = writeWsHead(frame, len);
+		frame[1] |= 0x80;
+		write32(frame + hlen, uint32(lg.randGen()));
+		sendq.insert(sendq.end(), frame, frame + hlen + sizeof(uint32));
+		sizet ofs = sendq.size();
+		sendq.insert(sendq.end(), data, data + len);
+		unmaskData(sendq.data() + ofs, len, frame + hlen);
+	} else
+		sendq.insert(sendq.end(), data, data + len);
+	Stats::add(lg.stats.sent, 1);
+	Stats::add(lg.stats.sentBytes, len);
+	flush(lg);
+}
+
+void Bot::replyControl(nsint, const uint8* frame, uint len) {
+	auto [bot, lg] = receiving;
+	uint8 mask[sizeof(uint32)];
+	write32(mask, uint32(lg->randGen()));
+	bot->sendq.insert(bot->sendq.end(), { frame[0], uint8(frame[1] | 0x80) });	// control frames have at most 125 bytes of payload
+	bot->sendq.insert(bot->sendq.end(), mask, mask + sizeof(mask));
+	sizet ofs = bot->sendq.size();
+	bot->sendq.insert(bot->sendq.end(), frame + wsHeadMin, frame + len);
+	unmaskData(bot->sendq.data() + ofs, len - wsHeadMin, mask);
+	bot->flush(*lg);
+}
+
+void Bot::flush(Loadgen& lg) {
+	while (sendPos < sendq.size()) {
+		long len = ::send(fd, reinterpret_cast<const char*>(sendq.data() + sendPos), int(sendq.size() - sendPos), 0);
+		if (len <= 0) {
+			if (len < 0 && wouldBlock()) {
+				lg.poller.setOut(fd, true);
+				return;
+			}
+			throw Error(msgConnectionLost);
+		}
+		sendPos += uint(len);
+	}
+	sendq.clear();
+	sendPos = 0;
+	lg.poller.setOut(fd, false);
+}
+
+void Bot::fail(Loadgen& lg, std::atomic<ullong>& counter) {
+	Stats::add(counter, 1);
+	close(lg, failDelay);
+}
+
+void Bot::close(Loadgen& lg, steady_clock::duration delay) {
+	if (fd != INVALID_SOCKET) {
+		lg.poller.del(fd);
+		closeSocket(fd);
+	}
+	if (stage >= Stage::lobby)
+		Stats::sub(lg.stats.online, 1);
+	recvb.clear();
+	sendq.clear();
+	sendPos = 0;
+	room.clear();
+	moveDue = false;
+	stage = Stage::idle;
+	wake = steady_clock::now() + delay;
+}
+
+// LOADGEN
+
+Loadgen::Loadgen(const Script& scr, uint first, uint cnt) :
+	script(scr),
+	firstId(first)
+{
+	randGen.seed(generateRandomSeed() + first);
+	bots.reserve(cnt);	// the poller holds pointers to the bots
+	for (uint i = first; i < first + cnt; ++i)
+		bots.emplace_back(i, i * 61 % 100 < scr.wsShare);	// spreads the websocket bots evenly over the ids
+}
+
+void Loadgen::run(const std::atomic<bool>& running) {
+	poller.start();
+	while (running) {
+		for (const Poller::Ready& it : poller.wait(pollTimeout))
+			static_cast<Bot*>(it.udata)->event(*this, it.events);
+		if (steady_clock::time_point now = steady_clock::now(); now - lastTick >= std::chrono::milliseconds(1)) {	// don't go over all bots for every small batch of events
+			lastTick = now;
+			for (Bot& it : bots)
+				it.tick(*this, now);
+		}
+	}
+	for (Bot& it : bots)
+		it.close(*this);
+	poller.end();
+}
+
+bool Loadgen::mayConnect(steady_clock::time_point now) {
+	if (!script.connectRate)
+		return true;
+	if (now < nextConnect)
+		return false;
+
+	constexpr std::chrono::milliseconds burst(100);	// how far the schedule may fall behind before connects get dropped instead of caught up
+	if (now - nextConnect > burst)
+		nextConnect = now - burst;
+	nextConnect += std::chrono::nanoseconds(1000000000 / script.connectRate);
+	return true;
+}
+
+const Bot& Loadgen::partner(uint id) const {
+	return bots[(id ^ 1) - firstId];
+}
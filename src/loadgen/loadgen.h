@@ -0,0 +1,157 @@
+#pragma once
+
+#include "server/poller.h"
+#include <atomic>
+#include <chrono>
+#include <random>
+
+using std::chrono::steady_clock;
+
+class Loadgen;
+
+// what every bot does during a run
+struct Script {
+	vector<const addrinfo*> addresses;	// of the same server, which the bots get spread over, since every destination only has so many local ports
+	vector<string> channels;	// lobby channels that the pairs of bots get spread over, none to stay in the default one
+	uint rounds = 100;		// move/record exchanges per game
+	uint burst = 0;			// global messages each bot sends after connecting
+	uint interval = 0;		// milliseconds between a host's moves
+	uint wsShare = 50;		// percentage of websocket bots
+	uint connectRate = 500;	// new connections per second and thread, 0 for no limit
+	bool idle = false;		// bots stay in the lobby after connecting instead of playing
+
+	const addrinfo* address(uint bot) const;
+};
+
+inline const addrinfo* Script::address(uint bot) const {
+	return addresses[bot % addresses.size()];
+}
+
+// counters of one thread that only it writes
+struct Stats {
+	static constexpr uint latencyPrecision = 512;	// relay latencies are recorded with 10 significant bits
+	static constexpr uint latencyBuckets = latencyPrecision * 25;	// enough for over an hour
+
+	std::atomic<ullong> connects = 0;	// handshakes that got a room list
+	std::atomic<ullong> rejects = 0;	// connections turned away by a full server
+	std::atomic<ullong> failures = 0;	// connection and protocol errors
+	std::atomic<ullong> stalls = 0;		// bots that got reconnected after not making progress
+	std::atomic<ullong> online = 0;		// bots that are currently past the handshake
+	std::atomic<ullong> games = 0;
+	std::atomic<ullong> sent = 0;		// messages
+	std::atomic<ullong> received = 0;
+	std::atomic<ullong> sentBytes = 0;
+	std::atomic<ullong> receivedBytes = 0;
+	vector<ullong> latencies = vector<ullong>(latencyBuckets);	// counts of relay latencies in microseconds, only read once the thread has finished
+
+	static void add(std::atomic<ullong>& cnt, ullong val);
+	static void sub(std::atomic<ullong>& cnt, ullong val);
+	void addLatency(ullong us);
+	static ullong latencyValue(uint bucket);	// lower bound of a bucket in microseconds
+};
+
+inline void Stats::add(std::atomic<ullong>& cnt, ullong val) {
+	cnt.store(cnt.load(std::memory_order_relaxed) + val, std::memory_order_relaxed);	// no need for an atomic increment with only one writer
+}
+
+inline void Stats::sub(std::atomic<ullong>& cnt, ullong val) {
+	cnt.store(cnt.load(std::memory_order_relaxed) - val, std::memory_order_relaxed);
+}
+
+// scripted client where every bot with an even id hosts a room that the next bot joins
+class Bot {
+public:
+	enum class Stage : uint8 {
+		idle,		// waiting to (re)connect
+		connecting,	// waiting for the TCP connection
+		upgrading,	// waiting for the websocket handshake response
+		validating,	// waiting for the room list
+		lobby,		// guest waiting for its host's room to open
+		hosting,	// host waiting for the room confirmation or its guest
+		joining,	// guest waiting for the join confirmation
+		playing
+	};
+
+	static constexpr std::chrono::seconds stallTimeout = std::chrono::seconds(10);
+	static constexpr std::chrono::seconds failDelay = std::chrono::seconds(1);	// before reconnecting after an error
+
+private:
+	Com::Buffer recvb;
+	vector<uint8> sendq;
+	uint sendPos = 0;			// start of the unsent data in sendq
+	string room;				// name of the room a host has created
+	string wsKey;
+	steady_clock::time_point wake;		// when an idle bot connects or a host sends its next move
+	steady_clock::time_point progress;	// last stage change
+	nsint fd = INVALID_SOCKET;
+	uint id;
+	uint cycle = 0;				// connections so far, which makes room names unique
+	uint rounds = 0;
+	Stage stage = Stage::idle;
+	bool webs;
+	bool moveDue = false;		// a host's next move waits for wake
+
+public:
+	Bot(uint bid, bool websocket);
+
+	void tick(Loadgen& lg, steady_clock::time_point now);
+	void event(Loadgen& lg, uint8 events);
+	void close(Loadgen& lg, steady_clock::duration delay = steady_clock::duration::zero());
+
+	Stage getStage() const;
+	bool isHost() const;
+	const string& getRoom() const;
+
+private:
+	void connect(Loadgen& lg, steady_clock::time_point now);
+	void connected(Loadgen& lg);
+	bool upgraded(Loadgen& lg);
+	void process(Loadgen& lg, const uint8* data);
+	void checkRooms(Loadgen& lg, const uint8* list, const uint8* end);
+	void checkDelta(Loadgen& lg, const uint8* list, const uint8* end);
+	void setStage(Stage stg);
+	void join(Loadgen& lg, const string& name);
+	void sendVersion(Loadgen& lg);
+	void sendChannel(Loadgen& lg);
+	void sendName(Loadgen& lg, Com::Code code, const string& name);
+	void sendStamp(Loadgen& lg, Com::Code code);
+	void sendMessage(Loadgen& lg, const uint8* data, uint len);	// wraps the message in a masked frame for websocket bots
+	static void replyControl(nsint fd, const uint8* frame, uint len);	// queues a masked copy of an unmasked websocket control frame for the bot that's receiving
+	void flush(Loadgen& lg);
+	void fail(Loadgen& lg, std::atomic<ullong>& counter);
+};
+
+inline Bot::Stage Bot::getStage() const {
+	return stage;
+}
+
+inline bool Bot::isHost() const {
+	return !(id % 2);
+}
+
+inline const string& Bot::getRoom() const {
+	return room;
+}
+
+// one thread's bots and their poller
+class Loadgen {
+public:
+	static constexpr int pollTimeout = 5;
+
+	Poller poller;
+	Stats stats;
+	const Script& script;
+	std::default_random_engine randGen;
+private:
+	vector<Bot> bots;
+	uint firstId;
+	steady_clock::time_point nextConnect;
+	steady_clock::time_point lastTick;
+
+public:
+	Loadgen(const Script& scr, uint first, uint cnt);
+
+	void run(const std::atomic<bool>& running);
+	bool mayConnect(steady_clock::time_point now);
+	const Bot& partner(uint id) const;
+};
@@ -0,0 +1,221 @@
+#include "loadgen.h"
+#include "utils/text.h"
+#include <csignal>
+#include <iostream>
+#include <thread>
+
+constexpr char defaultAddress[] = "localhost";
+constexpr uint defaultBots = 1000;
+constexpr uint defaultDuration = 30;
+constexpr uint maxThreads = 64;
+constexpr uint spareFiles = 16;	// besides the bots' sockets
+constexpr char argAddress = 'a';
+constexpr char argPort = 'p';
+constexpr char arg4 = '4';
+constexpr char arg6 = '6';
+constexpr char argBots = 'n';
+constexpr char argThreads = 'w';
+constexpr char argDuration = 't';
+constexpr char argRounds = 'r';
+constexpr char argInterval = 'i';
+constexpr char argBurst = 'g';
+constexpr char argWsShare = 's';
+constexpr char argConnectRate = 'c';
+constexpr char argChannels = 'j';
+constexpr char argIdle = 'l';
+constexpr array<double, 3> percentiles = { 0.5, 0.99, 0.999 };
+constexpr array<const char*, percentiles.size()> percentileNames = { "p50", "p99", "p999" };
+
+static std::atomic<bool> running = true;
+
+// sums of the counters of all threads
+struct Totals {
+	ullong connects = 0;
+	ullong rejects = 0;
+	ullong failures = 0;
+	ullong stalls = 0;
+	ullong online = 0;
+	ullong games = 0;
+	ullong sent = 0;
+	ullong received = 0;
+	ullong sentBytes = 0;
+	ullong receivedBytes = 0;
+
+	Totals(const vector<uptr<Loadgen>>& gens);
+};
+
+Totals::Totals(const vector<uptr<Loadgen>>& gens) {
+	for (const uptr<Loadgen>& it : gens) {
+		connects += it->stats.connects.load(std::memory_order_relaxed);
+		rejects += it->stats.rejects.load(std::memory_order_relaxed);
+		failures += it->stats.failures.load(std::memory_order_relaxed);
+		stalls += it->stats.stalls.load(std::memory_order_relaxed);
+		online += it->stats.online.load(std::memory_order_relaxed);
+		games += it->stats.games.load(std::memory_order_relaxed);
+		sent += it->stats.sent.load(std::memory_order_relaxed);
+		received += it->stats.received.load(std::memory_order_relaxed);
+		sentBytes += it->stats.sentBytes.load(std::memory_order_relaxed);
+		receivedBytes += it->stats.receivedBytes.load(std::memory_order_relaxed);
+	}
+}
+
+static void eventExit(int) {
+	running = false;
+}
+
+static void runThread(Loadgen* lg) {
+	try {
+		lg->run(running);
+	} catch (const std::runtime_error& err) {
+		std::cerr << "runtime error: " << err.what() << std::endl;
+		running = false;
+	}
+}
+
+static string perSecond(ullong cnt, double secs) {
+	return toStr(secs > 0.0 ? ullong(double(cnt) / secs) : cnt) + "/s";
+}
+
+static void printReport(const Totals& now, const Totals& last, uint secs) {
+	std::cout << secs << "s: " << now.online << " online, " << now.connects - last.connects << " connects, " << now.sent - last.sent << " sent, " << now.received - last.received << " received, " << now.games - last.games << " games" << std::endl;
+}
+
+static void printSummary(const vector<uptr<Loadgen>>& gens, double secs) {
+	Totals tot(gens);
+	std::cout << linend << "duration: " << toStr(secs) << 's' << linend
+		<< "connections: " << tot.connects << " (" << perSecond(tot.connects, secs) << "), rejected: " << tot.rejects << ", failed: " << tot.failures << ", stalled: " << tot.stalls << linend
+		<< "games: " << tot.games << linend
+		<< "sent: " << tot.sent << " messages (" << perSecond(tot.sent, secs) << "), " << tot.sentBytes << " bytes" << linend
+		<< "received: " << tot.received << " messages (" << perSecond(tot.received, secs) << "), " << tot.receivedBytes << " bytes" << linend;
+
+	vector<ullong> lats(Stats::latencyBuckets);
+	ullong cnt = 0;
+	for (const uptr<Loadgen>& it : gens)
+		for (uint i = 0; i < Stats::latencyBuckets; ++i) {
+			lats[i] += it->stats.latencies[i];
+			cnt += it->stats.latencies[i];
+		}
+	std::cout << "relay latency:";
+	if (!cnt) {
+		std::cout << " none" << std::endl;
+		return;
+	}
+	ullong sum = 0;
+	uint b = 0, last = 0;
+	for (uint i = 0; i < percentiles.size(); ++i) {
+		for (ullong target = ullong(double(cnt) * percentiles[i] + 0.999); sum < target; sum += lats[b++]);
+		std::cout << ' ' << percentileNames[i] << ' ' << Stats::latencyValue(b - 1) << "us";
+	}
+	for (uint i = 0; i < Stats::latencyBuckets; ++i)
+		if (lats[i])
+			last = i;
+	std::cout << " max " << Stats::latencyValue(last) << "us" << std::endl;
+}
+
+#if defined(_WIN32) && !defined(__MINGW32__)
+int wmain(int argc, wchar** argv) {
+#else
+int main(int argc, char** argv) {
+#endif
+#ifndef _WIN32
+	signal(SIGPIPE, SIG_IGN);	// a closed socket is handled by the failed send
+#endif
+	signal(SIGINT, eventExit);
+	signal(SIGTERM, eventExit);
+
+	Arguments args(argc, argv, { arg4, arg6, argIdle }, { argAddress, argPort, argBots, argThreads, argDuration, argRounds, argInterval, argBurst, argWsShare, argConnectRate, argChannels });
+	Script script;
+	const char* addr = args.getOpt(argAddress);
+	const char* port = args.getOpt(argPort);
+	int family = AF_UNSPEC;
+	if (args.hasFlag(arg4) && !args.hasFlag(arg6))
+		family = AF_INET;
+	else if (args.hasFlag(arg6) && !args.hasFlag(arg4))
+		family = AF_INET6;
+	const char* nbots = args.getOpt(argBots);
+	uint botCnt = std::max(((nbots ? uint(sstoul(nbots)) : defaultBots) + 1) & ~1u, 2u);	// bots come in pairs
+	const char* nthreads = args.getOpt(argThreads);
+	uint threadCnt = std::clamp(nthreads ? uint(sstoul(nthreads)) : 1u, 1u, std::min(maxThreads, botCnt / 2));
+	const char* duration = args.getOpt(argDuration);
+	uint secs = duration ? uint(sstoul(duration)) : defaultDuration;
+	if (const char* rounds = args.getOpt(argRounds))
+		script.rounds = std::max(uint(sstoul(rounds)), 1u);
+	if (const char* interval = args.getOpt(argInterval))
+		script.interval = uint(sstoul(interval));
+	if (const char* burst = args.getOpt(argBurst))
+		script.burst = uint(sstoul(burst));
+	if (const char* share = args.getOpt(argWsShare))
+		script.wsShare = std::min(uint(sstoul(share)), 100u);
+	if (const char* chans = args.getOpt(argChannels))
+		for (const char* pos = chans; *pos;) {
+			const char* end = std::find(pos, pos + strlen(pos), ',');
+			if (end != pos)
+				script.channels.emplace_back(pos, end);
+			pos = *end ? end + 1 : end;
+		}
+	script.idle = args.hasFlag(argIdle);
+	const char* crate = args.getOpt(argConnectRate);
+	uint connectRate = crate ? uint(sstoul(crate)) : script.connectRate * threadCnt;
+	script.connectRate = connectRate ? std::max(connectRate / threadCnt, 1u) : 0;
+
+#ifdef _WIN32
+	if (WSADATA wsad; WSAStartup(MAKEWORD(2, 2), &wsad)) {
+		std::cerr << Com::msgWinsockFail << std::endl;
+		return EXIT_FAILURE;
+	}
+#endif
+	vector<addrinfo*> infs;
+	for (const char* pos = addr ? addr : defaultAddress; *pos;) {
+		const char* end = std::find(pos, pos + strlen(pos), ',');
+		if (end != pos) {
+			addrinfo* inf = Com::resolveAddress(string(pos, end).c_str(), port ? port : Com::defaultPort, family);
+			if (!inf) {
+				std::cerr << Com::msgResolveFail << ": " << string(pos, end) << std::endl;
+				for (addrinfo* it : infs)
+					freeaddrinfo(it);
+				return EXIT_FAILURE;
+			}
+			infs.push_back(inf);
+			script.addresses.push_back(inf);
+		}
+		pos = *end ? end + 1 : end;
+	}
+	if (infs.empty()) {
+		std::cerr << Com::msgResolveFail << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (Com::raiseFileLimit(botCnt + spareFiles) < botCnt + spareFiles)
+		std::cerr << "the open file limit is too low for " << botCnt << " bots" << std::endl;
+	std::cout << "Thrones Load Generator v" << Com::commonVersion << linend << "address: " << (addr ? addr : defaultAddress) << linend << "port: " << (port ? port : Com::defaultPort) << linend << "bots: " << botCnt << " (" << script.wsShare << "% websocket" << (script.idle ? ", idle" : "") << ')' << linend << "threads: " << threadCnt << linend << "duration: " << secs << 's' << linend << "rounds per game: " << script.rounds << linend << "move interval: " << script.interval << "ms" << linend << "global messages per connection: " << script.burst << linend << "connect rate: " << (connectRate ? toStr(script.connectRate * threadCnt) + "/s" : string("unlimited")) << linend << "channels: " << (!script.channels.empty() ? toStr(script.channels.size()) : string("default only")) << linend << std::endl;
+
+	vector<uptr<Loadgen>> gens(threadCnt);
+	vector<std::thread> threads(threadCnt);
+	for (uint i = 0, first = 0; i < threadCnt; ++i) {
+		uint cnt = (botCnt / 2 / threadCnt + (i < botCnt / 2 % threadCnt)) * 2;	// keep pairs on the same thread
+		gens[i] = std::make_unique<Loadgen>(script, first, cnt);
+		first += cnt;
+	}
+	steady_clock::time_point start = steady_clock::now();
+	for (uint i = 0; i < threadCnt; ++i)
+		threads[i] = std::thread(runThread, gens[i].get());
+
+	Totals last(gens);
+	for (uint i = 1; running && (!secs || i <= secs); ++i) {
+		std::this_thread::sleep_until(start + std::chrono::seconds(i));
+		Totals now(gens);
+		printReport(now, last, i);
+		last = now;
+	}
+	running = false;
+	for (std::thread& it : threads)
+		it.join();
+	printSummary(gens, std::chrono::duration<double>(steady_clock::now() - start).count());
+	if (script.idle)
+		std::cout << "idle bots online at the end: " << last.online << " of " << botCnt << std::endl;
+	for (addrinfo* it : infs)
+		freeaddrinfo(it);
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return !script.idle || last.online == botCnt ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,6 +2,7 @@
 #include "program.h"
 #include "progs.h"
 using namespace Com;
+using std::chrono::steady_clock;
 
 // CONNECTOR
 
@@ -70,6 +71,7 @@ Netcp::~Netcp() {
 }
 
 void Netcp::connect(const Settings* sets) {
+	settings = sets;
 	connector = std::make_unique<Connector>(sets->address.c_str(), sets->port.c_str(), sets->getFamily());
 	tickproc = &Netcp::tickConnect;
 }
@@ -83,7 +85,16 @@ void Netcp::disconnect() {
 }
 
 void Netcp::tick() {
-	(this->*tickproc)();
+	bool (Netcp::*proc)() = tickproc;
+	try {
+		(this->*tickproc)();
+	} catch (const Error& err) {
+		if (!token || proc == &Netcp::tickReconnect || proc == &Netcp::tickResume)
+			throw;
+		logInfo("trying to resume after: ", err.what());
+		if (!resuming())	// a failed send might have already started it
+			startResume();
+	}
 }
 
 bool Netcp::tickConnect() {
@@ -122,104 +133,135 @@ bool Netcp::tickWait() {
 }
 
 bool Netcp::tickLobby() {
-	if (!pollSocket(sock))
-		return false;
+	return pollSocket(sock) && recvMessages(&Netcp::procLobby);
+}
+
+bool Netcp::tickGame() {
+	return pollSocket(sock) && recvMessages(&Netcp::procGame);
+}
 
+bool Netcp::recvMessages(bool (Netcp::*proc)(uint8*)) {
 	bool fin = recvb.recvData(sock.fd);
-	for (uint8* data; (data = recvb.recv(sock.fd, webs)); recvb.clearCur(webs))
-		switch (Code(data[0])) {
-		case Code::rlist:
-			prog->eventOpenLobby(data + dataHeadSize);
-			break;
-		case Code::rnew:
-			prog->getState<ProgLobby>()->addRoom(readName(data + dataHeadSize));
-			break;
-		case Code::cnrnew:
-			prog->eventHostRoomReceive(data + dataHeadSize);
-			break;
-		case Code::rerase:
-			prog->getState<ProgLobby>()->delRoom(readName(data + dataHeadSize));
-			break;
-		case Code::ropen:
-			prog->getState<ProgLobby>()->openRoom(readName(data + dataHeadSize + 1), data[dataHeadSize]);
-			break;
-		case Code::leave:
-			prog->eventRoomPlayerLeft();
-			break;
-		case Code::thost:
-			prog->eventRecvHost(true);
-			break;
-		case Code::kick:
-			prog->eventOpenLobby(data + dataHeadSize, "You got kicked");
-			break;
-		case Code::hello:
-			prog->info |= Program::INF_GUEST_WAITING;
-			prog->eventPlayerHello(true);
-			break;
-		case Code::cnjoin:
-			prog->eventJoinRoomReceive(data + dataHeadSize);
-			break;
-		case Code::config:
-			prog->eventRecvConfig(data + dataHeadSize);
-			break;
-		case Code::start:
-			prog->getGame()->recvStart(data + dataHeadSize);
-			break;
-		case Code::message: case Code::glmessage:
-			prog->eventRecvMessage(data);
-			break;
-		default:
-			throw Error("Invalid net code " + toStr(data[0]) + " of size " + toStr(read16(data + 1)));
-		}
+	if (procMessages(proc))
+		return true;
 	if (fin)
 		throw Error(msgConnectionLost);
 	return false;
 }
 
-bool Netcp::tickGame() {
-	if (!pollSocket(sock))
-		return false;
+bool Netcp::procMessages(bool (Netcp::*proc)(uint8*)) {
+	for (uint8* data; (data = recvb.recv(sock.fd, webs)); recvb.clearCur(webs)) {
+		if (Code code = Code(data[0]); token && replayable(code))
+			++recvCnt;
+		else if (code == Code::rlist || code == Code::leave || code == Code::kick)
+			token = 0;	// the room isn't full anymore
+		if ((this->*proc)(data))
+			return true;
+	}
+	return false;
+}
 
-	bool fin = recvb.recvData(sock.fd);
-	for (uint8* data; (data = recvb.recv(sock.fd, webs)); recvb.clearCur(webs))
-		switch (Code(data[0])) {
-		case Code::rlist:
-			prog->uninitGame();
-			prog->eventOpenLobby(data + dataHeadSize);
-			break;
-		case Code::leave:
-			prog->eventGamePlayerLeft();
-			break;
-		case Code::hello:
-			prog->info |= Program::INF_GUEST_WAITING;
-			break;
-		case Code::setup:
-			prog->getGame()->recvSetup(data + dataHeadSize);
-			break;
-		case Code::move:
-			prog->getGame()->recvMove(data + dataHeadSize);
-			break;
-		case Code::kill:
-			prog->getGame()->recvKill(data + dataHeadSize);
-			break;
-		case Code::breach:
-			prog->getGame()->recvBreach(data + dataHeadSize);
-			break;
-		case Code::tile:
-			prog->getGame()->recvTile(data + dataHeadSize);
-			break;
-		case Code::record:
-			if (prog->getGame()->recvRecord(data + dataHeadSize))	// it's possible that this instance gets deleted
-				return true;
-			break;
-		case Code::message:
-			prog->eventRecvMessage(data);
-			break;
-		default:
-			throw Error("Invalid net code " + toStr(data[0]) + " of size " + toStr(read16(data + 1)));
-		}
-	if (fin)
-		throw Error(msgConnectionLost);
+bool Netcp::procLobby(uint8* data) {
+	switch (Code(data[0])) {
+	case Code::rlist:
+		prog->eventOpenLobby(data + dataHeadSize);
+		break;
+	case Code::rnew:
+		prog->getState<ProgLobby>()->addRoom(readName(data + dataHeadSize));
+		break;
+	case Code::cnrnew:
+		prog->eventHostRoomReceive(data + dataHeadSize);
+		break;
+	case Code::rerase:
+		prog->getState<ProgLobby>()->delRoom(readName(data + dataHeadSize));
+		break;
+	case Code::ropen:
+		prog->getState<ProgLobby>()->openRoom(readName(data + dataHeadSize + 1), data[dataHeadSize]);
+		break;
+	case Code::rdelta:
+		prog->eventRecvRoomDelta(data);
+		break;
+	case Code::channel:
+		prog->eventRecvChannel(data + dataHeadSize);
+		break;
+	case Code::leave:
+		prog->eventRoomPlayerLeft();
+		break;
+	case Code::thost:
+		prog->eventRecvHost(true);
+		break;
+	case Code::kick:
+		prog->eventOpenLobby(data + dataHeadSize, "You got kicked");
+		break;
+	case Code::hello:
+		prog->info |= Program::INF_GUEST_WAITING;
+		prog->eventPlayerHello(true);
+		break;
+	case Code::cnjoin:
+		prog->eventJoinRoomReceive(data + dataHeadSize);
+		break;
+	case Code::config:
+		prog->eventRecvConfig(data + dataHeadSize);
+		break;
+	case Code::start:
+		prog->getGame()->recvStart(data + dataHeadSize);
+		break;
+	case Code::message: case Code::glmessage:
+		prog->eventRecvMessage(data);
+		break;
+	case Code::ping:
+		Com::sendData(sock.fd, data, read16(data + 1), webs);
+		break;
+	case Code::resume:
+		token = read64(data + dataHeadSize);
+		recvCnt = sentCnt = 0;
+		resends.clear();
+		resendBytes = 0;
+		break;
+	default:
+		throw Error("Invalid net code " + toStr(data[0]) + " of size " + toStr(read16(data + 1)));
+	}
+	return false;
+}
+
+bool Netcp::procGame(uint8* data) {
+	switch (Code(data[0])) {
+	case Code::rlist:
+		prog->uninitGame();
+		prog->eventOpenLobby(data + dataHeadSize);
+		break;
+	case Code::leave:
+		prog->eventGamePlayerLeft();
+		break;
+	case Code::hello:
+		prog->info |= Program::INF_GUEST_WAITING;
+		break;
+	case Code::setup:
+		prog->getGame()->recvSetup(data + dataHeadSize);
+		break;
+	case Code::move:
+		prog->getGame()->recvMove(data + dataHeadSize);
+		break;
+	case Code::kill:
+		prog->getGame()->recvKill(data + dataHeadSize);
+		break;
+	case Code::breach:
+		prog->getGame()->recvBreach(data + dataHeadSize);
+		break;
+	case Code::tile:
+		prog->getGame()->recvTile(data + dataHeadSize);
+		break;
+	case Code::record:
+		return prog->getGame()->recvRecord(data + dataHeadSize);	// it's possible that this instance gets deleted
+	case Code::message:
+		prog->eventRecvMessage(data);
+		break;
+	case Code::ping:
+		Com::sendData(sock.fd, data, read16(data + 1), webs);
+		break;
+	default:
+		throw Error("Invalid net code " + toStr(data[0]) + " of size " + toStr(read16(data + 1)));
+	}
 	return false;
 }
 
@@ -265,10 +307,79 @@ bool Netcp::pollSocket(pollfd& sock) {
 	return false;
 }
 
+bool Netcp::tickReconnect() {
+	steady_clock::time_point now = steady_clock::now();
+	if (now >= resumeEnd)
+		throw Error(msgConnectionLost);
+	if (!connector && now < retryTime)
+		return false;
+
+	try {
+		if (!connector)
+			connector = std::make_unique<Connector>(settings->address.c_str(), settings->port.c_str(), settings->getFamily());
+		if (nsint fd = connector->pollReady(); fd != INVALID_SOCKET) {
+			connector.reset();
+			sock.fd = fd;
+			recvb.clear();
+			sendVersionRequest();
+			tickproc = &Netcp::tickResume;
+		}
+	} catch (const Error&) {
+		connector.reset();
+		retryTime = now + retryDelay;
+	}
+	return false;
+}
+
+bool Netcp::tickResume() {
+	if (steady_clock::now() >= resumeEnd)
+		throw Error(msgConnectionLost);
+	if (!pollSocket(sock))
+		return false;
+
+	bool fin = recvb.recvData(sock.fd);
+	for (uint8* data; (data = recvb.recv(sock.fd, webs)); recvb.clearCur(webs))
+		switch (Code(data[0])) {
+		case Code::version:
+			throw Error("Server expected version " + readText(data));
+		case Code::full:
+			throw Error("Server full");
+		case Code::rlistcon: {	// skip the lobby
+			vector<uint8> req(codeSizes.at(Code::resume));
+			req[0] = uint8(Code::resume);
+			write16(req.data() + 1, req.size());
+			write64(req.data() + dataHeadSize, token);
+			write32(req.data() + dataHeadSize + sizeof(uint64), recvCnt);
+			Com::sendData(sock.fd, req.data(), req.size(), webs);
+			break; }
+		case Code::resume: {
+			uint32 got = read32(data + dataHeadSize + sizeof(uint64));
+			if (token = read64(data + dataHeadSize); !token || got > sentCnt || got < sentCnt - resends.size())
+				throw Error(msgConnectionLost);
+			for (sizet i = got - (sentCnt - resends.size()); i < resends.size(); ++i)
+				Com::sendData(sock.fd, resends[i].data(), resends[i].size(), webs);
+			logInfo("resumed session");
+			tickproc = resumeproc;
+			recvb.clearCur(webs);
+			if (procMessages(tickproc == &Netcp::tickGame ? &Netcp::procGame : &Netcp::procLobby))	// the missed messages
+				return true;
+			if (fin)
+				throw Error(msgConnectionLost);
+			return false; }
+		case Code::ping:
+			Com::sendData(sock.fd, data, read16(data + 1), webs);
+			break;
+		default:;	// lobby updates don't matter
+		}
+	if (fin)
+		throw Error(msgConnectionLost);
+	return false;
+}
+
 void Netcp::sendVersionRequest() {
 	uint8 vlen = strlen(commonVersion);
 	const string& pname = prog->getChatName();
-	vector<uint8> data(dataHeadSize + sizeof(uint8) + vlen + sizeof(uint8) + pname.length());
+	vector<uint8> data(dataHeadSize + sizeof(uint8) + vlen + sizeof(uint8) + pname.length() + sizeof(uint8));
 	data[0] = uint8(Code::version);
 	write16(data.data() + 1, data.size());
 
@@ -276,14 +387,51 @@ void Netcp::sendVersionRequest() {
 	*pos++ = vlen;
 	pos = std::copy_n(commonVersion, vlen, pos);
 	*pos++ = pname.length();
-	std::copy(pname.begin(), pname.end(), pos);
+	pos = std::copy(pname.begin(), pname.end(), pos);
+	*pos = CAP_ROOM_DELTA | CAP_PING | CAP_RESUME;
 	Com::sendData(sock.fd, data.data(), data.size(), webs);
 }
 
 void Netcp::sendData(Code code) {
 	uint8 data[dataHeadSize] = { uint8(code) };
 	write16(data + 1, dataHeadSize);
-	Com::sendData(sock.fd, data, dataHeadSize, webs);
+	sendMessages(data, dataHeadSize);
+}
+
+void Netcp::sendMessages(const uint8* data, uint len) {
+	bool kept = false;
+	for (const uint8* pos = data, *end = data + len; pos < end; pos += read16(pos + 1))
+		if (Code code = Code(*pos); token && replayable(code)) {
+			resends.emplace_back(pos, pos + read16(pos + 1));
+			resendBytes += read16(pos + 1);
+			++sentCnt;
+			kept = true;
+			for (; resendBytes > resendLimit; resends.pop_front())
+				resendBytes -= uint(resends.front().size());
+		} else if (code == Code::leave || code == Code::kick)
+			token = 0;	// the room isn't full anymore
+
+	if (resuming()) {
+		if (!kept)
+			throw Error(msgConnectionLost);
+		return;	// gets sent after the resumption
+	}
+	try {
+		Com::sendData(sock.fd, data, len, webs);
+	} catch (const Error& err) {
+		if (!kept)
+			throw;
+		logInfo("trying to resume after: ", err.what());
+		startResume();
+	}
+}
+
+void Netcp::startResume() {
+	closeSocket(sock.fd);
+	resumeproc = tickproc;
+	resumeEnd = steady_clock::now() + resumeTimeout;
+	retryTime = steady_clock::time_point();
+	tickproc = &Netcp::tickReconnect;
 }
 
 // HOST
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "server/server.h"
+#include <chrono>
+#include <deque>
 
 // tries to connect to a server
 class Connector {
@@ -21,11 +23,24 @@ private:
 // handles networking (for joining/hosting rooms on a remote sever)
 class Netcp {
 protected:
+	static constexpr uint resendLimit = 64 * 1024;	// bytes of the latest sent room messages that are kept for a resumption
+	static constexpr std::chrono::seconds resumeTimeout = std::chrono::seconds(20);	// time for getting back into the room after a disconnect
+	static constexpr std::chrono::seconds retryDelay = std::chrono::seconds(1);	// between reconnection attempts
+
 	bool (Netcp::*tickproc)() = nullptr;	// returns whether this instance was deleted
+	bool (Netcp::*resumeproc)() = nullptr;	// tickproc to continue with after a resumption
 	Com::Buffer recvb;
 	Program* prog;
+	const Settings* settings = nullptr;	// for reconnecting
 	uptr<Connector> connector;
+	std::deque<vector<uint8>> resends;	// messages to the other player of the room that might not have arrived before a disconnect
+	std::chrono::steady_clock::time_point resumeEnd;	// when to give up reconnecting
+	std::chrono::steady_clock::time_point retryTime;	// when to try to reconnect again
 	pollfd sock = { INVALID_SOCKET, POLLIN | POLLRDHUP, 0 };
+	uint64 token = 0;	// for getting back into the room after a disconnect, 0 if there's none
+	uint resendBytes = 0;
+	uint32 recvCnt = 0;	// messages from the other player since the token was issued
+	uint32 sentCnt = 0;	// messages to the other player since the token was issued
 	bool webs = false;
 
 public:
@@ -47,9 +62,18 @@ public:
 protected:
 	bool tickValidate();
 	bool tickDiscard();
+	bool tickReconnect();
+	bool tickResume();
 	static bool pollSocket(pollfd& sock);
 private:
+	bool recvMessages(bool (Netcp::*proc)(uint8*));
+	bool procMessages(bool (Netcp::*proc)(uint8*));
+	bool procLobby(uint8* data);
+	bool procGame(uint8* data);
+	void sendMessages(const uint8* data, uint len);
 	void sendVersionRequest();
+	void startResume();
+	bool resuming() const;
 };
 
 inline Netcp::Netcp(Program* program) :
@@ -57,15 +81,23 @@ inline Netcp::Netcp(Program* program) :
 {}
 
 inline void Netcp::sendData(Com::Buffer& sendb) {
-	sendb.send(sock.fd, webs);
+	sendMessages(sendb.getData(), sendb.getDlim());
+	sendb.clear();
 }
 
 inline void Netcp::sendData(const vector<uint8>& vec) {
-	Com::sendData(sock.fd, vec.data(), vec.size(), webs);
+	sendMessages(vec.data(), vec.size());
 }
 
 inline void Netcp::setTickproc(bool (Netcp::*func)()) {
-	tickproc = func;
+	if (resuming())
+		resumeproc = func;	// the state changed while reconnecting
+	else
+		tickproc = func;
+}
+
+inline bool Netcp::resuming() const {
+	return tickproc == &Netcp::tickReconnect || tickproc == &Netcp::tickResume;
 }
 
 // for running one room on self as server
@@ -312,24 +312,40 @@ void Program::eventConnLobby(const uint8* data) {
 		if (!acceptName)
 			gui.openPopupChoice("Name taken. Are you ok with " + chatName + '?', &Program::eventClosePopup, &Program::eventExitLobby);
 	}
+	if (const string& channel = World::sets()->channel; !channel.empty())
+		sendRoomName(Com::Code::channel, channel);
 }
 
 void Program::eventOpenLobby(const uint8* data, const char* message) {
-	vector<pair<string, bool>> rooms(Com::read16(data));
-	data += sizeof(uint16);
-	for (auto& [name, open] : rooms) {
-		open = *data & 0x80;
-		name = Com::readName(data, 0x7F);
-		data += name.length() + 1;
-	}
-
 	info &= ~(INF_HOST | INF_UNIQ | INF_GUEST_WAITING);
 	netcp->setTickproc(&Netcp::tickLobby);
-	setState<ProgLobby>(std::move(rooms));
+	setState<ProgLobby>(readRoomList(data));
 	if (message)
 		gui.openPopupMessage(message, &Program::eventClosePopup);
 }
 
+void Program::eventRecvRoomDelta(const uint8* data) {
+	ProgLobby* pl = getState<ProgLobby>();
+	for (const uint8* pos = data + Com::dataHeadSize + sizeof(uint32), *end = data + Com::read16(data + 1); pos < end; pos += (*pos & Com::roomDeltaLength) + 1) {
+		string name = Com::readName(pos, Com::roomDeltaLength);
+		if (*pos & Com::roomDeltaErased) {
+			if (pl->hasRoom(name))
+				pl->delRoom(name);
+		} else {
+			if (!pl->hasRoom(name))
+				pl->addRoom(string(name));
+			pl->openRoom(name, *pos & Com::roomDeltaOpen);
+		}
+	}
+}
+
+void Program::eventRecvChannel(const uint8* data) {
+	if (*data)
+		getState<ProgLobby>()->setRooms(readRoomList(data + 1));	// keeps a possible name popup open
+	else
+		gui.openPopupMessage("Channel " + World::sets()->channel + " not available", &Program::eventClosePopup);
+}
+
 void Program::eventHostRoomInput(Button*) {
 	gui.openPopupInput("Name:", chatName + "'s room", &Program::eventHostRoomRequest, Com::roomNameLimit);
 }
@@ -378,6 +394,17 @@ void Program::eventJoinRoomReceive(const uint8* data) {
 		gui.openPopupMessage("Failed to join room", &Program::eventClosePopup);
 }
 
+vector<pair<string, bool>> Program::readRoomList(const uint8* data) {
+	vector<pair<string, bool>> rooms(Com::read16(data));
+	data += sizeof(uint16);
+	for (auto& [name, open] : rooms) {
+		open = *data & 0x80;
+		name = Com::readName(data, 0x7F);
+		data += name.length() + 1;
+	}
+	return rooms;
+}
+
 void Program::sendRoomName(Com::Code code, const string& name) {
 	vector<uint8> data(Com::dataHeadSize + 1 + name.length());
 	data[0] = uint8(code);
@@ -107,6 +107,8 @@ public:
 	// lobby menu
 	void eventConnLobby(const uint8* data);
 	void eventOpenLobby(const uint8* data, const char* message = nullptr);
+	void eventRecvRoomDelta(const uint8* data);
+	void eventRecvChannel(const uint8* data);
 	void eventHostRoomInput(Button* but = nullptr);
 	void eventHostRoomRequest(Button* but = nullptr);
 	void eventHostRoomReceive(const uint8* data);
@@ -294,6 +296,7 @@ private:
 	void populateSetup(Setup& setup);
 	void playGameStartAnimations() const;
 	Piece* getUnplacedDragon();
+	static vector<pair<string, bool>> readRoomList(const uint8* data);
 	static string winMessage(Record::Info win);
 	void executeRecordAction(const RecAction& action);
 	void setShadowRes(uint16 newRes);
@@ -261,7 +261,7 @@ ProgLobby::ProgLobby(vector<pair<string, bool>>&& roomList) :
 	ProgState(),
 	roomBuff(std::move(roomList))
 {
-	std::sort(roomBuff.begin(), roomBuff.end(), [](pair<string, bool>& a, pair<string, bool>& b) -> bool { return strnatless(a.first, b.first); });
+	sortRooms(roomBuff);
 }
 
 void ProgLobby::eventEscape() {
@@ -303,10 +303,22 @@ bool ProgLobby::hasRoom(const string& name) const {
 	return findRoom(name) < rooms->getWidgets().size();
 }
 
+void ProgLobby::setRooms(vector<pair<string, bool>>&& roomList) {
+	sortRooms(roomList);
+	vector<Widget*> lns(roomList.size());
+	for (sizet i = 0; i < roomList.size(); ++i)
+		lns[i] = World::pgui()->createRoom(std::move(roomList[i].first), roomList[i].second);
+	rooms->setWidgets(std::move(lns));
+}
+
 sizet ProgLobby::findRoom(const string& name) const {
 	return std::find_if(rooms->getWidgets().begin(), rooms->getWidgets().end(), [name](const Widget* rm) -> bool { return static_cast<const Label*>(rm)->getText() == name; }) - rooms->getWidgets().begin();
 }
 
+void ProgLobby::sortRooms(vector<pair<string, bool>>& roomList) {
+	std::sort(roomList.begin(), roomList.end(), [](pair<string, bool>& a, pair<string, bool>& b) -> bool { return strnatless(a.first, b.first); });
+}
+
 // PROG ROOM
 
 ProgRoom::ProgRoom() :
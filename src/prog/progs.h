@@ -140,8 +140,10 @@ public:
 	void delRoom(const string& name);
 	void openRoom(const string& name, bool open);
 	bool hasRoom(const string& name) const;
+	void setRooms(vector<pair<string, bool>>&& roomList);
 private:
 	 sizet findRoom(const string& name) const;
+	static void sortRooms(vector<pair<string, bool>>& roomList);
 };
 
 class ProgRoom : public ProgState {
@@ -0,0 +1,269 @@
+#include "handoff.h"
+#include "utils/text.h"
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+using namespace Com;
+
+constexpr char msgHandoffFail[] = "Failed to hand over";
+
+// SNAPSHOT
+
+void Snapshot::push(const string& str) {
+	push(uint32(str.length()));
+	data.insert(data.end(), str.begin(), str.end());
+}
+
+void Snapshot::push(const vector<uint8>& vec) {
+	push(uint32(vec.size()));
+	data.insert(data.end(), vec.begin(), vec.end());
+}
+
+string Snapshot::popString() {
+	uint32 len = pop<uint32>();
+	return string(reinterpret_cast<const char*>(popRaw(len)), len);
+}
+
+vector<uint8> Snapshot::popBytes() {
+	uint32 len = pop<uint32>();
+	const uint8* dat = popRaw(len);
+	return vector<uint8>(dat, dat + len);
+}
+
+const uint8* Snapshot::popRaw(sizet len) {
+	if (data.size() - pos < len)
+		throw Error(msgHandoffData);
+	pos += len;
+	return data.data() + pos - len;
+}
+
+// HANDOFF
+
+#ifndef _WIN32
+static sockaddr_un handoffAddress(const string& path) {
+	sockaddr_un addr{};
+	if (path.length() >= sizeof(addr.sun_path))
+		throw Error("Handoff path too long");
+	addr.sun_family = AF_UNIX;
+	std::copy(path.begin(), path.end(), addr.sun_path);
+	return addr;
+}
+
+static bool sameUser(nsint fd) {	// the other process can take over every player, so it has to be run by the same user
+#ifdef SO_PEERCRED
+	ucred cred;
+	socklen_t len = sizeof(cred);
+	return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.uid == geteuid();
+#else
+	uid_t uid;
+	gid_t gid;
+	return !getpeereid(fd, &uid, &gid) && uid == geteuid();
+#endif
+}
+
+static void setTimeout(nsint fd, uint seconds) {
+	timeval tv = { time_t(seconds), 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void sendAll(nsint fd, const uint8* data, sizet len) {
+	for (sizet ofs = 0; ofs < len;) {
+		long cnt = ::send(fd, data + ofs, len - ofs, 0);
+		if (cnt <= 0) {
+			if (cnt < 0 && errno == EINTR)
+				continue;
+			throw Error(msgHandoffFail);
+		}
+		ofs += sizet(cnt);
+	}
+}
+
+static void recvAll(nsint fd, uint8* data, sizet len) {
+	for (sizet ofs = 0; ofs < len;) {
+		long cnt = ::recv(fd, data + ofs, len - ofs, 0);
+		if (cnt <= 0) {
+			if (cnt < 0 && errno == EINTR)
+				continue;
+			throw Error(cnt ? msgHandoffFail : "Handoff rejected");
+		}
+		ofs += sizet(cnt);
+	}
+}
+
+static void recvSockets(nsint fd, vector<nsint>& fds, uint limit) {
+	uint8 byte;
+	iovec iov = { &byte, sizeof(byte) };
+	vector<uint8> control(CMSG_SPACE(sizeof(int) * limit));
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+	long len;
+	while ((len = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR);
+	if (len <= 0)
+		throw Error(msgHandoffFail);
+
+	for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+			for (sizet i = 0, cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int); i < cnt; ++i)
+				fds.push_back(readMem<int>(CMSG_DATA(cm) + i * sizeof(int)));
+	if (msg.msg_flags & MSG_CTRUNC)
+		throw Error(msgHandoffData);
+}
+
+bool Handoff::receive(const char* file, vector<uint8>& state, vector<nsint>& fds) {
+	path = file;
+	sockaddr_un addr = handoffAddress(path);
+	nsint fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == INVALID_SOCKET)
+		throw Error(msgHandoffFail);
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+		int err = errno;
+		closeSocketV(fd);
+		if (err == ENOENT || err == ECONNREFUSED)	// no server or a stale file
+			return false;
+		throw Error(msgHandoffFail);
+	}
+
+	setTimeout(fd, timeout);
+	try {
+		if (!sameUser(fd))
+			throw Error("Handoff file belongs to another user");
+		uint8 head[sizeof(uint32) * 2 + sizeof(uint64)];	// version, number of sockets, size of the state
+		write32(head, version);
+		sendAll(fd, head, sizeof(uint32));
+		recvAll(fd, head, sizeof(head));
+		if (read32(head) != version)
+			throw Error(msgHandoffData);
+		uint32 cnt = read32(head + sizeof(uint32));
+		state.resize(read64(head + sizeof(uint32) * 2));
+		recvAll(fd, state.data(), state.size());
+		while (fds.size() < cnt)
+			recvSockets(fd, fds, std::min(cnt - uint(fds.size()), socketBatch));
+		if (fds.size() != cnt)
+			throw Error(msgHandoffData);
+	} catch (const Error&) {
+		for (nsint it : fds)
+			closeSocketV(it);
+		fds.clear();
+		closeSocketV(fd);
+		throw;
+	}
+	closeSocketV(fd);
+	return true;
+}
+
+void Handoff::listen() {
+	sockaddr_un addr = handoffAddress(path);
+	unlink(path.c_str());	// the previous server's file or a stale one
+	if (listener = socket(AF_UNIX, SOCK_STREAM, 0); listener == INVALID_SOCKET)
+		throw Error(msgHandoffFail);
+	if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || chmod(path.c_str(), S_IRUSR | S_IWUSR) || ::listen(listener, 1) || noblockSocket(listener, true)) {	// nobody else can connect before the file is private
+		closeSocket(listener);
+		throw Error(msgBindFail);
+	}
+}
+
+nsint Handoff::accept() {
+	nsint conn = ::accept(listener, nullptr, nullptr);
+	if (conn == INVALID_SOCKET)
+		return INVALID_SOCKET;
+	if (!sameUser(conn)) {
+		closeSocketV(conn);
+		throw Error("Rejected handoff from another user");
+	}
+	if (noblockSocket(conn, true)) {
+		closeSocketV(conn);
+		throw Error(msgIoctlFail);
+	}
+	requestLen = 0;
+	return conn;
+}
+
+bool Handoff::recvRequest(nsint conn) {
+	while (requestLen < sizeof(request)) {
+		long cnt = ::recv(conn, request + requestLen, sizeof(request) - requestLen, 0);
+		if (cnt < 0 && errno == EINTR)
+			continue;
+		if (cnt < 0 && wouldBlock())
+			return false;
+		if (cnt <= 0)
+			throw Error(msgHandoffFail);
+		requestLen += uint(cnt);
+	}
+	if (read32(request) != version)
+		throw Error("Incompatible handoff version " + toStr(read32(request)));
+	if (noblockSocket(conn, false))	// the transfer itself blocks with a timeout after the workers have stopped
+		throw Error(msgIoctlFail);
+	setTimeout(conn, timeout);
+	return true;
+}
+
+void Handoff::send(nsint conn, const vector<uint8>& state, const vector<nsint>& fds) {
+	try {
+		uint8 head[sizeof(uint32) * 2 + sizeof(uint64)];
+		write32(head, version);
+		write32(head + sizeof(uint32), uint32(fds.size()));
+		write64(head + sizeof(uint32) * 2, state.size());
+		sendAll(conn, head, sizeof(head));
+		sendAll(conn, state.data(), state.size());
+		for (sizet i = 0; i < fds.size(); i += socketBatch) {
+			uint cnt = uint(std::min(fds.size() - i, sizet(socketBatch)));
+			uint8 byte = 0;
+			iovec iov = { &byte, sizeof(byte) };
+			vector<uint8> control(CMSG_SPACE(sizeof(int) * cnt));
+			msghdr msg{};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control.data();
+			msg.msg_controllen = control.size();
+			cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(int) * cnt);
+			for (uint j = 0; j < cnt; ++j)
+				writeMem(CMSG_DATA(cm) + j * sizeof(int), int(fds[i+j]));
+			long len;
+			while ((len = sendmsg(conn, &msg, 0)) < 0 && errno == EINTR);
+			if (len != sizeof(byte))
+				throw Error(msgHandoffFail);
+		}
+	} catch (const Error&) {
+		closeSocketV(conn);
+		throw;
+	}
+	closeSocketV(conn);
+}
+
+void Handoff::close(bool handedOver) {
+	if (listener != INVALID_SOCKET) {
+		closeSocket(listener);
+		if (!handedOver)
+			unlink(path.c_str());
+	}
+}
+#else
+bool Handoff::receive(const char*, vector<uint8>&, vector<nsint>&) {
+	return false;
+}
+
+void Handoff::listen() {}
+
+nsint Handoff::accept() {
+	return INVALID_SOCKET;
+}
+
+bool Handoff::recvRequest(nsint) {
+	throw Error(msgHandoffFail);
+}
+
+void Handoff::send(nsint conn, const vector<uint8>&, const vector<nsint>&) {
+	closeSocketV(conn);
+	throw Error(msgHandoffFail);
+}
+
+void Handoff::close(bool) {}
+#endif
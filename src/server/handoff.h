@@ -0,0 +1,80 @@
+#pragma once
+
+#include "server.h"
+#include <type_traits>
+
+constexpr char msgHandoffData[] = "Invalid handoff data";
+
+// serialized state of a server in native byte order, since it only goes to another process on the same machine
+class Snapshot {
+private:
+	vector<uint8> data;
+	sizet pos = 0;	// read position
+
+public:
+	Snapshot() = default;
+	Snapshot(vector<uint8>&& dat);
+
+	vector<uint8>& getData();
+	template <class T> void push(const T& val);
+	void push(const string& str);
+	void push(const vector<uint8>& vec);
+	template <class T> T pop();	// throws Error if there isn't enough data left
+	string popString();
+	vector<uint8> popBytes();
+private:
+	const uint8* popRaw(sizet len);
+};
+
+inline Snapshot::Snapshot(vector<uint8>&& dat) :
+	data(std::move(dat))
+{}
+
+inline vector<uint8>& Snapshot::getData() {
+	return data;
+}
+
+template <class T>
+void Snapshot::push(const T& val) {
+	static_assert(std::is_trivially_copyable_v<T>);
+	data.resize(data.size() + sizeof(T));
+	writeMem(data.data() + data.size() - sizeof(T), val);
+}
+
+template <class T>
+T Snapshot::pop() {
+	static_assert(std::is_trivially_copyable_v<T>);
+	return readMem<T>(popRaw(sizeof(T)));
+}
+
+// passes the listening and player sockets of a running server with a snapshot of its state to a new server process over a unix domain socket
+class Handoff {
+public:
+	static constexpr uint32 version = 1;	// of the snapshot format, which both processes need to agree on
+#ifdef _WIN32
+	static constexpr bool supported = false;
+#else
+	static constexpr bool supported = true;
+#endif
+private:
+	static constexpr uint socketBatch = 250;	// sockets per message, since Linux doesn't take more than 253
+	static constexpr uint timeout = 10;	// seconds a transfer may stall
+
+	string path;
+	nsint listener = INVALID_SOCKET;
+	uint8 request[sizeof(uint32)];	// version of the new server that's being read without blocking
+	uint requestLen = 0;
+
+public:
+	bool receive(const char* file, vector<uint8>& state, vector<nsint>& fds);	// takes over from the server that listens on file and returns false if there's none
+	void listen();	// on the file that was passed to receive for the next server, which only the same user can connect to
+	nsint accept();	// returns a non-blocking connection from a new server of the same user or INVALID_SOCKET if there's none and throws Error if it belongs to someone else
+	bool recvRequest(nsint conn);	// reads the new server's version without blocking, returns true once it's there and the connection is ready for send and throws Error if it's incompatible or gone
+	void send(nsint conn, const vector<uint8>& state, const vector<nsint>& fds);	// closes conn
+	void close(bool handedOver);	// the file stays when it belongs to the new server
+	nsint getListener() const;
+};
+
+inline nsint Handoff::getListener() const {
+	return listener;
+}
@@ -19,6 +19,103 @@ void Log::start(bool logStd, const char* logDir, uint maxLogs) {
 		createDirectories(dir);
 		openFile(DateTime::now());
 	}
+	if (verbose || !dir.empty()) {
+		ring = std::make_unique<Record[]>(ringSize);
+		for (uint i = 0; i < ringSize; ++i)
+			ring[i].seq.store(i, std::memory_order_relaxed);
+		running = true;
+		thread = std::thread(&Log::run, this);
+	}
+}
+
+void Log::end() {
+	running = false;
+	if (thread.joinable())
+		thread.join();
+	lfile.close();
+}
+
+void Log::push(bool error, const string& line) {
+	uint pos = head.load(std::memory_order_relaxed);
+	Record* rec;
+	for (;;) {
+		rec = &ring[pos & (ringSize - 1)];
+		if (int dif = int(rec->seq.load(std::memory_order_acquire) - pos); !dif) {
+			if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (dif < 0) {	// the writer hasn't freed the slot yet, so the ring is full
+			drops.fetch_add(1, std::memory_order_relaxed);
+			return;
+		} else
+			pos = head.load(std::memory_order_relaxed);
+	}
+	rec->time = time(nullptr);
+	rec->error = error;
+	rec->len = uint16(std::min(line.length(), sizet(recordText)));
+	std::copy_n(line.data(), rec->len, rec->text);
+	rec->seq.store(pos + 1, std::memory_order_release);
+}
+
+void Log::run() {
+	string out, err, file, stamp;
+	time_t lastTime = 0;
+	ullong reported = 0;
+	for (bool live = true; live;) {
+		live = running.load();	// one more round after end to write what's left
+		uint cnt = 0;
+		for (; cnt < ringSize; ++cnt, ++tail) {
+			Record& rec = ring[tail & (ringSize - 1)];
+			if (rec.seq.load(std::memory_order_acquire) != tail + 1)
+				break;
+			if (verbose) {
+				string& dst = rec.error ? err : out;
+				dst.append(rec.text, rec.len);
+				dst += linend;
+			}
+			if (!dir.empty()) {
+				if (rec.time != lastTime) {	// only convert the time once per second
+					DateTime now = DateTime::fromTime(rec.time);
+					if (!now.datecmp(lastLog)) {
+						if (lfile.good())
+							lfile.write(file.data(), std::streamsize(file.length()));
+						file.clear();
+						lfile.close();
+						openFile(now);
+					}
+					lastTime = rec.time;
+					stamp = now.timeString() + ' ';
+				}
+				file += stamp;
+				file.append(rec.text, rec.len);
+				file += linend;
+			}
+			rec.seq.store(tail + ringSize, std::memory_order_release);
+		}
+		if (ullong dcnt = drops.load(std::memory_order_relaxed); dcnt != reported) {
+			string msg = "dropped " + toStr(dcnt - reported) + " log lines" + linend;
+			reported = dcnt;
+			if (verbose)
+				err += msg;
+			if (!dir.empty())
+				file += stamp + msg;
+		}
+
+		if (!out.empty()) {
+			std::cout.write(out.data(), std::streamsize(out.length())).flush();
+			out.clear();
+		}
+		if (!err.empty()) {
+			std::cerr.write(err.data(), std::streamsize(err.length())).flush();
+			err.clear();
+		}
+		if (!file.empty()) {
+			if (lfile.good())
+				lfile.write(file.data(), std::streamsize(file.length())).flush();
+			file.clear();
+		}
+		if (!cnt && live)
+			std::this_thread::sleep_for(std::chrono::milliseconds(idleSleep));
+	}
 }
 
 void Log::openFile(const DateTime& now) {
@@ -1,59 +1,95 @@
 #pragma once
 
 #include "utils/text.h"
+#include <atomic>
 #include <iostream>
 #include <fstream>
+#include <thread>
 
-// for simultaneous console and file output
+// for simultaneous console and file output, lines are formatted by the caller and written by a background thread
 class Log {
 public:
 	static constexpr uint defaultMaxLogfiles = 8;
 private:
 	static constexpr char filePrefix[] = "thrones_log_";
+	static constexpr uint ringSize = 2048;	// must be a power of two
+	static constexpr uint recordText = 500;	// longer lines get cut off
+	static constexpr uint idleSleep = 20;	// milliseconds the writer waits when there's nothing to write
+
+	// preformatted line in the ring, seq tells whose turn it is to use the slot
+	struct Record {
+		std::atomic<uint> seq;
+		time_t time;
+		uint16 len;
+		bool error;
+		char text[recordText];
+	};
 
 	string dir;
 	std::ofstream lfile;
+	uptr<Record[]> ring;
+	std::atomic<uint> head = 0;	// next slot to write to for the producers
+	uint tail = 0;	// next slot to read from for the writer
+	std::atomic<ullong> drops = 0;	// lines that didn't fit into the ring
+	std::atomic<bool> running = false;
+	std::thread thread;
 	DateTime lastLog;
 	uint maxLogfiles;
 	bool verbose;
 
 public:
+	~Log();
+
 	void start(bool logStd, const char* logDir, uint maxLogs);
-	void end();
+	void end();	// writes everything that's left
 
 	template <class... A> void out(A&&... args);
 	template <class... A> void err(A&&... args);
+	ullong dropped() const;
 private:
-	template <class... A> void write(std::ostream& vofs, A&&... args);
+	template <class... A> void write(bool error, A&&... args);
+	template <class T> static void append(string& str, const T& val);
+	void push(bool error, const string& line);
+	void run();
 	void openFile(const DateTime& now);
 	vector<string> listLogs() const;
 };
 
-inline void Log::end() {
-	lfile.close();
+inline Log::~Log() {
+	end();
+}
+
+inline ullong Log::dropped() const {
+	return drops.load(std::memory_order_relaxed);
 }
 
 template <class... A>
 void Log::out(A&&... args) {
-	write(std::cout, std::forward<A>(args)...);
+	write(false, std::forward<A>(args)...);
 }
 
 template <class... A>
 void Log::err(A&&... args) {
-	write(std::cerr, std::forward<A>(args)...);
+	write(true, std::forward<A>(args)...);
 }
 
 template <class... A>
-void Log::write(std::ostream& vofs, A&&... args) {
-	if (verbose)
-		(vofs << ... << args) << std::endl;
-	if (!dir.empty()) {
-		DateTime now = DateTime::now();
-		if (!now.datecmp(lastLog)) {
-			lfile.close();
-			openFile(now);
-		}
-		if (lfile.good())
-			((lfile << now.timeString() << ' ') << ... << std::forward<A>(args)) << std::endl;
-	}
+void Log::write(bool error, A&&... args) {
+	if (!running.load(std::memory_order_relaxed))
+		return;
+
+	static thread_local string line;
+	line.clear();
+	(append(line, args), ...);
+	push(error, line);
+}
+
+template <class T>
+void Log::append(string& str, const T& val) {
+	if constexpr (std::is_same_v<T, char>)
+		str += val;
+	else if constexpr (std::is_arithmetic_v<T>)
+		str += toStr(val);
+	else
+		str += val;
 }
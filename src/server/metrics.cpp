@@ -0,0 +1,177 @@
+#include "metrics.h"
+#include "utils/text.h"
+#include <chrono>
+#ifndef _WIN32
+#include <sys/un.h>
+#endif
+
+using std::chrono::steady_clock;
+
+constexpr int acceptTimeout = 500;	// how often the thread checks whether to stop
+constexpr int requestTimeout = 1000;	// for receiving a whole request and sending the answer
+constexpr uint requestMax = 2048;
+constexpr char contentType[] = "text/plain; version=0.0.4";
+
+// HISTOGRAM
+
+void Histogram::observe(ullong val) {
+	uint id = 0;
+	for (; id < bucketCnt && val > bound(id); ++id);
+	counts[id].store(counts[id].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);	// no need for an atomic increment with only one writer
+	sum.store(sum.load(std::memory_order_relaxed) + val, std::memory_order_relaxed);
+}
+
+void Histogram::addTo(Total& total) const {
+	for (uint i = 0; i <= bucketCnt; ++i)
+		total.counts[i] += counts[i].load(std::memory_order_relaxed);
+	total.sum += sum.load(std::memory_order_relaxed);
+}
+
+// METRICS SERVER
+
+void MetricsServer::start(const string& location, CollectCall call) {
+	collect = call;
+	addr = location;
+#ifndef _WIN32
+	if (unixFile = addr.find('/') != string::npos; unixFile) {
+		sockaddr_un sa{};
+		if (addr.length() >= sizeof(sa.sun_path))
+			throw Com::Error(Com::msgBindFail);
+		sa.sun_family = AF_UNIX;
+		std::copy(addr.begin(), addr.end(), sa.sun_path);
+		unlink(sa.sun_path);	// a leftover from a previous run would block the bind
+		if (server = socket(AF_UNIX, SOCK_STREAM, 0); server == INVALID_SOCKET)
+			throw Com::Error(Com::msgBindFail);
+		if (bind(server, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) || listen(server, 8)) {
+			Com::closeSocket(server);
+			throw Com::Error(Com::msgBindFail);
+		}
+	} else
+#endif
+	{
+		sockaddr_in sa{};
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(uint16(sstoul(addr)));
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);	// not meant to be reachable from outside
+		if (server = Com::createSocket(AF_INET, 1); server == INVALID_SOCKET)
+			throw Com::Error(Com::msgBindFail);
+		if (bind(server, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) || listen(server, 8)) {
+			Com::closeSocket(server);
+			throw Com::Error(Com::msgBindFail);
+		}
+	}
+	running = true;
+	thread = std::thread(&MetricsServer::run, this);
+}
+
+void MetricsServer::end() {
+	running = false;
+	if (thread.joinable())
+		thread.join();
+	if (server != INVALID_SOCKET) {
+		Com::closeSocket(server);
+#ifndef _WIN32
+		if (unixFile)
+			unlink(addr.c_str());
+#endif
+	}
+}
+
+void MetricsServer::run() {
+	while (running) {
+		pollfd pfd = { server, POLLIN, 0 };
+		if (poll(&pfd, 1, acceptTimeout) <= 0 || !(pfd.revents & POLLIN))
+			continue;
+		if (nsint fd = accept(server, nullptr, nullptr); fd != INVALID_SOCKET) {
+			answer(fd);
+			Com::closeSocketV(fd);
+		}
+	}
+}
+
+static bool waitSocket(nsint fd, short events, steady_clock::time_point deadline) {	// returns false if the socket isn't ready before the deadline
+	long left = long(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - steady_clock::now()).count());
+	pollfd pfd = { fd, events, 0 };
+	return left > 0 && poll(&pfd, 1, int(left)) > 0;
+}
+
+void MetricsServer::answer(nsint fd) {
+	if (Com::noblockSocket(fd, true))	// so that a client that stops reading can't block the thread
+		return;
+	steady_clock::time_point deadline = steady_clock::now() + std::chrono::milliseconds(requestTimeout);	// one for the whole exchange, so that a trickling client can't hold the thread either
+	string req;
+	for (char buf[512]; req.find("\r\n\r\n") == string::npos && req.length() < requestMax;) {
+		if (!waitSocket(fd, POLLIN, deadline))
+			return;
+		long len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0 && Com::wouldBlock())
+			continue;
+		if (len <= 0)
+			return;
+		req.append(buf, len);
+	}
+
+	string body, status = "200 OK";
+	if (sizet pos = req.find(' '); pos == string::npos || req.compare(0, pos, "GET"))
+		status = "405 Method Not Allowed";
+	else if (string target = req.substr(pos + 1, req.find_first_of(" ?\r", pos + 1) - pos - 1); target != "/" && target != "/metrics")
+		status = "404 Not Found";
+	else
+		collect(body);
+	string res = "HTTP/1.0 " + status + "\r\nContent-Type: " + contentType + "\r\nContent-Length: " + toStr(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
+	for (sizet ofs = 0; ofs < res.length();) {
+		if (!waitSocket(fd, POLLOUT, deadline))
+			return;
+		long len = send(fd, res.data() + ofs, int(res.length() - ofs), 0);
+		if (len < 0 && Com::wouldBlock())
+			continue;
+		if (len <= 0)
+			return;
+		ofs += len;
+	}
+}
+
+void MetricsServer::writeHead(string& out, const char* name, const char* type, const char* help) {
+	out += "# HELP ";
+	out += name;
+	out += ' ';
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += ' ';
+	out += type;
+	out += '\n';
+}
+
+void MetricsServer::writeValue(string& out, const char* name, ullong val, const char* labels) {
+	out += name;
+	if (labels) {
+		out += '{';
+		out += labels;
+		out += '}';
+	}
+	out += ' ';
+	out += toStr(val);
+	out += '\n';
+}
+
+static string microsToSeconds(ullong val) {
+	string frac = toStr(val % 1000000, 6);
+	frac.erase(frac.find_last_not_of('0') + 1);
+	return frac.empty() ? toStr(val / 1000000) : toStr(val / 1000000) + '.' + frac;
+}
+
+void MetricsServer::writeHistogram(string& out, const char* name, const char* help, const Histogram::Total& hist, bool micros) {
+	writeHead(out, name, "histogram", help);
+	string bucket = name + string("_bucket");
+	ullong cnt = 0;
+	for (uint i = 0; i < Histogram::bucketCnt; ++i) {
+		cnt += hist.counts[i];
+		writeValue(out, bucket.c_str(), cnt, ("le=\"" + (micros ? microsToSeconds(Histogram::bound(i)) : toStr(Histogram::bound(i))) + '"').c_str());
+	}
+	cnt += hist.counts[Histogram::bucketCnt];
+	writeValue(out, bucket.c_str(), cnt, "le=\"+Inf\"");
+	out += name;
+	out += micros ? "_sum " + microsToSeconds(hist.sum) + '\n' : "_sum " + toStr(hist.sum) + '\n';
+	writeValue(out, (name + string("_count")).c_str(), cnt);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "server.h"
+#include <atomic>
+#include <thread>
+
+// cumulative histogram with power of 4 bucket bounds that's only written by one thread
+class Histogram {
+public:
+	static constexpr uint bucketCnt = 12;	// the bounds go from 1 to about 4 million, the last bucket has no upper bound
+
+	// summed up values of multiple histograms
+	struct Total {
+		array<ullong, bucketCnt + 1> counts{};
+		ullong sum = 0;
+	};
+
+private:
+	array<std::atomic<ullong>, bucketCnt + 1> counts{};
+	std::atomic<ullong> sum = 0;
+
+public:
+	static constexpr ullong bound(uint id);
+	void observe(ullong val);
+	void addTo(Total& total) const;
+};
+
+constexpr ullong Histogram::bound(uint id) {
+	return 1ull << (id * 2);
+}
+
+// serves prometheus text to local scrapers on a separate thread, so that a slow client can't hold up a worker
+class MetricsServer {
+public:
+	using CollectCall = void (*)(string&);
+
+private:
+	std::thread thread;
+	std::atomic<bool> running = false;
+	nsint server = INVALID_SOCKET;
+	string addr;
+	bool unixFile = false;	// addr is a socket file that has to be removed at the end
+	CollectCall collect = nullptr;
+
+public:
+	~MetricsServer();
+
+	void start(const string& location, CollectCall call);	// location is either a port on the loopback interface or a unix socket file
+	void end();
+	const string& address() const;
+
+	static void writeHead(string& out, const char* name, const char* type, const char* help);
+	static void writeValue(string& out, const char* name, ullong val, const char* labels = nullptr);
+	static void writeHistogram(string& out, const char* name, const char* help, const Histogram::Total& hist, bool micros);	// micros converts microseconds to seconds
+private:
+	void run();
+	void answer(nsint fd);
+};
+
+inline MetricsServer::~MetricsServer() {
+	end();
+}
+
+inline const string& MetricsServer::address() const {
+	return addr;
+}
@@ -0,0 +1,107 @@
+#include "poller.h"
+
+#ifdef __linux__
+void Poller::start() {
+	if (efd = epoll_create1(EPOLL_CLOEXEC); efd == -1)
+		throw Com::Error(Com::msgPollFail);
+	ready.reserve(maxReady);
+}
+
+void Poller::end() {
+	if (efd != -1) {
+		close(efd);
+		efd = -1;
+	}
+}
+
+void Poller::add(nsint fd, void* udata, bool out) {
+	epoll_event ev;
+	ev.events = out ? EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET : EPOLLIN | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = udata;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev))
+		throw Com::Error(Com::msgPollFail);
+}
+
+void Poller::del(nsint fd) {
+	epoll_ctl(efd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void Poller::setOut(nsint, bool) {}
+
+const vector<Poller::Ready>& Poller::wait(int timeout) {
+	ready.clear();
+	int cnt = epoll_wait(efd, evs.data(), evs.size(), timeout);
+	if (cnt < 0 && errno != EINTR)
+		throw Com::Error(Com::msgPollFail);
+
+	for (int i = 0; i < cnt; ++i) {
+		uint8 events = 0;
+		if (evs[i].events & EPOLLIN)
+			events |= EV_IN;
+		if (evs[i].events & EPOLLOUT)
+			events |= EV_OUT;
+		if (evs[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+			events |= EV_DISCONNECT;
+		ready.push_back({ evs[i].data.ptr, events });
+	}
+	return ready;
+}
+#else
+void Poller::start() {
+	ready.reserve(maxReady);
+}
+
+void Poller::end() {
+	pfds.clear();
+	udatas.clear();
+	ids.clear();
+}
+
+void Poller::add(nsint fd, void* udata, bool) {
+	ids.emplace(fd, pfds.size());
+	pfds.push_back({ fd, POLLIN | POLLRDHUP, 0 });
+	udatas.push_back(udata);
+}
+
+void Poller::del(nsint fd) {
+	umap<nsint, uint>::iterator it = ids.find(fd);
+	if (it == ids.end())
+		return;
+
+	uint id = it->second;
+	ids.erase(it);
+	if (id != pfds.size() - 1) {	// swap with the last entry to keep removal O(1)
+		pfds[id] = pfds.back();
+		udatas[id] = udatas.back();
+		ids[pfds[id].fd] = id;
+	}
+	pfds.pop_back();
+	udatas.pop_back();
+}
+
+void Poller::setOut(nsint fd, bool on) {
+	if (umap<nsint, uint>::iterator it = ids.find(fd); it != ids.end())
+		pfds[it->second].events = on ? POLLIN | POLLOUT | POLLRDHUP : POLLIN | POLLRDHUP;
+}
+
+const vector<Poller::Ready>& Poller::wait(int timeout) {
+	ready.clear();
+	int cnt = poll(pfds.data(), ulong(pfds.size()), timeout);
+	if (cnt < 0 && errno != EINTR)
+		throw Com::Error(Com::msgPollFail);
+
+	for (uint i = 0; cnt > 0 && i < pfds.size(); ++i)
+		if (pfds[i].revents) {
+			uint8 events = 0;
+			if (pfds[i].revents & POLLIN)
+				events |= EV_IN;
+			if (pfds[i].revents & POLLOUT)
+				events |= EV_OUT;
+			if (pfds[i].revents & polleventsDisconnect)
+				events |= EV_DISCONNECT;
+			ready.push_back({ udatas[i], events });
+			--cnt;
+		}
+	return ready;
+}
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "server.h"
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+// socket readiness notification (edge-triggered epoll on Linux, level-triggered poll elsewhere, so callers must always drain a ready socket)
+class Poller {
+public:
+	enum Event : uint8 {
+		EV_IN = 0x1,
+		EV_DISCONNECT = 0x2,
+		EV_OUT = 0x4
+	};
+
+	struct Ready {
+		void* udata;	// pointer that was passed to add
+		uint8 events;
+	};
+
+private:
+	static constexpr uint maxReady = 256;
+
+#ifdef __linux__
+	int efd = -1;
+	array<epoll_event, maxReady> evs;
+#else
+	vector<pollfd> pfds;
+	vector<void*> udatas;
+	umap<nsint, uint> ids;	// socket, index in pfds
+#endif
+	vector<Ready> ready;
+
+public:
+	void start();
+	void end();
+
+	void add(nsint fd, void* udata, bool out = false);	// out enables EV_OUT notifications
+	void del(nsint fd);
+	void setOut(nsint fd, bool on);	// only needed by level-triggered polling, epoll always reports EV_OUT edges if enabled in add
+	const vector<Ready>& wait(int timeout);	// returns an empty list on timeout or signal interruption
+};
@@ -0,0 +1,103 @@
+#include "sendQueue.h"
+using Com::BlockPool;
+
+// SEND QUEUE
+
+SendQueue::~SendQueue() {
+	for (Block& it : blocks)
+		recycle(it);
+}
+
+void SendQueue::clear() {
+	for (Block& it : blocks)
+		recycle(it);
+	blocks = vector<Block>();	// an idle connection doesn't need any memory
+	head = bytes = 0;
+}
+
+void SendQueue::push(const uint8* dat, uint len, bool webs) {
+	if (webs) {
+		uint8 frame[Com::wsHeadMax];
+		pushRaw(frame, Com::writeWsHead(frame, len));
+	}
+	pushRaw(dat, len);
+}
+
+void SendQueue::pushRaw(const uint8* dat, uint len) {
+	if (blocks.empty() || blocks.back().shared || blocks.back().length + len > blocks.back().capacity) {
+		Block& blk = blocks.emplace_back();
+		blk.capacity = blocks.size() == 1 && len <= firstBlockSize ? firstBlockSize : BlockPool::blockSize(std::max(len, blockSize));
+		blk.data = BlockPool::take(blk.capacity);
+	}
+	Block& blk = blocks.back();
+	std::copy_n(dat, len, blk.data.get() + blk.length);
+	blk.length += len;
+	bytes += len;
+}
+
+void SendQueue::pushShared(const sptr<const vector<uint8>>& dat) {
+	blocks.emplace_back().shared = dat;
+	bytes += uint(dat->size());
+}
+
+vector<uint8> SendQueue::save() const {
+	vector<uint8> data;
+	data.reserve(bytes);
+	for (sizet i = 0; i < blocks.size(); ++i) {
+		const Block& blk = blocks[i];
+		const uint8* dat = blk.shared ? blk.shared->data() : blk.data.get();
+		data.insert(data.end(), dat + (i ? 0 : head), dat + blk.size());
+	}
+	return data;
+}
+
+uint SendQueue::flush(nsint fd) {
+	uint calls = 0;
+	while (bytes) {
+		uint cnt = std::min(uint(blocks.size()), maxBlocks);
+#ifdef _WIN32
+		WSABUF bufs[maxBlocks];
+		for (uint i = 0; i < cnt; ++i) {
+			bufs[i].buf = reinterpret_cast<char*>(blocks[i].begin() + (i ? 0 : head));
+			bufs[i].len = ULONG(blocks[i].size() - (i ? 0 : head));
+		}
+		DWORD sent;
+		long len = WSASend(fd, bufs, cnt, &sent, 0, nullptr, nullptr) ? -1 : long(sent);
+#else
+		iovec bufs[maxBlocks];
+		for (uint i = 0; i < cnt; ++i) {
+			bufs[i].iov_base = blocks[i].begin() + (i ? 0 : head);
+			bufs[i].iov_len = blocks[i].size() - (i ? 0 : head);
+		}
+		long len = writev(fd, bufs, int(cnt));
+#endif
+		++calls;
+		if (len < 0) {
+			if (Com::wouldBlock())
+				break;
+			throw Com::Error(Com::msgConnectionLost);
+		}
+		erase(uint(len));
+	}
+	return calls;
+}
+
+void SendQueue::erase(uint len) {
+	if (len == bytes) {
+		clear();
+		return;
+	}
+	bytes -= len;
+	vector<Block>::iterator end = blocks.begin();
+	for (len += head; len >= end->size(); ++end) {
+		len -= end->size();
+		recycle(*end);
+	}
+	blocks.erase(blocks.begin(), end);
+	head = len;
+}
+
+void SendQueue::recycle(Block& blk) {
+	if (blk.data)
+		BlockPool::give(std::move(blk.data), blk.capacity);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "server.h"
+
+// outbound data of a non-blocking socket that gets collected over a poll iteration and sent with as few calls as possible
+class SendQueue {
+private:
+	static constexpr uint blockSize = 4096;
+	static constexpr uint firstBlockSize = 256;	// most queues only get a short message before they're flushed, like a ping to every player whose timer expires in the same tick
+	static constexpr uint maxBlocks = 64;	// max buffers per send call (IOV_MAX is at least 16 on POSIX and mostly 1024)
+
+	struct Block {
+		uptr<uint8[]> data;	// from the thread's BlockPool
+		sptr<const vector<uint8>> shared;	// data that's the same for many players gets referenced instead of copied
+		uint capacity = 0;	// size of data
+		uint length = 0;	// used bytes of data
+
+		uint8* begin();
+		uint size() const;
+	};
+
+	vector<Block> blocks;	// messages get appended to the last block until it's full, so that the memory never has to be moved, and there are none when everything has been sent
+	uint head = 0;	// position of the first unsent byte in the first block
+	uint bytes = 0;	// amount of unsent bytes
+
+public:
+	SendQueue() = default;
+	SendQueue(SendQueue&&) = default;
+	~SendQueue();
+
+	SendQueue& operator=(SendQueue&&) = default;
+
+	uint size() const;	// amount of unsent bytes
+	bool empty() const;
+	void clear();
+
+	void push(const uint8* dat, uint len, bool webs);	// append a message and put it in a websocket frame if necessary
+	void pushRaw(const uint8* dat, uint len);
+	void pushShared(const sptr<const vector<uint8>>& dat);	// append data that mustn't change while it's queued
+	vector<uint8> save() const;	// unsent bytes for handing them over to another process
+	uint flush(nsint fd);	// send as much as possible and return the number of send calls
+private:
+	void erase(uint len);
+	static void recycle(Block& blk);
+};
+
+inline uint8* SendQueue::Block::begin() {
+	return shared ? const_cast<uint8*>(shared->data()) : data.get();	// only for iovec, which doesn't take const
+}
+
+inline uint SendQueue::Block::size() const {
+	return shared ? uint(shared->size()) : length;
+}
+
+inline uint SendQueue::size() const {
+	return bytes;
+}
+
+inline bool SendQueue::empty() const {
+	return !bytes;
+}
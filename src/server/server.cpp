@@ -1,6 +1,19 @@
 #include "server.h"
 #include "utils/text.h"
 #include <random>
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <sys/resource.h>
+#endif
 
 namespace Com {
 
@@ -36,19 +49,26 @@ nsint createSocket(int family, int reuseaddr, int nodelay) {
 	return fd;
 }
 
-nsint bindSocket(const char* port, int family) {
+nsint bindSocket(const char* port, int family, int reuseport) {
 	addrinfo* inf = resolveAddress(nullptr, port, family);
 	if (!inf)
 		throw Error(msgResolveFail);
 
 	nsint fd = INVALID_SOCKET;
-	for (addrinfo* it = inf; it; it = it->ai_next) {
-		if (fd = createSocket(it->ai_family, 1); fd == INVALID_SOCKET)
+	for (addrinfo* it = inf; it && fd == INVALID_SOCKET; it = it->ai_next) {	// fd only gets set once a socket is listening, so a failed last address can't leave a closed one behind
+		nsint sock = createSocket(it->ai_family, 1);
+		if (sock == INVALID_SOCKET)
 			continue;
-		if (bind(fd, it->ai_addr, socklent(it->ai_addrlen)) || listen(fd, 8))
-			closeSocket(fd);
+#ifdef SO_REUSEPORT
+		if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<char*>(&reuseport), sizeof(reuseport))) {
+			closeSocketV(sock);
+			continue;
+		}
+#endif
+		if (bind(sock, it->ai_addr, socklent(it->ai_addrlen)) || listen(sock, SOMAXCONN))	// connections can pile up while a worker is busy
+			closeSocketV(sock);
 		else
-			break;
+			fd = sock;
 	}
 	freeaddrinfo(inf);
 	if (fd == INVALID_SOCKET)
@@ -77,6 +97,41 @@ int noblockSocket(nsint fd, bool noblock) {
 #endif
 }
 
+int keepaliveSocket([[maybe_unused]] nsint fd, [[maybe_unused]] uint interval) {
+#ifndef __EMSCRIPTEN__
+	int on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<char*>(&on), sizeof(on)))
+		return -1;
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+	int idle = int(interval), intvl = std::max(int(interval) / 3, 1), cnt = 3;	// a dead peer is noticed within two intervals
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, reinterpret_cast<char*>(&idle), sizeof(idle)) || setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, reinterpret_cast<char*>(&intvl), sizeof(intvl)) || setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, reinterpret_cast<char*>(&cnt), sizeof(cnt)))
+		return -1;
+#endif
+#ifdef TCP_USER_TIMEOUT
+	uint utime = interval * 2000;	// also give up on data that doesn't get acknowledged
+	if (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, reinterpret_cast<char*>(&utime), sizeof(utime)))
+		return -1;
+#endif
+#endif
+	return 0;
+}
+
+uint raiseFileLimit(uint fds) {
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+	rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim))
+		return 0;
+	if (lim.rlim_cur != RLIM_INFINITY && lim.rlim_cur < fds) {
+		rlimit nlim = { lim.rlim_max == RLIM_INFINITY ? rlim_t(fds) : std::min(rlim_t(fds), lim.rlim_max), lim.rlim_max };
+		if (!setrlimit(RLIMIT_NOFILE, &nlim))
+			lim.rlim_cur = nlim.rlim_cur;
+	}
+	return lim.rlim_cur == RLIM_INFINITY ? UINT32_MAX : uint(std::min(lim.rlim_cur, rlim_t(UINT32_MAX)));
+#else
+	return fds;
+#endif
+}
+
 static void sendNet(nsint fd, const void* data, uint size) {
 	if (send(fd, static_cast<const char*>(data), size, 0) != sendlen(size))
 		throw Error(msgConnectionLost);
@@ -93,6 +148,7 @@ static uint recvNet(nsint fd, void* data, uint size) {
 	return len;
 }
 
+#if !defined(MSG_DONTWAIT) || defined(__EMSCRIPTEN__)
 static long recvNow(nsint fd, void* data, uint size) {
 #ifdef _WIN32
 	int len = recv(fd, static_cast<char*>(data), size, 0);
@@ -109,6 +165,7 @@ static long recvNow(nsint fd, void* data, uint size) {
 #endif
 	return len > 0 ? len : -1;
 }
+#endif
 
 void closeSocket(nsint& fd) {
 	closeSocketV(fd);
@@ -121,114 +178,112 @@ static uint32 rol(uint32 value, uint8 bits) {
 	return (value << bits) | (value >> (32 - bits));
 }
 
-static uint32 blk0(uint8* block, uint i) {
-	uint32 num = readMem<uint32>(block + i * sizeof(uint32));
-	num = (rol(num, 24) & 0xFF00FF00) | (rol(num, 8) & 0x00FF00FF);
-	writeMem(block + i * sizeof(uint32), num);
-	return num;
-}
-
-static uint32 blk(uint8* block, uint i) {
-	uint32 num = rol(readMem<uint32>(block + ((i + 13) & 15) * sizeof(uint32)) ^ readMem<uint32>(block + ((i + 8) & 15) * sizeof(uint32)) ^ readMem<uint32>(block + ((i + 2) & 15) * sizeof(uint32)) ^ readMem<uint32>(block + (i & 15) * sizeof(uint32)), 1);
-	writeMem(block + (i & 15) * sizeof(uint32), num);
-	return num;
-}
+void Sha1::transform(const uint8* blk) {
+	uint32 w[16];
+	for (uint i = 0; i < 16; ++i)
+		w[i] = read32(blk + i * sizeof(uint32));
 
-static void sha1Transform(uint32* state, uint8* buffer) {
-	array<uint32, 5> scop = { state[0], state[1], state[2], state[3], state[4] };
+	uint32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
 	for (uint i = 0; i < 80; ++i) {
-		if (i < 16)
-			scop[4] += ((scop[1] & (scop[2] ^ scop[3])) ^ scop[3]) + blk0(buffer, i) + 0x5A827999 + rol(scop[0], 5);
-		else if (i < 20)
-			scop[4] += ((scop[1] & (scop[2] ^ scop[3])) ^ scop[3]) + blk(buffer, i) + 0x5A827999 + rol(scop[0], 5);
+		if (i >= 16)
+			w[i & 15] = rol(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+
+		uint32 f;
+		if (i < 20)
+			f = ((b & (c ^ d)) ^ d) + 0x5A827999;
 		else if (i < 40)
-			scop[4] += (scop[1] ^ scop[2] ^ scop[3]) + blk(buffer, i) + 0x6ED9EBA1 + rol(scop[0], 5);
+			f = (b ^ c ^ d) + 0x6ED9EBA1;
 		else if (i < 60)
-			scop[4] += (((scop[1] | scop[2]) & scop[3]) | (scop[1] & scop[2])) + blk(buffer, i) + 0x8F1BBCDC + rol(scop[0], 5);
+			f = (((b | c) & d) | (b & c)) + 0x8F1BBCDC;
 		else
-			scop[4] += (scop[1] ^ scop[2] ^ scop[3]) + blk(buffer, i) + 0xCA62C1D6 + rol(scop[0], 5);
-		scop[1] = rol(scop[1], 30);
-		std::rotate(scop.begin(), scop.end() - 1, scop.end());
+			f = (b ^ c ^ d) + 0xCA62C1D6;
+		uint32 t = rol(a, 5) + f + e + w[i & 15];
+		e = d;
+		d = c;
+		c = rol(b, 30);
+		b = a;
+		a = t;
 	}
-	for (uint i = 0; i < 5; ++i)
-		state[i] += scop[i];
-}
-
-static void sha1Update(uint32* state, uint32* count, uint8* buffer, uint8* data, uint32 len) {
-	uint32 j = count[0];
-	if (count[0] += len << 3; count[0] < j)
-		++count[1];
-	count[1] += len >> 29;
-	j = (j >> 3) & 63;
-
-	uint32 i;
-	if (j + len > 63) {
-		i = 64 - j;
-		std::copy_n(data, i, buffer + j);
-		sha1Transform(state, buffer);
-		for (; i + 63 < len; i += 64)
-			sha1Transform(state, data + i);
-		j = 0;
-	} else
-		i = 0;
-	std::copy_n(data + i, len - i, buffer + j);
-}
-
-string digestSha1(string str) {
-	uint32 state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
-	uint32 count[2] = { 0, 0 };
-	uint8 buffer[64];
-	for (sizet i = 0; i < str.length(); ++i)
-		sha1Update(state, count, buffer, reinterpret_cast<uint8*>(str.data()) + i, 1);
-
-	uint8 finalcount[8];
-	for (uint i = 0; i < 8; ++i)
-		finalcount[i] = (count[i<4] >> ((3 - (i & 3)) * 8)) & 255;
-
-	uint8 c = 0x80;
-	sha1Update(state, count, buffer, &c, 1);
-	while ((count[0] & 504) != 448) {
-		c = 0;
-		sha1Update(state, count, buffer, &c, 1);
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+void Sha1::update(const void* data, sizet len) {
+	const uint8* pos = static_cast<const uint8*>(data);
+	uint used = uint(count % blockSize);
+	count += len;
+	if (used) {
+		uint cnt = uint(std::min(len, sizet(blockSize - used)));
+		std::copy_n(pos, cnt, block + used);
+		if (pos += cnt, len -= cnt; used + cnt < blockSize)
+			return;
+		transform(block);
+	}
+	for (; len >= blockSize; pos += blockSize, len -= blockSize)
+		transform(pos);
+	std::copy_n(pos, len, block);
+}
+
+void Sha1::finish(uint8* digest) {
+	uint used = uint(count % blockSize);
+	uint64 bits = count * 8;
+	block[used++] = 0x80;
+	if (used > blockSize - sizeof(uint64)) {
+		std::fill(block + used, block + blockSize, 0);
+		transform(block);
+		used = 0;
 	}
-	sha1Update(state, count, buffer, finalcount, 8);
+	std::fill(block + used, block + blockSize - sizeof(uint64), 0);
+	write64(block + blockSize - sizeof(uint64), bits);
+	transform(block);
 
-	str.resize(20);
-	for (sizet i = 0; i < str.length(); ++i)
-		str[i] = char((state[i >> 2] >> ((3 - (i & 3)) * 8)) & 255);
-	return str;
+	for (uint i = 0; i < 5; ++i)
+		write32(digest + i * sizeof(uint32), state[i]);
 }
 
-string encodeBase64(const string& str) {
-	constexpr char b64charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-	string ret;
-	uint8 arr3[3], arr4[4];
+// every 12 bit value mapped to its two base64 characters
+static constexpr array<char, 2 << 12> base64Pairs = []() {
+	constexpr char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	array<char, 2 << 12> pairs{};
+	for (uint i = 0; i < 1 << 12; ++i) {
+		pairs[i * 2] = charset[i >> 6];
+		pairs[i * 2 + 1] = charset[i & 0x3F];
+	}
+	return pairs;
+}();
+
+uint encodeBase64(const uint8* data, uint len, char* out) {
+	char* pos = out;
 	uint i = 0;
-	for (char ch : str) {
-		arr3[i++] = ch;
-		if (i == 3) {
-			arr4[0] = (arr3[0] & 0xFC) >> 2;
-			arr4[1] = ((arr3[0] & 0x03) << 4) + ((arr3[1] & 0xF0) >> 4);
-			arr4[2] = ((arr3[1] & 0x0F) << 2) + ((arr3[2] & 0xC0) >> 6);
-			arr4[3] = arr3[2] & 0x3F;
-
-			for (i = 0; i < 4 ; ++i)
-				ret += b64charset[arr4[i]];
-			i = 0;
-		}
+	for (; i + 3 <= len; i += 3, pos += 4) {
+		uint32 num = uint32(data[i]) << 16 | uint32(data[i+1]) << 8 | data[i+2];
+		std::copy_n(&base64Pairs[(num >> 12) * 2], 2, pos);
+		std::copy_n(&base64Pairs[(num & 0xFFF) * 2], 2, pos + 2);
 	}
-	if (i) {
-		for (uint j = i; j < 3; ++j)
-			arr3[j] = '\0';
-		arr4[0] = (arr3[0] & 0xFC) >> 2;
-		arr4[1] = ((arr3[0] & 0x03) << 4) + ((arr3[1] & 0xF0) >> 4);
-		arr4[2] = ((arr3[1] & 0x0F) << 2) + ((arr3[2] & 0xC0) >> 6);
-
-		for (uint j = 0; j < i + 1; ++j)
-			ret += b64charset[arr4[j]];
-		while (i++ < 3)
-			ret += '=';
+	if (uint rest = len - i) {
+		uint32 num = uint32(data[i]) << 16 | (rest == 2 ? uint32(data[i+1]) << 8 : 0);
+		std::copy_n(&base64Pairs[(num >> 12) * 2], 2, pos);
+		pos[2] = rest == 2 ? base64Pairs[(num & 0xFFF) * 2] : '=';
+		pos[3] = '=';
+		pos += 4;
 	}
+	return uint(pos - out);
+}
+
+string digestSha1(const string& str) {
+	Sha1 sha;
+	sha.update(str.data(), str.length());
+	string digest(Sha1::digestSize, '\0');
+	sha.finish(reinterpret_cast<uint8*>(digest.data()));
+	return digest;
+}
+
+string encodeBase64(const string& str) {
+	string ret(base64Size(uint(str.length())), '\0');
+	encodeBase64(reinterpret_cast<const uint8*>(str.data()), uint(str.length()), ret.data());
 	return ret;
 }
 
@@ -248,31 +303,24 @@ void sendVersionRejection(nsint socket, bool webs) {
 }
 
 void sendRejection(nsint server) {
-	nsint fd = INVALID_SOCKET;
 	try {
-		fd = acceptSocket(server);
+		sendFull(acceptSocket(server));
+	} catch (const Error&) {}
+}
+
+void sendFull(nsint socket) {
+	try {
 		uint8 data[dataHeadSize] = { uint8(Code::full) };
 		write16(data + 1, dataHeadSize);
-		sendNet(fd, data, dataHeadSize);
+		sendNet(socket, data, dataHeadSize);
 	} catch (const Error&) {}
-	closeSocketV(fd);
+	closeSocketV(socket);
 }
 
 void sendData(nsint socket, const uint8* data, uint len, bool webs) {
 	if (webs) {
-		uint ofs = wsHeadMin;
-		uint8 frame[wsHeadMax] = { 0x82 };
-		if (len <= 125)
-			frame[1] = len;
-		else if (len <= UINT16_MAX) {
-			frame[1] = 126;
-			write16(frame + wsHeadMin, len);
-			ofs += sizeof(uint16);
-		} else {
-			frame[1] = 127;
-			write64(frame + wsHeadMin, len);
-			ofs += sizeof(uint64);
-		}
+		uint8 frame[wsHeadMax];
+		uint ofs = writeWsHead(frame, len);
 		vector<uint8> wdat(len + ofs);
 		std::copy_n(frame, ofs, wdat.begin());
 		std::copy_n(data, len, wdat.begin() + ofs);
@@ -281,6 +329,22 @@ void sendData(nsint socket, const uint8* data, uint len, bool webs) {
 		sendNet(socket, data, len);
 }
 
+uint writeWsHead(uint8* frame, uint len, bool deflated) {
+	frame[0] = deflated ? 0xC2 : 0x82;
+	if (len <= 125) {
+		frame[1] = len;
+		return wsHeadMin;
+	}
+	if (len <= UINT16_MAX) {
+		frame[1] = 126;
+		write16(frame + wsHeadMin, len);
+		return wsHeadMin + sizeof(uint16);
+	}
+	frame[1] = 127;
+	write64(frame + wsHeadMin, len);
+	return wsHeadMin + sizeof(uint64);
+}
+
 ulong generateRandomSeed() {
 	try {
 		std::random_device rd;
@@ -289,22 +353,178 @@ ulong generateRandomSeed() {
 	return time(nullptr);
 }
 
+// WEBSOCKET MASK
+
+static void unmaskWords(uint8* data, uint len, const uint8* mask) {
+	uint32 mword = readMem<uint32>(mask);
+	uint64 mdword = uint64(mword) | uint64(mword) << 32;	// same byte order in both halves regardless of endianness
+	uint i = 0;
+	for (; i + sizeof(uint64) <= len; i += sizeof(uint64))
+		writeMem(data + i, readMem<uint64>(data + i) ^ mdword);
+	for (; i < len; ++i)
+		data[i] ^= mask[i % sizeof(uint32)];
+}
+
+#ifdef SIMD_X86
+static void unmaskSse2(uint8* data, uint len, const uint8* mask) {
+	__m128i mvec = _mm_set1_epi32(readMem<int>(mask));
+	uint i = 0;
+	for (; i + sizeof(__m128i) <= len; i += sizeof(__m128i)) {
+		__m128i* pos = reinterpret_cast<__m128i*>(data + i);
+		_mm_storeu_si128(pos, _mm_xor_si128(_mm_loadu_si128(pos), mvec));
+	}
+	unmaskWords(data + i, len - i, mask);
+}
+
+#ifndef _MSC_VER
+__attribute__((target("avx2")))
+#endif
+static void unmaskAvx2(uint8* data, uint len, const uint8* mask) {
+	__m256i mvec = _mm256_set1_epi32(readMem<int>(mask));
+	uint i = 0;
+	for (; i + sizeof(__m256i) <= len; i += sizeof(__m256i)) {
+		__m256i* pos = reinterpret_cast<__m256i*>(data + i);
+		_mm256_storeu_si256(pos, _mm256_xor_si256(_mm256_loadu_si256(pos), mvec));
+	}
+	if (i + sizeof(__m128i) <= len) {	// stay in VEX encoding for the last half vector
+		__m128i* pos = reinterpret_cast<__m128i*>(data + i);
+		_mm_storeu_si128(pos, _mm_xor_si128(_mm_loadu_si128(pos), _mm256_castsi256_si128(mvec)));
+		i += sizeof(__m128i);
+	}
+	unmaskWords(data + i, len - i, mask);
+}
+
+static bool hasAvx2() {
+#ifdef _MSC_VER
+	int info[4];
+	if (__cpuid(info, 0); info[0] < 7)
+		return false;
+	if (__cpuid(info, 1); !(info[2] & (1 << 27)) || (_xgetbv(0) & 0x6) != 0x6)	// the OS needs to save the YMM registers
+		return false;
+	__cpuidex(info, 7, 0);
+	return info[1] & (1 << 5);
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#elif defined(SIMD_NEON)
+static void unmaskNeon(uint8* data, uint len, const uint8* mask) {
+	uint8x16_t mvec = vreinterpretq_u8_u32(vdupq_n_u32(readMem<uint32>(mask)));
+	uint i = 0;
+	for (; i + sizeof(uint8x16_t) <= len; i += sizeof(uint8x16_t))
+		vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), mvec));
+	unmaskWords(data + i, len - i, mask);
+}
+#endif
+
+vector<pair<const char*, UnmaskCall>> unmaskCalls() {
+	vector<pair<const char*, UnmaskCall>> calls = { pair("words", unmaskWords) };
+#ifdef SIMD_X86
+	calls.emplace_back("SSE2", unmaskSse2);
+	if (hasAvx2())
+		calls.emplace_back("AVX2", unmaskAvx2);
+#elif defined(SIMD_NEON)
+	calls.emplace_back("NEON", unmaskNeon);
+#endif
+	return calls;
+}
+
+static const UnmaskCall unmaskBest = unmaskCalls().back().second;
+
+void unmaskData(uint8* data, uint len, const uint8* mask) {
+	unmaskBest(data, len, mask);
+}
+
+// BLOCK POOL
+
+thread_local BlockPool::Pool BlockPool::pool;
+thread_local bool BlockPool::closed = false;
+
+BlockPool::Pool::~Pool() {
+	closed = true;
+}
+
+uint BlockPool::blockSize(uint len) {
+	if (len > maxSize)
+		return len;
+	uint size = minSize;
+	while (size < len)
+		size *= 2;
+	return size;
+}
+
+uptr<uint8[]> BlockPool::take(uint size) {
+	++pool.stats.takes;
+	if (size <= maxSize && !closed) {
+		uint cls = sizeClass(size);
+		if (vector<uptr<uint8[]>>& blks = pool.blocks[cls]; !blks.empty()) {
+			uptr<uint8[]> blk = std::move(blks.back());
+			blks.pop_back();
+			pool.idle[cls] = std::min(pool.idle[cls], blks.size());
+			pool.stats.cached -= size;
+			return blk;
+		}
+	}
+	++pool.stats.misses;
+	return std::make_unique<uint8[]>(size);
+}
+
+void BlockPool::give(uptr<uint8[]>&& blk, uint size) {
+	if (size <= maxSize && !closed) {
+		if (vector<uptr<uint8[]>>& blks = pool.blocks[sizeClass(size)]; (blks.size() + 1) * size <= classLimit) {
+			blks.push_back(std::move(blk));
+			pool.stats.cached += size;
+			return;
+		}
+	}
+	blk.reset();
+}
+
+void BlockPool::trim() {
+	for (uint i = 0; i < classCnt; ++i) {
+		vector<uptr<uint8[]>>& blks = pool.blocks[i];
+		sizet bytes = pool.idle[i] * (minSize << i);
+		blks.resize(blks.size() - pool.idle[i]);
+		if (blks.empty())
+			blks.shrink_to_fit();
+		pool.stats.cached -= bytes;
+		pool.stats.trimmed += bytes;
+		pool.idle[i] = blks.size();
+	}
+}
+
+const BlockPool::Stats& BlockPool::stats() {
+	return pool.stats;
+}
+
+uint BlockPool::sizeClass(uint size) {
+	uint cls = 0;
+	for (; (minSize << cls) < size; ++cls);
+	return cls;
+}
+
 // BUFFER
 
+uint Buffer::maxMessage = UINT16_MAX;
+uint Buffer::maxBuffered = UINT32_MAX;
+
+Buffer::~Buffer() {
+	if (data)
+		BlockPool::give(std::move(data), size);
+}
+
 uint Buffer::pushHead(Code code, uint16 dlen) {
-	uint end = checkOver(dlim + dataHeadSize);
-	data[dlim] = uint8(code);
-	write16(&data[dlim+1], dlen);
-	return dlim = end;
+	uint8* dst = extend(dataHeadSize);
+	dst[0] = uint8(code);
+	write16(dst + 1, dlen);
+	return dend - dbeg;
 }
 
 uint Buffer::allocate(Code code, uint16 dlen) {
-	uint end = checkOver(dlim + dlen);
-	data[dlim] = uint8(code);
-	write16(&data[dlim+1], dlen);
-	uint ret = dlim + dataHeadSize;
-	dlim = end;
-	return ret;
+	uint8* dst = extend(dlen);
+	dst[0] = uint8(code);
+	write16(dst + 1, dlen);
+	return dend - dbeg - dlen + dataHeadSize;
 }
 
 void Buffer::push(uint8 val) {
@@ -325,9 +545,7 @@ void Buffer::push(uint64 val) {
 
 template <class T, class F>
 void Buffer::pushNumber(T val, F writer) {
-	uint end = checkOver(dlim + sizeof(val));
-	writer(&data[dlim], val);
-	dlim = end;
+	writer(extend(sizeof(val)), val);
 }
 
 void Buffer::push(initlist<uint16> lst) {
@@ -350,20 +568,22 @@ void Buffer::push(const string& str) {
 	pushRaw(str);
 }
 
+void Buffer::push(const vector<uint8>& vec) {
+	pushRaw(vec);
+}
+
 template <class T, class F>
 void Buffer::pushNumberList(initlist<T> lst, F writer) {
-	checkOver(dlim + lst.size() * sizeof(T));
+	uint8* dst = extend(lst.size() * sizeof(T));
 	for (T n : lst) {
-		writer(&data[dlim], n);
-		dlim += sizeof(T);
+		writer(dst, n);
+		dst += sizeof(T);
 	}
 }
 
 template <class T>
 void Buffer::pushRaw(const T& vec) {
-	uint end = checkOver(dlim + vec.size());
-	std::copy(vec.begin(), vec.end(), &data[dlim]);
-	dlim = end;
+	std::copy(vec.begin(), vec.end(), extend(vec.size()));
 }
 
 uint Buffer::write(uint8 val, uint pos) {
@@ -384,69 +604,164 @@ uint Buffer::write(uint64 val, uint pos) {
 
 template <class T, class F>
 uint Buffer::writeNumber(T val, uint pos, F writer) {
-	writer(&data[pos], val);
+	writer(&data[dbeg+pos], val);
 	return pos + sizeof(val);
 }
 
 void Buffer::redirect(nsint socket, uint8* pos, bool sendWebs) {
-	if (pos == data.get())	// no offset means no ws frame
-		sendData(socket, data.get(), readLoadSize(false), sendWebs);	// send like normal
+	uint8* dat = &data[dbeg];
+	if (pos == dat)	// no offset means no ws frame
+		sendData(socket, dat, readLoadSize(false), sendWebs);	// send like normal
 	else if (sendWebs) {
-		if (data[1] & 0x80) {
-			data[1] &= 0x7F;
-			std::copy(pos, &data[dlim], pos - sizeof(uint32));	// should already be unmasked
-			dlim -= sizeof(uint32);	// skip resize because there should be an erase right after this anyway
+		if (dat[1] & 0x80) {
+			dat[1] &= 0x7F;
+			std::copy(pos, &data[dend], pos - sizeof(uint32));	// should already be unmasked
+			dend -= sizeof(uint32);
 		}
-		sendNet(socket, data.get(), readLoadSize(true));	// reuse ws frame without mask
+		sendNet(socket, dat, readLoadSize(true));	// reuse ws frame without mask
 	} else
 		sendNet(socket, pos, read16(pos + 1));	// skip ws frame
 }
 
 void Buffer::send(nsint socket, bool webs, bool clr) {
-	if (sendData(socket, data.get(), dlim, webs); clr)
+	if (sendData(socket, data.get() + dbeg, dend - dbeg, webs); clr)
 		clear();
 }
 
-uint8* Buffer::recv(nsint socket, bool webs) {
+uint8* Buffer::recv(nsint socket, bool webs, SendCall reply, InflateCall inflate, PongCall pong) {
 	uint ofs = 0;
 	uint8* mask = nullptr;
-	return recvHead(socket, ofs, mask, webs) ? recvLoad(ofs, mask) : nullptr;
+	return recvHead(socket, ofs, mask, webs, reply, inflate, pong) ? recvLoad(ofs, mask) : nullptr;
 }
 
-bool Buffer::recvData(nsint socket) {
-#ifndef MSG_DONTWAIT
-	if (noblockSocket(socket, true))
+bool Buffer::recvData(nsint socket, [[maybe_unused]] bool noblock) {
+#if defined(MSG_DONTWAIT) && !defined(__EMSCRIPTEN__)
+	for (uint8 spill[recvSpill];;) {	// read into the free space and whatever doesn't fit into the stack, so that one call can take everything
+		if (capped())
+			return false;	// the rest has to wait until the data has been processed
+		uint room = maxBuffered - (dend - dbeg);
+		if (dend == size)
+			reserve(std::min(initSize, room));
+		uint free = std::min(size - dend, room);
+		iovec iov[2] = { { &data[dend], free }, { spill, std::min(recvSpill, room - free) } };
+		msghdr msg{};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		long len = recvmsg(socket, &msg, MSG_DONTWAIT);
+		if (len <= 0)
+			return !len || !wouldBlock();
+
+		if (uint(len) <= free)
+			dend += uint(len);
+		else {
+			dend += free;
+			std::copy_n(spill, uint(len) - free, extend(uint(len) - free));
+		}
+	}
+#else
+	if (!noblock && noblockSocket(socket, true))
 		throw Error(msgIoctlFail);
-#endif
-	for (long len;; dlim += len) {
-		checkOver(dlim);	// allocate next block if full
-		if (len = recvNow(socket, &data[dlim], size - dlim); len <= 0) {
-#ifndef MSG_DONTWAIT
-			if (noblockSocket(socket, false))
+	for (long len;; dend += len) {
+		if (capped())
+			len = 0;	// the rest has to wait until the data has been processed
+		else {
+			if (dend == size)	// allocate more if full
+				reserve(std::min(initSize, maxBuffered - (dend - dbeg)));
+			len = recvNow(socket, &data[dend], std::min(size - dend, maxBuffered - (dend - dbeg)));
+		}
+		if (len <= 0) {
+			if (!noblock && noblockSocket(socket, false))
 				throw Error(msgIoctlFail);
-#endif
 			return len;
 		}
 	}
+#endif
 }
 
-Buffer::Init Buffer::recvConn(nsint socket, bool& webs, bool& nameError, bool (*nameCheck)(const string& name)) {
+// reads the params of the first acceptable permessage-deflate offer in a Sec-WebSocket-Extensions header and writes the matching response params
+static bool readDeflateOffers(const char* pos, const char* end, WsDeflateParams& params, string& response) {
+	auto token = [](const char*& it, const char* last, char sep) -> string {
+		const char* tend = std::find(it, last, sep);
+		string tok = trim(string(it, tend));
+		it = tend == last ? last : tend + 1;
+		return tok;
+	};
+	auto windowBits = [](const string& val) -> uint8 {	// returns 0 if invalid
+		return !val.empty() && val.length() <= 2 && val[0] != '0' && std::all_of(val.begin(), val.end(), [](char c) -> bool { return c >= '0' && c <= '9'; }) ? uint8(sstoul(val, 10)) : 0;
+	};
+
+	while (pos < end) {
+		const char* oend = std::find(pos, end, ',');
+		const char* it = pos;
+		pos = oend == end ? end : oend + 1;
+		if (token(it, oend, ';') != "permessage-deflate")
+			continue;
+
+		WsDeflateParams prm = params;
+		string resp = "permessage-deflate";
+		bool valid = true;
+		while (valid && it < oend) {
+			string param = token(it, oend, ';');
+			string val;
+			if (sizet eq = param.find('='); eq != string::npos) {
+				val = trim(param.substr(eq + 1));
+				param = trim(param.substr(0, eq));
+				if (val.length() >= 2 && val.front() == '"' && val.back() == '"')
+					val = val.substr(1, val.length() - 2);
+			}
+
+			if (param == "server_no_context_takeover" && val.empty()) {
+				prm.serverNoContext = true;
+				resp += "; server_no_context_takeover";
+			} else if (param == "client_no_context_takeover" && val.empty())
+				resp += "; client_no_context_takeover";	// the inflater doesn't mind either way
+			else if (param == "server_max_window_bits") {
+				uint8 bits = windowBits(val);
+				if (valid = bits >= 9 && bits <= 15; valid) {	// zlib can't make raw streams with a 256 byte window
+					prm.serverWindow = std::min(prm.serverWindow, bits);
+					resp += "; server_max_window_bits=" + toStr(prm.serverWindow);
+				}
+			} else if (param == "client_max_window_bits") {
+				uint8 bits = val.empty() ? 15 : windowBits(val);
+				if (valid = bits >= 8 && bits <= 15; valid) {
+					prm.clientWindow = std::min(params.clientWindow, bits);
+					resp += "; client_max_window_bits=" + toStr(prm.clientWindow);
+				}
+			} else
+				valid = false;
+		}
+		if (valid) {
+			if (resp.find("client_max_window_bits") == string::npos)
+				prm.clientWindow = 15;	// the client can only be limited if it offers to be
+			params = prm;
+			response = std::move(resp);
+			return true;
+		}
+	}
+	return false;
+}
+
+Buffer::Init Buffer::recvConn(nsint socket, bool& webs, bool& nameError, bool (*nameCheck)(const string& name), WsDeflateParams* deflate, InflateCall inflate, uint8* caps) {
 	uint ofs = 0;
 	uint8* mask = nullptr;
-	if (!recvHead(socket, ofs, mask, webs))
+	if (!recvHead(socket, ofs, mask, webs, nullptr, inflate, nullptr))
 		return Init::wait;
 
-	switch (uint8 dc = mask ? data[ofs] ^ mask[0] : data[ofs]; Code(dc)) {
+	uint8* dat = &data[dbeg];
+	switch (uint8 dc = mask ? dat[ofs] ^ mask[0] : dat[ofs]; Code(dc)) {
 	case Code::version: {
-		uint8* dat = recvLoad(ofs, mask);
-		if (!dat)
+		uint8* load = recvLoad(ofs, mask);
+		if (!load)
 			return Init::wait;
-		string version = readName(dat + dataHeadSize);
+		string version = readName(load + dataHeadSize);
 		if (std::find(compatibleVersions.begin(), compatibleVersions.end(), version) == compatibleVersions.end())
 			return Init::version;
 
-		string pname = readName(dat + dataHeadSize + sizeof(uint8) + version.length());
+		uint8* nbeg = load + dataHeadSize + sizeof(uint8) + version.length();
+		string pname = readName(nbeg);
 		nameError = pname.empty() || nameCheck(pname);
+		if (caps)
+			*caps = nbeg + sizeof(uint8) + pname.length() < load + read16(load + 1) ? nbeg[sizeof(uint8) + pname.length()] : uint8(CAP_NONE);	// older clients end with the name
 		clearCur(webs);
 		return Init::connect; }
 	case Code::wsconn: {
@@ -454,25 +769,53 @@ Buffer::Init Buffer::recvConn(nsint socket, bool& webs, bool& nameError, bool (*
 			break;
 
 		string word = "\r\n\r\n";
-		uint8* rend = std::search(data.get(), &data[dlim], word.begin(), word.end());
-		if (rend == &data[dlim])
+		uint8* rend = std::search(dat, &data[dend], word.begin(), word.end());
+		if (rend == &data[dend])
 			return Init::wait;
 
 		rend += pdift(word.length());
 		word = "Sec-WebSocket-Key:";
-		uint8* pos = std::search(data.get(), rend, word.begin(), word.end());
+		uint8* pos = std::search(dat, rend, word.begin(), word.end());
 		if (pos == rend)
 			break;
 
 		pos += pdift(word.length());
 		word = "\r\n";
-		string key = string(pos, std::search(pos, rend, word.begin(), word.end()));
-		string response = "HTTP/1.1 101 Switching Protocols\r\n"
+		uint8* kend = std::search(pos, rend, word.begin(), word.end());
+		for (; pos < kend && isSpace(char(*pos)); ++pos);
+		for (; kend > pos && isSpace(char(kend[-1])); --kend);
+
+		string extension;
+		if (deflate && deflate->serverWindow) {
+			constexpr char crlf[] = "\r\n";
+			word = "Sec-WebSocket-Extensions:";
+			bool found = false;
+			for (uint8* ext = dat; !found && (ext = std::search(ext, rend, word.begin(), word.end())) != rend;) {	// the header may be repeated
+				ext += pdift(word.length());
+				uint8* eend = std::search(ext, rend, crlf, crlf + 2);
+				found = readDeflateOffers(reinterpret_cast<char*>(ext), reinterpret_cast<char*>(eend), *deflate, extension);
+				ext = eend;
+			}
+			if (!found)
+				deflate->serverWindow = 0;
+		}
+
+		constexpr char wsGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+		constexpr char wsAccept[] = "HTTP/1.1 101 Switching Protocols\r\n"
 			"Upgrade: websocket\r\n"
 			"Connection: Upgrade\r\n"
-			"Sec-WebSocket-Accept: " + encodeBase64(digestSha1(trim(key) + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11")) + "\r\n\r\n";
-		sendNet(socket, response.c_str(), response.length());
-		eraseFront(rend - data.get());
+			"Sec-WebSocket-Accept: ";
+		constexpr char wsExtension[] = "\r\nSec-WebSocket-Extensions: ";
+		Sha1 sha;
+		sha.update(pos, sizet(kend - pos));
+		sha.update(wsGuid, sizeof(wsGuid) - 1);
+		uint8 digest[Sha1::digestSize];
+		sha.finish(digest);
+		char accept[base64Size(Sha1::digestSize)];
+		encodeBase64(digest, Sha1::digestSize, accept);
+		string response = wsAccept + string(accept, sizeof(accept)) + (extension.empty() ? string() : wsExtension + extension) + "\r\n\r\n";
+		sendNet(socket, response.data(), response.length());
+		eraseFront(uint(rend - dat));
 		webs = true;
 		return Init::cont; }
 	}
@@ -480,111 +823,289 @@ Buffer::Init Buffer::recvConn(nsint socket, bool& webs, bool& nameError, bool (*
 	return Init::error;
 }
 
-bool Buffer::recvHead(nsint socket, uint& ofs, uint8*& mask, bool webs) {
-	if (webs) {
+vector<uint8> Buffer::save() const {
+	vector<uint8> state(sizeof(uint32) * 3 + dend - dbeg);
+	write32(state.data(), fragEnd);
+	write32(state.data() + sizeof(uint32), fragNext);
+	write32(state.data() + sizeof(uint32) * 2, fragSkip);
+	std::copy(data.get() + dbeg, data.get() + dend, state.begin() + sizeof(uint32) * 3);
+	return state;
+}
+
+void Buffer::load(const vector<uint8>& state) {
+	if (state.size() < sizeof(uint32) * 3)
+		throw Error(msgProtocolError);
+	uint dlim = uint(state.size() - sizeof(uint32) * 3);
+	uint fend = read32(state.data()), fnext = read32(state.data() + sizeof(uint32)), fskip = read32(state.data() + sizeof(uint32) * 2);
+	if (fend > fnext || fnext > dlim || fskip > dlim)
+		throw Error(msgProtocolError);
+	clear();
+	std::copy(state.begin() + sizeof(uint32) * 3, state.end(), extend(dlim));
+	fragEnd = fend;
+	fragNext = fnext;
+	fragSkip = fskip;
+}
+
+bool Buffer::recvHead(nsint socket, uint& ofs, uint8*& mask, bool webs, SendCall reply, InflateCall inflate, PongCall pong) {
+	if (!webs)
+		return dend - dbeg >= ofs + dataHeadSize;
+
+	for (;;) {	// control frames and reassembled messages get consumed until a data frame is in front, without recursing for each of them
+		if (fragEnd && !recvFragments(socket, reply, pong))
+			return false;
+
+		uint dlim = dend - dbeg;
+		uint8* dat = data.get() + dbeg;
 		if (ofs += wsHeadMin; dlim < ofs)
 			return false;
-		if ((data[0] & 0xF0) != 0x80)	// TODO: handle fragmentation
+		uint8 opc = dat[0] & 0xF;
+		if ((dat[0] & 0x30) || (!(dat[0] & 0x80) && opc != 2) || ((dat[0] & 0x40) && (!inflate || opc != 2)))	// only data frames can be fragmented or compressed
 			throw Error(msgProtocolError);
 
-		uint plen = data[1] & 0x7F;
+		uint64 plen = dat[1] & 0x7F;
 		if (plen == 126) {
 			if (ofs += sizeof(uint16); dlim < ofs)
 				return false;
-			plen = read16(&data[wsHeadMin]);
+			plen = read16(dat + wsHeadMin);
 		} else if (plen == 127) {
 			if (ofs += sizeof(uint64); dlim < ofs)
 				return false;
-			plen = read64(&data[wsHeadMin]);
+			plen = read64(dat + wsHeadMin);
 		}
+		if (plen > (opc == 2 ? maxMessage : wsControlMax))
+			throw FrameError(msgFrameTooBig);
 
-		if (data[1] & 0x80) {
+		if (dat[1] & 0x80) {
 			if (ofs += sizeof(uint32); dlim < ofs)
 				return false;
-			mask = &data[ofs-sizeof(uint32)];
+			mask = dat + ofs - sizeof(uint32);
 		}
 
-		if (uint8 opc = data[0] & 0xF; opc != 2) {
-			switch (opc) {
-			case 8:
-				resendWs(socket, ofs, plen, mask);
-				throw Error("Connection closed");
-			case 9:
-				data[0] = 0x8A;
-				resendWs(socket, ofs, plen, mask);
-				break;
-			default:
+		if (opc != 2) {
+			if (opc < 8 || opc > 10)
 				throw Error(msgProtocolError);
-			}
+			if (dlim < ofs + plen)	// wait for the whole control frame instead of blocking on a recv
+				return false;
+
+			resendWs(socket, dat, ofs, uint(plen), mask, reply, pong);
+			eraseFront(ofs + uint(plen));
+			if (opc == 8)
+				throw Error("Connection closed");
+			ofs = 0;
+			mask = nullptr;
+			continue;	// there may be more frames behind the ping
+		}
+
+		if (!(dat[0] & 0x80)) {	// first fragment, which stays in place while the following fragments' payloads get moved behind it
+			if (dlim < ofs + plen)
+				return false;
+			if (mask)
+				unmaskData(dat + ofs, uint(plen), mask);
+			fragEnd = fragNext = ofs + uint(plen);
+			ofs = 0;
+			mask = nullptr;
+			continue;	// the reassembled message gets handled like any other frame
+		}
+
+		if (dat[0] & 0x40) {
+			if (dlim < ofs + plen)
+				return false;
+			inflateFront(socket, ofs, uint(plen), mask, inflate);
+			mask = nullptr;
+			dlim = dend - dbeg;
+		}
+		return dlim >= ofs + dataHeadSize;
+	}
+}
+
+bool Buffer::recvFragments(nsint socket, SendCall reply, PongCall pong) {
+	uint8* dat = &data[dbeg];
+	uint head = readWsHeadSize(dat);
+	for (uint dlim = dend - dbeg;;) {
+		uint8* frame = dat + fragNext;
+		uint ofs = fragNext + wsHeadMin;
+		if (dlim < ofs)
 			return false;
+		uint8 opc = frame[0] & 0xF;
+		if ((frame[0] & 0x70) || (opc && (opc < 8 || opc > 10)))	// only the first fragment has the compression bit
+			throw Error(msgProtocolError);
+
+		uint64 plen = frame[1] & 0x7F;
+		if (plen == 126) {
+			if (ofs += sizeof(uint16); dlim < ofs)
+				return false;
+			plen = read16(frame + wsHeadMin);
+		} else if (plen == 127) {
+			if (ofs += sizeof(uint64); dlim < ofs)
+				return false;
+			plen = read64(frame + wsHeadMin);
+		}
+		if (plen > (opc ? wsControlMax : maxMessage - (fragEnd - head)))
+			throw FrameError(msgFrameTooBig);
+
+		const uint8* mask = nullptr;
+		if (frame[1] & 0x80) {
+			if (ofs += sizeof(uint32); dlim < ofs)
+				return false;
+			mask = dat + ofs - sizeof(uint32);
+		}
+		if (dlim < ofs + plen)
+			return false;
+
+		if (opc) {	// control frames can come in between fragments
+			resendWs(socket, frame, ofs - fragNext, uint(plen), mask, reply, pong);
+			if (opc == 8)
+				throw Error("Connection closed");
+			fragNext = ofs + uint(plen);
+			continue;
+		}
+		bool fin = frame[0] & 0x80;	// the frame's head gets overwritten by the move
+		if (mask)
+			unmaskData(dat + ofs, uint(plen), mask);
+		std::copy(dat + ofs, dat + ofs + plen, dat + fragEnd);
+		fragEnd += uint(plen);
+		fragNext = ofs + uint(plen);
+
+		if (fin) {	// put a complete unmasked head in front of the payload
+			uint8 whead[wsHeadMax];
+			uint hlen = writeWsHead(whead, fragEnd - head, dat[0] & 0x40);
+			if (hlen > head)
+				throw Error(msgProtocolError);
+			fragSkip = fragNext - fragEnd;
+			fragEnd = fragNext = 0;
+			dbeg += head - hlen;
+			std::copy_n(whead, hlen, &data[dbeg]);
+			return true;
 		}
 	}
-	return dlim >= ofs + dataHeadSize;
+}
+
+void Buffer::inflateFront(nsint socket, uint& ofs, uint plen, const uint8* mask, InflateCall inflate) {
+	uint8* dat = &data[dbeg];
+	if (mask)
+		unmaskData(dat + ofs, plen, mask);
+	const vector<uint8>& load = inflate(socket, dat + ofs, plen);
+	if (load.size() < dataHeadSize || read16(load.data() + 1) != load.size())	// every frame has to be exactly one message
+		throw Error(msgProtocolError);
+
+	uint8 frame[wsHeadMax];	// replace the compressed frame with an uncompressed unmasked one
+	uint hlen = writeWsHead(frame, uint(load.size()));
+	uint olen = ofs + plen, nlen = hlen + uint(load.size());
+	if (nlen <= olen)
+		dbeg += olen - nlen;
+	else if (uint diff = nlen - olen; dbeg >= diff)
+		dbeg -= diff;
+	else {
+		reserve(diff);
+		std::copy_backward(&data[dbeg+olen], &data[dend], &data[dend+diff]);
+		dend += diff;
+	}
+	std::copy_n(load.begin(), load.size(), std::copy_n(frame, hlen, &data[dbeg]));
+	ofs = hlen;
 }
 
 uint8* Buffer::recvLoad(uint ofs, const uint8* mask) {
+	uint8* dat = &data[dbeg];
+	uint8 buf[sizeof(uint16)] = { dat[ofs+1], dat[ofs+2] };
 	if (mask) {
-		uint8 buf[sizeof(uint16)] = { uint8(data[ofs+1] ^ mask[1]), uint8(data[ofs+2] ^ mask[2]) };
-		uint end = read16(buf) + ofs;
-		if (dlim < end)
-			return nullptr;
-		unmask(mask, ofs, end);
-	} else if (dlim < read16(&data[ofs+1]))
+		buf[0] ^= mask[1];
+		buf[1] ^= mask[2];
+	}
+	uint len = read16(buf);
+	if (len < dataHeadSize)	// a message can't be shorter than its head
+		throw Error(msgProtocolError);
+	if (len > maxMessage)
+		throw FrameError(msgFrameTooBig);
+	if (dend - dbeg < len + ofs)
 		return nullptr;
-	return &data[ofs];
+	if (mask)
+		unmaskData(dat + ofs, len, mask);
+	return dat + ofs;
 }
 
-void Buffer::resendWs(nsint socket, uint hsize, uint plen, const uint8* mask) {
-	uint end = hsize + plen;
-	for (checkOver(end); dlim < end; dlim += recvNet(socket, &data[dlim], size - dlim));
-
+void Buffer::resendWs(nsint socket, uint8* frame, uint hsize, uint plen, const uint8* mask, SendCall reply, PongCall pong) {
+	if ((frame[0] & 0xF) == 10) {	// a pong only needs to arrive unless someone wants its payload
+		if (pong) {
+			if (mask)
+				unmaskData(frame + hsize, plen, mask);
+			pong(socket, frame + hsize, plen);
+		}
+		return;
+	}
+	uint slen = hsize + plen;
+	if ((frame[0] & 0xF) == 9)
+		frame[0] = 0x8A;	// answer a ping with a pong
 	if (mask) {
-		data[1] &= 0x7F;
-		unmask(mask, hsize, end);
-		std::copy_n(&data[hsize], plen, &data[hsize-sizeof(uint32)]);
+		frame[1] &= 0x7F;
+		unmaskData(frame + hsize, plen, mask);
+		std::copy_n(frame + hsize, plen, frame + hsize - sizeof(uint32));
+		slen -= sizeof(uint32);
 	}
-	sendData(socket, data.get(), end, false);
-	eraseFront(end);
+	if (reply)
+		reply(socket, frame, slen);
+	else
+		sendData(socket, frame, slen, false);
 }
 
 uint Buffer::readLoadSize(bool webs) const {
-	uint ofs = 0;
-	if (webs) {
-		ofs += wsHeadMin;
-		if (uint plen = data[1] & 0x7F; plen == 126)
-			ofs += sizeof(uint16);
-		else if (plen == 127)
-			ofs += sizeof(uint64);
-		if (data[1] & 0x80)
-			ofs += sizeof(uint32);
-	}
-	return ofs + read16(&data[ofs+1]);
+	const uint8* dat = &data[dbeg];
+	uint ofs = webs ? readWsHeadSize(dat) : 0;
+	return ofs + read16(dat + ofs + 1);
 }
 
-uint Buffer::checkOver(uint end) {
-	if (end >= size)	// if end == size then already allocate the next block
-		resize(end);
-	return end;
+uint Buffer::readWsHeadSize(const uint8* frame) {
+	uint ofs = wsHeadMin;
+	if (uint plen = frame[1] & 0x7F; plen == 126)
+		ofs += sizeof(uint16);
+	else if (plen == 127)
+		ofs += sizeof(uint64);
+	return frame[1] & 0x80 ? ofs + sizeof(uint32) : ofs;
 }
 
-void Buffer::eraseFront(uint len) {
-	if (dlim -= len; size - dlim <= sizeStep)	// if dlim == size - sizeStep then still keep the next block
-		std::copy_n(&data[len], dlim, data.get());
-	else
-		resize(dlim, len);
+uint8* Buffer::extend(uint len) {
+	reserve(len);
+	uint8* pos = &data[dend];
+	dend += len;
+	return pos;
 }
 
-void Buffer::resize(uint lim, uint ofs) {
-	uint nsiz = (lim / sizeStep + 1) * sizeStep;
-	uptr<uint8[]> ndat = std::make_unique<uint8[]>(nsiz);
-	std::copy_n(&data[ofs], dlim, ndat.get());
+void Buffer::reserve(uint len) {
+	if (size - dend >= len)
+		return;
+
+	uint dlim = dend - dbeg;
+	if (dlim + len <= size / 2) {	// moving the data to the front frees enough space without it having to happen again soon
+		std::copy_n(&data[dbeg], dlim, data.get());
+		dbeg = 0;
+		dend = dlim;
+		return;
+	}
+	uint nsiz = std::max(size, initSize);
+	while (nsiz < dlim + len)
+		nsiz *= 2;
+	uptr<uint8[]> ndat = BlockPool::take(nsiz);
+	std::copy_n(data.get() + dbeg, dlim, ndat.get());
+	if (data)
+		BlockPool::give(std::move(data), size);
 	data = std::move(ndat);
 	size = nsiz;
+	dbeg = 0;
+	dend = dlim;
+}
+
+void Buffer::eraseFront(uint len) {
+	if (dbeg += len; dbeg == dend) {
+		dbeg = dend = 0;
+		if (size == initSize || size > keepSize)	// sizes in between are likely to be needed again soon
+			release();
+	}
 }
 
-void Buffer::unmask(const uint8* mask, uint ofs, uint end) {
-	for (uint i = ofs; i < end; ++i)
-		data[i] ^= mask[(i - ofs) % sizeof(uint32)];
+void Buffer::release() {
+	if (dbeg != dend || !data)
+		return;
+	BlockPool::give(std::move(data), size);
+	size = dbeg = dend = 0;
 }
 
 }
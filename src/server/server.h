@@ -12,6 +12,7 @@
 #include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
@@ -45,11 +46,13 @@ constexpr uint16 dataHeadSize = sizeof(uint8) + sizeof(uint16);	// code + size
 constexpr uint8 roomNameLimit = 63;
 constexpr uint wsHeadMin = 2;
 constexpr uint wsHeadMax = 2 + sizeof(uint64) + sizeof(uint32);
+constexpr uint wsControlMax = 125;	// payload limit of websocket control frames
 
 constexpr char msgAcceptFail[] = "Failed to accept";
 constexpr char msgBindFail[] = "Failed to bind socket";
 constexpr char msgConnectionFail[] = "Failed to connect";
 constexpr char msgConnectionLost[] = "Connection lost";
+constexpr char msgFrameTooBig[] = "Frame too big";
 constexpr char msgIoctlFail[] = "Failed to ioctl";
 constexpr char msgPollFail[] = "Failed to poll";
 constexpr char msgProtocolError[] = "Protocol error";
@@ -85,9 +88,39 @@ enum class Code : uint8 {
 	tile,		// tile type change (tile + type)
 	record,		// turn record data (info + last actor + protected pieces)
 	message,	// local message
+	rdelta,		// batch of room changes (lobby version + state flags and names)
+	channel,	// switch to a lobby channel (channel name, empty for the default), answered with whether it worked + rlist data if it did
+	channels,	// summary of the lobby channels (amount + room count + player count + name per channel)
+	ping,		// round trip time probe (timestamp), which the client sends back unchanged
+	resume,		// session token + number of messages the sender got from the other player of the room since the token was issued (a player gets one when its room fills up and sends it back after reconnecting to get back in, which is answered with a new one or 0 if it failed)
+	watch,		// spectate a room (room name), answered with whether it worked, after which the room's game so far and then its new messages come as Code::spectate
+	spectate,	// message from a player of the watched room (whether it's from the host + the message)
 	wsconn = 'G'	// first letter of websocket handshake
 };
 
+// features a client announces with a byte after its name in the version message
+enum Capability : uint8 {
+	CAP_NONE = 0,
+	CAP_ROOM_DELTA = 1,	// gets room changes as Code::rdelta batches instead of single updates
+	CAP_PING = 2,		// answers Code::ping
+	CAP_RESUME = 4		// gets Code::resume tokens
+};
+
+// whether a message is from the other player of a room, which gets counted and resent after a resumption
+constexpr bool replayable(Code code) {
+	return code == Code::thost || (code >= Code::hello && code <= Code::message);
+}
+
+// whether a message from one player of a room to the other also goes to the room's spectators
+constexpr bool spectated(Code code) {
+	return code >= Code::start && code <= Code::record;
+}
+
+// flags of a room in a Code::rdelta batch, combined with the length of its name
+constexpr uint8 roomDeltaOpen = 0x80;
+constexpr uint8 roomDeltaErased = 0x40;
+constexpr uint8 roomDeltaLength = 0x3F;
+
 enum class CncrnewCode : uint8 {
 	ok,
 	full,
@@ -105,17 +138,41 @@ const umap<Code, uint16> codeSizes = {
 	pair(Code::move, dataHeadSize + sizeof(uint16) * 2),
 	pair(Code::kill, dataHeadSize + sizeof(uint16)),
 	pair(Code::breach, dataHeadSize + sizeof(uint16) + sizeof(uint8)),
-	pair(Code::tile, dataHeadSize + sizeof(uint16) + sizeof(uint8))
+	pair(Code::tile, dataHeadSize + sizeof(uint16) + sizeof(uint8)),
+	pair(Code::ping, dataHeadSize + sizeof(uint64)),
+	pair(Code::resume, dataHeadSize + sizeof(uint64) + sizeof(uint32))
+};
+
+using SendCall = void (*)(nsint socket, const uint8* data, uint len);
+using UnmaskCall = void (*)(uint8* data, uint len, const uint8* mask);
+using InflateCall = const vector<uint8>& (*)(nsint socket, const uint8* data, uint len);	// decompresses a permessage-deflate payload or throws Error
+using PongCall = void (*)(nsint socket, const uint8* data, uint len);	// gets the payload of a websocket pong
+
+// permessage-deflate parameters (RFC 7692), set to the server's limits before the handshake and to the negotiated values after it
+struct WsDeflateParams {
+	uint8 serverWindow = 0;	// window bits of the server's compressor, 0 if the extension isn't used
+	uint8 clientWindow = 15;	// window bits of the client's compressor
+	bool serverNoContext = false;	// the server's compressor has to be reset after every message
 };
 
 // socket functions
 addrinfo* resolveAddress(const char* addr, const char* port, int family);
 nsint createSocket(int family, int reuseaddr, int nodelay = 1);
-nsint bindSocket(const char* port, int family);
+nsint bindSocket(const char* port, int family, int reuseport = 0);
 nsint acceptSocket(nsint fd);
 int noblockSocket(nsint fd, bool noblock);
+int keepaliveSocket(nsint fd, uint interval);	// enables TCP keepalive probes after interval seconds of silence where the system supports setting it
+uint raiseFileLimit(uint fds);	// tries to let the process have that many open files up to the hard limit and returns how many it may have
 void closeSocket(nsint& fd);
 
+inline bool wouldBlock() {
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
 inline void closeSocketV(nsint fd) {
 #ifdef _WIN32
 	closesocket(fd);
@@ -128,8 +185,13 @@ inline void closeSocketV(nsint fd) {
 void sendWaitClose(nsint socket);
 void sendVersionRejection(nsint socket, bool webs);	// this might as well be sendText(const string& text)
 void sendRejection(nsint server);
+void sendFull(nsint socket);	// sends Code::full and closes the socket
 void sendData(nsint socket, const uint8* data, uint len, bool webs);
-string digestSha1(string str);
+uint writeWsHead(uint8* frame, uint len, bool deflated = false);	// writes the head of a binary websocket frame for a payload of length len (frame needs to be at least wsHeadMax - sizeof(uint32) bytes) and returns its size
+void unmaskData(uint8* data, uint len, const uint8* mask);	// xor with the repeated 4 byte websocket mask using the fastest instructions the CPU supports
+vector<pair<const char*, UnmaskCall>> unmaskCalls();	// all implementations the CPU supports with the fastest last (for tests and benchmarks)
+uint encodeBase64(const uint8* data, uint len, char* out);	// out needs to be at least base64Size(len) bytes, returns the number of written characters
+string digestSha1(const string& str);
 string encodeBase64(const string& str);
 ulong generateRandomSeed();
 
@@ -165,12 +227,78 @@ inline string readName(const uint8* data, uint8 nmask = 0xFF) {
 	return string(reinterpret_cast<const char*>(data + 1), data[0] & nmask);
 }
 
+constexpr uint base64Size(uint len) {
+	return (len + 2) / 3 * 4;
+}
+
+// streaming SHA-1 that hashes whole 64 byte blocks straight from the input
+class Sha1 {
+public:
+	static constexpr uint digestSize = 20;
+
+private:
+	static constexpr uint blockSize = 64;
+
+	uint32 state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint64 count = 0;	// in bytes
+	uint8 block[blockSize];
+
+public:
+	void update(const void* data, sizet len);
+	void finish(uint8* digest);	// digest needs to be at least digestSize bytes
+
+private:
+	void transform(const uint8* blk);
+};
+
 // network error
 struct Error : std::runtime_error {
 	using std::runtime_error::runtime_error;
 };
 
-// for sending/receiving network data (mustn't be used for both simultaneously)
+// frame that's bigger than allowed, which gets thrown as soon as its head arrives
+struct FrameError : Error {
+	using Error::Error;
+};
+
+// thread's free lists of power of two sized blocks for buffers and send queues, so that the blocks of a burst get reused instead of fragmenting the heap
+class BlockPool {
+public:
+	static constexpr uint minSize = 256;
+	static constexpr uint maxSize = 64 * 1024;	// bigger blocks aren't kept
+	static constexpr uint classLimit = 1024 * 1024;	// bytes of free blocks that a size class may keep
+
+	struct Stats {
+		ullong takes = 0;	// blocks that were needed
+		ullong misses = 0;	// the ones that had to be allocated
+		ullong trimmed = 0;	// bytes of idle blocks that got freed
+		sizet cached = 0;	// bytes in the free lists
+	};
+
+private:
+	static constexpr uint classCnt = 9;	// minSize to maxSize
+
+	struct Pool {
+		array<vector<uptr<uint8[]>>, classCnt> blocks;
+		array<sizet, classCnt> idle{};	// least amount of free blocks since the last trim, which weren't needed during that time
+		Stats stats;
+
+		~Pool();
+	};
+	static thread_local Pool pool;
+	static thread_local bool closed;	// blocks that come back while the thread ends get freed
+
+public:
+	static uint blockSize(uint len);	// size of the block for len bytes
+	static uptr<uint8[]> take(uint size);	// size must be a power of two and at least minSize
+	static void give(uptr<uint8[]>&& blk, uint size);
+	static void trim();	// free the blocks that weren't needed since the last call
+	static const Stats& stats();
+private:
+	static uint sizeClass(uint size);
+};
+
+// for sending/receiving network data (mustn't be used for both simultaneously), processed data is skipped with a read cursor and only moved when the space is needed
 class Buffer {
 public:
 	enum class Init : uint8 {
@@ -182,20 +310,34 @@ public:
 	};
 
 private:
-	static constexpr uint sizeStep = 512;
-
-	uptr<uint8[]> data;
-	uint size = sizeStep;
-	uint dlim = 0;
+	static constexpr uint initSize = 512;
+	static constexpr uint keepSize = BlockPool::maxSize;	// an emptied buffer that's bigger lets go of its memory
+	static constexpr uint recvSpill = 64 * 1024;	// stack space for received data that doesn't fit into the buffer's free space
+
+	uptr<uint8[]> data;	// null until something gets written, so that idle connections don't hold any memory
+	uint size = 0;	// always a power of two or 0 without data
+	uint dbeg = 0;	// start of unprocessed data
+	uint dend = 0;	// end of data
+	uint fragEnd = 0;	// end of the reassembled payload of a fragmented websocket message, 0 if none is being received
+	uint fragNext = 0;	// start of the next unprocessed frame behind the reassembled payload
+	uint fragSkip = 0;	// leftover headers of a reassembled message that need to be skipped when clearing it
 
 public:
-	Buffer();
+	static uint maxMessage;	// size limit of a received message, which for websocket messages also applies to the payload including all of its fragments
+	static uint maxBuffered;	// received bytes that a buffer may hold until they're processed
+
+	Buffer() = default;
+	Buffer(Buffer&&) = default;
+	~Buffer();
 
+	Buffer& operator=(Buffer&&) = default;
 	uint8& operator[](uint i);
 	uint8 operator[](uint i) const;
 	const uint8* getData() const;
 	uint getDlim() const;
+	bool capped() const;	// holds as much unprocessed data as it may
 	void clear();				// delete all
+	void release();				// give the memory of an empty buffer back to the pool
 	void clearCur(bool webs);	// delete first chunk
 
 	uint pushHead(Code code);				// should only be used for codes with fixed length (returns end position of head)
@@ -211,6 +353,7 @@ public:
 	void push(initlist<uint32> lst);
 	void push(initlist<uint64> lst);
 	void push(const string& str);
+	void push(const vector<uint8>& vec);
 	uint write(uint8 val, uint pos);
 	uint write(uint16 val, uint pos);
 	uint write(uint32 val, uint pos);
@@ -218,50 +361,56 @@ public:
 
 	void redirect(nsint socket, uint8* pos, bool sendWebs);	// doesn't clear data
 	void send(nsint socket, bool webs, bool clr = true);	// sends and clears all data
-	uint8* recv(nsint socket, bool webs);	// returns begin of data or nullptr if nothing to process yet
-	bool recvData(nsint socket);	// load recv data into buffer; returns true if the connection closed (call once before iterating over recv()
-	Init recvConn(nsint socket, bool& webs, bool& nameError, bool (*nameCheck)(const string& name));
+	uint8* recv(nsint socket, bool webs, SendCall reply = nullptr, InflateCall inflate = nullptr, PongCall pong = nullptr);	// returns begin of data or nullptr if nothing to process yet (reply sends websocket control frame responses, which are sent directly if it's null, compressed frames are a protocol error without inflate and pongs get dropped without pong)
+	bool recvData(nsint socket, bool noblock = false);	// load recv data into buffer up to maxBuffered; returns true if the connection closed (call once before iterating over recv(), noblock indicates that the socket is already non-blocking, the socket might have more data if the buffer is capped afterwards
+	Init recvConn(nsint socket, bool& webs, bool& nameError, bool (*nameCheck)(const string& name), WsDeflateParams* deflate = nullptr, InflateCall inflate = nullptr, uint8* caps = nullptr);	// deflate is null if compression isn't supported, caps gets the client's Capability flags
+	vector<uint8> save() const;	// unprocessed data with the state of a fragmented websocket message for handing it over to another process
+	void load(const vector<uint8>& state);	// restores what save returned or throws Error if it's invalid
 private:
-	bool recvHead(nsint socket, uint& ofs, uint8*& mask, bool webs);
+	bool recvHead(nsint socket, uint& ofs, uint8*& mask, bool webs, SendCall reply, InflateCall inflate, PongCall pong);
+	bool recvFragments(nsint socket, SendCall reply, PongCall pong);
+	void inflateFront(nsint socket, uint& ofs, uint plen, const uint8* mask, InflateCall inflate);
 	uint8* recvLoad(uint ofs, const uint8* mask);
-	void resendWs(nsint socket, uint hsize, uint plen, const uint8* mask);
+	void resendWs(nsint socket, uint8* frame, uint hsize, uint plen, const uint8* mask, SendCall reply, PongCall pong);
 	uint readLoadSize(bool webs) const;
-	uint checkOver(uint end);
+	static uint readWsHeadSize(const uint8* frame);
+	uint8* extend(uint len);	// reserve and return len bytes at the end
+	void reserve(uint len);	// make sure there are at least len bytes of free space at the end
 	void eraseFront(uint len);
-	void resize(uint lim, uint ofs = 0);
-	void unmask(const uint8* mask, uint ofs, uint end);
 	template <class T, class F> void pushNumber(T val, F writer);
 	template <class T, class F> void pushNumberList(initlist<T> lst, F writer);
 	template <class T> void pushRaw(const T& vec);
 	template <class T, class F> uint writeNumber(T val, uint pos, F writer);
 };
 
-inline Buffer::Buffer() :
-	data(std::make_unique<uint8[]>(sizeStep))
-{}
-
 inline uint8& Buffer::operator[](uint i) {
-	return data[i];
+	return data[dbeg+i];
 }
 
 inline uint8 Buffer::operator[](uint i) const {
-	return data[i];
+	return data[dbeg+i];
 }
 
 inline const uint8* Buffer::getData() const {
-	return data.get();
+	return data.get() + dbeg;
 }
 
 inline uint Buffer::getDlim() const {
-	return dlim;
+	return dend - dbeg;
+}
+
+inline bool Buffer::capped() const {
+	return dend - dbeg >= maxBuffered;
 }
 
 inline void Buffer::clear() {
-	eraseFront(dlim);
+	fragEnd = fragNext = fragSkip = 0;
+	eraseFront(dend - dbeg);
 }
 
 inline void Buffer::clearCur(bool webs) {
-	eraseFront(readLoadSize(webs));
+	eraseFront(readLoadSize(webs) + fragSkip);
+	fragSkip = 0;
 }
 
 inline uint Buffer::pushHead(Code code) {
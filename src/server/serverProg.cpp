@@ -1,39 +1,80 @@
-#include "server.h"
+#include "handoff.h"
 #include "log.h"
+#include "metrics.h"
+#include "poller.h"
+#include "sendQueue.h"
+#include "slab.h"
+#include "timerWheel.h"
+#include "wsDeflate.h"
+#include <atomic>
+#include <chrono>
 #include <csignal>
+#include <deque>
+#include <mutex>
 #include <random>
+#include <thread>
 #ifdef _WIN32
 #include <conio.h>
 #elif !defined(SERVICE)
 #include <termios.h>
 #endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 using namespace Com;
+using std::chrono::steady_clock;
 
 struct Player;
 
 static bool cprocValidate(nsint pfd, Player& player);
 static bool cprocPlayer(nsint pfd, Player& player);
+static bool cprocHold(nsint pfd, Player& player);
+static bool cprocSuspended(nsint pfd, Player& player);
+static void disconnectPlayers(SlabSet<nsint> dfds);
 
 // PLAYER
 
 struct Player {
 	Buffer recvb;
+	SendQueue sendq;
+	WsDeflate deflate;
+	uptr<std::deque<vector<uint8>>> replay;	// the latest messages from the partner for resending them after a resumption, null while there's no session
 	bool (*cproc)(nsint, Player&) = cprocValidate;
-	string name;
+	const string* name = nullptr;	// generated name in the lobby's set, null if the player's own one is free
 	nsint partner = INVALID_SOCKET;
+	nsint watched = INVALID_SOCKET;	// host socket of the room the player is spectating
+	steady_clock::time_point relayed{};	// when the oldest relayed data that hasn't been sent yet was received
+	steady_clock::time_point heard{};	// when data last arrived, including websocket pongs
+	steady_clock::time_point active{};	// when the player last sent a message or got back to the lobby
+	steady_clock::time_point pingSent{};	// when the last ping was sent
+	uint64 token = 0;	// for resuming the session after a disconnect, 0 if there's none
+	uint rtt = 0;	// smoothed round trip time in microseconds, 0 if unknown
+	uint replayBytes = 0;
+	uint32 relayCnt = 0;	// messages from the partner since the token was issued
+	uint32 recvCnt = 0;	// messages to the partner since the token was issued
+	uint32 watchPos = 0;	// index of the next message in the watched room's log
+	uint32 timer = 0;	// id of the player's current timer in the worker's timer wheel
+	uint32 lobbyVer = 0;	// channel version of the last room list or batch the player got
+	uint8 channel = 0;	// index of the lobby channel
+	uint8 caps = CAP_NONE;
 	bool webs = false;
+	bool stale = false;	// lobby updates have been dropped, so the room list needs to be resent
+	bool dirty = false;	// has data to flush at the end of the current poll iteration
+	bool pinged = false;	// a websocket ping was sent and nothing arrived since
 };
 
+using PlayerMap = SlabMap<nsint, Player>;	// the records of idle connections make up most of the memory with lots of players
+
 // PLAYER ERROR
 
 struct PlayerError {
-	const uset<nsint> pfds;
+	const SlabSet<nsint> pfds;
 
-	PlayerError(uset<nsint>&& fds);
+	PlayerError(SlabSet<nsint>&& fds);
 	PlayerError(initlist<nsint> fds);
 };
 
-PlayerError::PlayerError(uset<nsint>&& fds) :
+PlayerError::PlayerError(SlabSet<nsint>&& fds) :
 	pfds(std::move(fds))
 {}
 
@@ -41,6 +82,123 @@ PlayerError::PlayerError(initlist<nsint> fds) :
 	pfds(fds)
 {}
 
+// ROOM
+
+// message for the spectators of a room, which gets encoded once and shared by all of them
+struct SpectatorFrame {
+	sptr<const vector<uint8>> raw;
+	sptr<const vector<uint8>> webs;	// the same in a websocket frame, null until a websocket spectator needs it
+};
+
+// worker's part of a room that's hosted by one of its players
+struct Room {
+	string name;
+	vector<nsint> spectators;
+	vector<SpectatorFrame> log;	// spectated messages of the current game for spectators that join late or fall behind
+	uint logBytes = 0;
+	bool watchable = false;	// a game has started and the log has all of it
+};
+
+// LOBBY
+
+// rooms and generated player names of all workers
+struct Lobby {
+	struct Room {
+		string name;
+		nsint guest = INVALID_SOCKET;
+		uint worker;
+		uint8 channel;
+		uint latency = 0;	// estimated microseconds for a message from one player to reach the other, 0 if unknown
+	};
+
+	// part of the lobby whose players only see its rooms and messages
+	struct Channel {
+		string name;
+		SlabMap<string, nsint> roomNames;	// room name, host socket
+		sptr<const vector<uint8>> list;	// serialized rooms (amount + flags + names), null if they changed since
+		uint listSize = sizeof(uint16);	// of the serialized rooms, which is kept even while list is null
+		SlabSet<string> changes;	// names of the rooms that changed since the last batch
+		std::deque<vector<uint8>> batches;	// the latest Code::rdelta messages for players that fell behind
+		uint32 version = 0;	// of the last batch
+		uint players = 0;	// including the ones in rooms
+	};
+
+	std::mutex mutex;
+	SlabMap<nsint, Room> rooms;	// host socket, room info
+	vector<Channel> channels;	// the first one is the default channel without a name
+	SlabSet<string> names;
+};
+
+// WORKER
+
+// message from one worker to another
+struct Post {
+	enum class Type : uint8 {
+		lobby,		// frame for every player in the lobby except "except"
+		migrate,	// player who wants to join the room "room" or resume the session or watch the room in "data" on the receiving worker
+		dump		// print the player table
+	};
+
+	Type type;
+	nsint except = INVALID_SOCKET;
+	uint8 channel = 0;	// of the lobby frame
+	vector<uint8> data;	// lobby frame or resume or watch request
+	string room;
+	PlayerMap::node_type player;
+};
+
+// counters that are only written by their worker
+struct Stats {
+	std::atomic<ullong> frames = 0;	// messages queued for sending
+	std::atomic<ullong> sends = 0;	// send calls that were needed to flush them
+	std::atomic<ullong> deflateIn = 0;	// size of messages that got compressed
+	std::atomic<ullong> deflateOut = 0;	// their size after compression
+	std::atomic<ullong> accepts = 0;
+	std::atomic<ullong> rejects = 0;	// connections that got turned away because the server was full
+	std::atomic<ullong> handshakeTimeouts = 0;	// connections that didn't finish the handshake in time
+	std::atomic<ullong> idleTimeouts = 0;	// players who got disconnected for being idle in the lobby
+	std::atomic<ullong> heartbeatTimeouts = 0;	// players who didn't answer a ping
+	std::atomic<ullong> suspends = 0;	// disconnected players whose room was kept for a resumption
+	std::atomic<ullong> resumes = 0;	// players who got back into their room
+	std::atomic<ullong> resumeRejects = 0;	// resume requests with an unknown token or too many missed messages
+	std::atomic<ullong> spectated = 0;	// messages between the players of a room that got shared with its spectators
+	std::atomic<ullong> splicedMsgs = 0;	// relayed messages that went from socket to socket through a pipe
+	std::atomic<ullong> splicedBytes = 0;
+	std::atomic<ullong> frameRejects = 0;	// players who sent a frame or message over the size limit
+	std::atomic<ullong> bufferRejects = 0;	// players whose unprocessed data reached the receive limit
+	array<std::atomic<ullong>, uint8(Code::message) + 1> relayedMsgs{};	// messages forwarded to other players by code
+	array<std::atomic<ullong>, uint8(Code::message) + 1> relayedBytes{};
+	Histogram relayLatency;	// microseconds from receiving a message until its partner's queue is flushed
+	Histogram queueDepth;	// queued bytes of a player before a flush
+	Histogram pollDuration;	// microseconds spent processing the events of a poll iteration
+	Histogram rtt;	// microseconds from sending a ping until its answer arrived
+	Histogram roomLatency;	// estimated microseconds for a message from one player of a room to the other
+	std::atomic<ullong> blockTakes = 0;	// copied from the worker's BlockPool
+	std::atomic<ullong> blockMisses = 0;
+	std::atomic<ullong> blockTrimmed = 0;
+	std::atomic<ullong> blockCached = 0;
+	std::atomic<ullong> slabBytes = 0;	// copied from the worker's Slab
+	std::atomic<ullong> slabFree = 0;
+
+	static void add(std::atomic<ullong>& cnt, ullong val);
+};
+
+void Stats::add(std::atomic<ullong>& cnt, ullong val) {
+	cnt.store(cnt.load(std::memory_order_relaxed) + val, std::memory_order_relaxed);	// no need for an atomic increment with only one writer
+}
+
+// thread with its own listening socket and shard of players and rooms
+struct Worker {
+	std::thread thread;
+	std::mutex mutex;
+	vector<Post> inbox;
+	Stats stats;
+	nsint server = INVALID_SOCKET;
+	int wakefd = -1;
+	Snapshot shard;	// players, rooms and posts for the next server or from the previous one
+	vector<nsint> shardFds;	// sockets of the players in the shard
+};
+
 // TERMINAL
 
 #if !defined(_WIN32) && !defined(SERVICE)
@@ -69,45 +227,350 @@ Terminal::~Terminal() {
 
 constexpr uint32 checkTimeout = 500;
 constexpr uint defaultMaxPlayers = 1024;
-constexpr uint maxPlayersLimit = 2040;
+constexpr uint roomListMax = UINT16_MAX - dataHeadSize - sizeof(uint16);	// serialized rooms that fit into a room list message with the biggest extra data
+constexpr uint spareFiles = 64;	// for metrics connections, logs and handoffs besides the sockets of players and workers
+constexpr uint maxWorkers = 64;
+constexpr uint maxChannels = 64;
+constexpr uint defaultLobbyMark = 64 * 1024;
+constexpr uint defaultQueueLimit = 1024 * 1024;
+constexpr uint defaultRecvLimit = 256 * 1024;
+constexpr uint defaultDeflateMin = 128;
+constexpr uint defaultDeltaWindow = 50;
+constexpr uint lobbyHistory = 64;	// number of kept batches
+constexpr uint defaultHandshakeTimeout = 10;
+constexpr uint defaultHeartbeat = 30;
+constexpr uint defaultPingInterval = 10;
+constexpr uint defaultResumeGrace = 30;
+constexpr uint defaultReplayLimit = 64 * 1024;
+constexpr uint defaultSpectatorLimit = 256;
+constexpr uint maxTimeout = uint(std::chrono::duration_cast<std::chrono::seconds>(TimerWheel::tick * TimerWheel::maxDelay).count());	// as far as the timer wheel reaches, so that no deadline fires early
+constexpr uint trimInterval = 10;	// seconds after which free blocks that weren't needed get released
+constexpr uint handoffRequestTimeout = 2;	// seconds a new server has to send its version
+constexpr char msgSendQueueFull[] = "Send queue full";
 constexpr char argPort = 'p';
 constexpr char arg4 = '4';
 constexpr char arg6 = '6';
 constexpr char argMaxPlayers = 'c';
 constexpr char argLog = 'l';
 constexpr char argMaxLogs = 'm';
-constexpr char	argVerbose = 'v';
+constexpr char argVerbose = 'v';
+constexpr char argWorkers = 'w';
+constexpr char argLobbyMark = 'b';
+constexpr char argQueueLimit = 'q';
+constexpr char argDeflateMin = 'z';
+constexpr char argMaxMessage = 'f';
+constexpr char argMetrics = 'e';
+constexpr char argDeltaWindow = 'd';
+constexpr char argChannels = 'j';
+constexpr char argHandshakeTimeout = 't';
+constexpr char argHeartbeat = 'k';
+constexpr char argIdleTimeout = 'i';
+constexpr char argPingInterval = 'r';
+constexpr char argResumeGrace = 'g';
+constexpr char argReplayLimit = 'y';
+constexpr char argSpectators = 'a';
+constexpr char argHandoff = 'u';
+constexpr char argSplice = 'x';
+constexpr char argRecvLimit = 's';
+constexpr array<const char*, uint8(Code::message) + 1> codeLabels = {
+	"code=\"version\"", "code=\"full\"", "code=\"rlistcon\"", "code=\"rlist\"", "code=\"rnew\"", "code=\"cnrnew\"", "code=\"rerase\"", "code=\"ropen\"",
+	"code=\"glmessage\"", "code=\"join\"", "code=\"leave\"", "code=\"thost\"", "code=\"kick\"", "code=\"hello\"", "code=\"cnjoin\"", "code=\"config\"",
+	"code=\"start\"", "code=\"setup\"", "code=\"move\"", "code=\"kill\"", "code=\"breach\"", "code=\"tile\"", "code=\"record\"", "code=\"message\""
+};
 
-static bool running = true;
+static std::atomic<bool> running = true;
 static uint maxPlayers;
-static Buffer sendb;
-static umap<nsint, Player> players;	// socket, player data
-static umap<nsint, string> rooms;	// host socket, room name
+static std::atomic<uint> playerCnt = 0;
+static uint workerCnt = 1;
+static uint lobbyMark = defaultLobbyMark;	// queued bytes of a player above which lobby updates get dropped and spectated messages held back
+static uint queueLimit = defaultQueueLimit;	// queued bytes of a player above which it gets disconnected
+static uint deflateMin = WsDeflate::supported ? defaultDeflateMin : 0;	// smallest message that gets compressed for websocket players, 0 if permessage-deflate is off
+static uint deltaWindow = defaultDeltaWindow;	// milliseconds during which room changes are collected into one batch
+static std::chrono::seconds handshakeTimeout(defaultHandshakeTimeout);	// time a new connection has to finish the handshake
+static std::chrono::seconds heartbeat(defaultHeartbeat);	// silence after which a player gets probed and then has as long to answer, 0 if off
+static std::chrono::seconds idleTimeout(0);	// time after which a player in the lobby who doesn't send anything gets disconnected, 0 if off
+static std::chrono::seconds pingInterval(defaultPingInterval);	// time between pings for measuring round trip times, 0 if off
+static std::chrono::seconds resumeGrace(defaultResumeGrace);	// time a disconnected player's room is kept for a resumption, 0 if off
+static uint replayLimit = defaultReplayLimit;	// bytes of the latest messages from the partner that are kept for a resumption
+static uint spectatorLimit = defaultSpectatorLimit;	// spectators per room, 0 if spectating is off
+static uint spliceMin = 0;	// smallest message that gets relayed with splice between raw TCP players, 0 if off
+static uptr<Worker[]> workers;
+static Lobby lobby;
 static Log slog;
-static std::default_random_engine randGen;
+static MetricsServer metrics;
+static Handoff handoff;
+static nsint handoffConn = INVALID_SOCKET;	// new server that's taking over
+static nsint handoffPending = INVALID_SOCKET;	// new server whose version hasn't arrived yet
+static steady_clock::time_point handoffDue;	// when the pending server gets dropped
+static umap<nsint, nsint> handedFds;	// the previous server's socket numbers to the ones in this process
+constexpr array<bool (*)(nsint, Player&), 4> cprocs = { cprocValidate, cprocPlayer, cprocHold, cprocSuspended };	// for saving a player's state
 static std::uniform_int_distribution<uint16> randNameDist(1, UINT16_MAX);	// 0 is reserved to indicate a not taken player name
 
+static thread_local uint wid = 0;	// index of the current thread's worker
+static thread_local Poller poller;
+static thread_local TimerWheel timers;	// every player has one timer, which gets checked and rescheduled when it expires
+static thread_local Buffer sendb;
+static thread_local PlayerMap players;	// socket, player data
+static thread_local vector<PlayerMap::node_type> dropped;	// disconnected players that are kept alive until the end of the current poll iteration
+static thread_local vector<tuple<nsint, uint, string, vector<uint8>>> migrations;	// players waiting to be moved to another worker (socket, worker, room name, resume or watch request)
+static thread_local SlabMap<nsint, Room> rooms;	// host socket, room data
+static thread_local vector<nsint> dirty;	// players with data to flush at the end of the current poll iteration
+static thread_local SlabMap<uint64, nsint> sessions;	// resume token, player socket
+static thread_local std::default_random_engine randGen;
+static thread_local std::random_device randDev;	// for tokens, which mustn't be predictable
+static thread_local steady_clock::time_point polled;	// when the current poll iteration's events arrived
+static thread_local steady_clock::time_point deltaDue;	// when to send the pending room changes if this worker started the batch
+static thread_local steady_clock::time_point trimDue;	// when to release the free blocks that weren't needed since the last time
+#ifdef __linux__
+static thread_local array<int, 2> splicePipe = { -1, -1 };	// empty between messages, so that it doesn't belong to any player
+static thread_local vector<uint8> spliceCopy;	// spliced message that also has to be kept for a resumption or spectators
+#endif
+
 static uint maxRooms() {
 	return maxPlayers / 2 + maxPlayers % 2;
 }
 
+static void post(uint id, Post&& msg) {
+	Worker& wrk = workers[id];
+	{
+		std::lock_guard lock(wrk.mutex);
+		wrk.inbox.push_back(std::move(msg));
+	}
+#ifdef __linux__
+	uint64 cnt = 1;
+	if (write(wrk.wakefd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		slog.err("failed to wake worker ", id);
+#endif
+}
+
+static void postLobby(const uint8* data, uint len, nsint except, uint8 channel) {
+	for (uint i = 0; i < workerCnt; ++i)
+		if (i != wid)
+			post(i, Post{ Post::Type::lobby, except, channel, vector<uint8>(data, data + len), string(), {} });
+}
+
 template <class T>
-void rekeyRoom(T room, nsint key) {
-	umap<nsint, string>::node_type rnode = rooms.extract(room);
+void rekeyRoom(T room, nsint key, nsint guest) {
+	SlabMap<nsint, Room>::node_type rnode = rooms.extract(room);
+	nsint host = rnode.key();
 	rnode.key() = key;
+	for (nsint it : rnode.mapped().spectators)
+		players.at(it).watched = key;
 	rooms.insert(std::move(rnode));
+
+	std::lock_guard lock(lobby.mutex);
+	SlabMap<nsint, Lobby::Room>::node_type lnode = lobby.rooms.extract(host);
+	lnode.key() = key;
+	lnode.mapped().guest = guest;
+	lnode.mapped().latency = 0;
+	Lobby::Channel& chan = lobby.channels[lnode.mapped().channel];
+	chan.roomNames.at(lnode.mapped().name) = key;
+	chan.list.reset();
+	lobby.rooms.insert(std::move(lnode));
+}
+
+static void setRoomGuest(nsint host, nsint guest) {
+	std::lock_guard lock(lobby.mutex);
+	Lobby::Room& room = lobby.rooms.at(host);
+	room.guest = guest;
+	room.latency = 0;
+	lobby.channels[room.channel].list.reset();
+}
+
+static bool inLobby(nsint pfd, const Player& player) {
+	return player.cproc == cprocPlayer && player.partner == INVALID_SOCKET && player.watched == INVALID_SOCKET && !rooms.count(pfd);
+}
+
+static void markDirty(nsint pfd, Player& player) {
+	if (!player.dirty) {
+		player.dirty = true;
+		dirty.push_back(pfd);
+	}
+}
+
+static void checkQueue(nsint pfd, Player& player) {	// after a message was queued
+	Stats::add(workers[wid].stats.frames, 1);
+	if (player.sendq.size() > queueLimit)
+		throw Error(msgSendQueueFull);
+	markDirty(pfd, player);
+}
+
+static void sendPlayer(nsint pfd, Player& player, const uint8* data, uint len, bool webs) {
+	if (webs && len >= deflateMin && player.deflate.enabled()) {
+		const vector<uint8>& cdat = player.deflate.deflate(data, len);
+		uint8 frame[wsHeadMax];
+		player.sendq.pushRaw(frame, writeWsHead(frame, uint(cdat.size()), true));
+		player.sendq.pushRaw(cdat.data(), uint(cdat.size()));
+		Stats::add(workers[wid].stats.deflateIn, len);
+		Stats::add(workers[wid].stats.deflateOut, cdat.size());
+	} else
+		player.sendq.push(data, len, webs);
+	checkQueue(pfd, player);
+}
+
+static void sendBuffer(nsint pfd, Player& player) {
+	try {
+		sendPlayer(pfd, player, sendb.getData(), sendb.getDlim(), player.webs);
+	} catch (const Error&) {
+		sendb.clear();
+		throw;
+	}
+	sendb.clear();
+}
+
+static void sendControl(nsint pfd, const uint8* data, uint len) {
+	sendPlayer(pfd, players.at(pfd), data, len, false);	// websocket control frames are already complete
+}
+
+static const vector<uint8>& inflateFrame(nsint pfd, const uint8* data, uint len) {
+	return players.at(pfd).deflate.inflate(data, len);
+}
+
+static uint64 pingStamp(steady_clock::time_point time) {
+	return uint64(std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count());
+}
+
+static void sendPing(nsint pfd, Player& player) {
+	if (player.webs) {	// browsers answer websocket pings by themselves
+		uint8 frame[wsHeadMin + sizeof(uint64)] = { 0x89, sizeof(uint64) };
+		write64(frame + wsHeadMin, pingStamp(polled));
+		player.sendq.pushRaw(frame, sizeof(frame));
+		checkQueue(pfd, player);
+	} else {
+		sendb.pushHead(Code::ping);
+		sendb.push(pingStamp(polled));
+		sendBuffer(pfd, player);
+	}
+	player.pingSent = polled;
+	player.pinged = true;
+}
+
+static void recordRtt(nsint pfd, Player& player, uint64 stamp) {
+	if (stamp != pingStamp(player.pingSent))	// only the answer to the latest ping counts, so that a client can't make up times
+		return;
+	uint sample = uint(std::chrono::duration_cast<std::chrono::microseconds>(polled - player.pingSent).count());
+	player.rtt = player.rtt ? uint((ullong(player.rtt) * 7 + sample) / 8) : sample;
+	Stats& stats = workers[wid].stats;
+	stats.rtt.observe(sample);
+	if (PlayerMap::iterator partner = players.find(player.partner); partner != players.end() && partner->second.rtt) {
+		uint latency = (player.rtt + partner->second.rtt) / 2;	// half a round trip from one player to the server and half from the server to the other
+		stats.roomLatency.observe(latency);
+		std::lock_guard lock(lobby.mutex);
+		lobby.rooms.at(rooms.count(pfd) ? pfd : partner->first).latency = latency;
+	}
+}
+
+static void recvPong(nsint pfd, const uint8* data, uint len) {
+	if (len == sizeof(uint64))
+		recordRtt(pfd, players.at(pfd), read64(data));
+}
+
+static void keepRelayed(Player& player, const uint8* data, uint len) {	// for resending a message from the partner after a resumption
+	if (player.token) {
+		if (!player.replay)
+			player.replay = std::make_unique<std::deque<vector<uint8>>>();
+		player.replay->emplace_back(data, data + len);
+		player.replayBytes += len;
+		++player.relayCnt;
+		for (; player.replayBytes > replayLimit; player.replay->pop_front())
+			player.replayBytes -= uint(player.replay->front().size());
+	}
+}
+
+static void sendRelayed(nsint pfd, Player& player, const uint8* data, uint len) {	// for messages from the partner, which only get kept while the player is suspended
+	keepRelayed(player, data, len);
+	if (player.cproc != cprocSuspended) {
+		sendPlayer(pfd, player, data, len, player.webs);
+		if (player.relayed == steady_clock::time_point())
+			player.relayed = polled;
+	}
+}
+
+static sizet replaySize(const Player& player) {
+	return player.replay ? player.replay->size() : 0;
+}
+
+static void relayBuffer(nsint pfd, Player& player) {
+	try {
+		sendRelayed(pfd, player, sendb.getData(), sendb.getDlim());
+	} catch (const Error&) {
+		sendb.clear();
+		throw;
+	}
+	sendb.clear();
+}
+
+static void dropToken(Player& player) {
+	if (player.token) {
+		sessions.erase(player.token);
+		player.token = 0;
+		player.replay.reset();
+		player.replayBytes = 0;
+	}
+}
+
+static uint64 newToken(nsint pfd) {
+	uint64 token;
+	do {
+		token = ((uint64(randDev()) << 32 | randDev()) & ~uint64(maxWorkers - 1)) | wid;	// the lowest bits tell which worker has the session
+	} while (!token || !sessions.emplace(token, pfd).second);
+	return token;
+}
+
+static void sendToken(nsint pfd, Player& player) {
+	sendb.pushHead(Code::resume);
+	sendb.push(player.token);
+	sendb.push(player.recvCnt);
+	sendBuffer(pfd, player);
+}
+
+static void startSession(nsint pfd, Player& player) {	// when the player's room fills up
+	if (resumeGrace.count() && (player.caps & CAP_RESUME)) {
+		dropToken(player);
+		player.token = newToken(pfd);
+		player.relayCnt = player.recvCnt = 0;
+		sendToken(pfd, player);
+	}
+}
+
+static sptr<const vector<uint8>> roomList(Lobby::Channel& chan) {	// lobby.mutex has to be locked
+	if (!chan.list) {
+		vector<uint8> list(sizeof(uint16));
+		write16(list.data(), uint16(chan.roomNames.size()));
+		for (auto& [name, host] : chan.roomNames) {
+			list.push_back(uint8(((lobby.rooms.at(host).guest == INVALID_SOCKET) << 7) | name.length()));
+			list.insert(list.end(), name.begin(), name.end());
+		}
+		chan.list = std::make_shared<const vector<uint8>>(std::move(list));
+	}
+	return chan.list;
 }
 
 static void sendRoomList(nsint pfd, Player& player, Code code, initlist<uint8> extra = {}) {
-	uint ofs = sendb.pushHead(code, 0) - sizeof(uint16);
+	sptr<const vector<uint8>> list;
+	{
+		std::lock_guard lock(lobby.mutex);
+		Lobby::Channel& chan = lobby.channels[player.channel];
+		list = roomList(chan);
+		player.lobbyVer = chan.version;	// pending changes are already in the list and batches don't mind being applied twice
+	}
+	uint len = dataHeadSize + uint(extra.size() + list->size());
+	sendb.pushHead(code, uint16(len));
 	sendb.push(extra);
-	sendb.push(uint16(rooms.size()));
-	for (auto& [host, name] : rooms) {
-		sendb.push({ uint8(((players.at(host).partner == INVALID_SOCKET) << 7) | name.length()) });
-		sendb.push(name);
+	if (player.webs && len >= deflateMin && player.deflate.enabled()) {	// every player has its own compression context
+		sendb.push(*list);
+		sendBuffer(pfd, player);
+	} else {
+		if (player.webs) {
+			uint8 frame[wsHeadMax];
+			player.sendq.pushRaw(frame, writeWsHead(frame, len));
+		}
+		player.sendq.pushRaw(sendb.getData(), sendb.getDlim());	// only the head differs between players
+		player.sendq.pushShared(list);
+		sendb.clear();
+		checkQueue(pfd, player);
 	}
-	sendb.write(uint16(sendb.getDlim()), ofs);
-	sendb.send(pfd, player.webs);
+	player.stale = false;
 }
 
 static void sendConnRoomList(nsint pfd, Player& player, bool nameClash) {
@@ -115,11 +578,12 @@ static void sendConnRoomList(nsint pfd, Player& player, bool nameClash) {
 		uint16 nresp = 0;
 		if (nameClash) {
 			string name;
+			std::lock_guard lock(lobby.mutex);
 			do {
 				nresp = randNameDist(randGen);
 				name = toStr<16>(nresp);
-			} while (std::any_of(players.begin(), players.end(), [&name](const pair<const nsint, Player>& it) -> bool { return it.second.name == name; }));
-			player.name = std::move(name);
+			} while (lobby.names.count(name));
+			player.name = &*lobby.names.insert(std::move(name)).first;
 		}
 		uint8 nrbuf[2];
 		write16(nrbuf, nresp);
@@ -129,30 +593,91 @@ static void sendConnRoomList(nsint pfd, Player& player, bool nameClash) {
 		slog.err("failed to send room list to player ", pfd, ": ", err.what());
 		throw PlayerError{ pfd };
 	}
+	{
+		std::lock_guard lock(lobby.mutex);
+		++lobby.channels[player.channel].players;
+	}
+	player.active = polled;
 	player.cproc = cprocPlayer;
+	player.timer = timers.schedule(pfd, polled);	// replaces the handshake deadline, so that the player's timeouts and pings start now
 }
 
-static void sendRoomData(Code code, const string& name, initlist<uint8> extra, uset<nsint>& errPfds) {
-	uint ofs = sendb.pushHead(code, 0) - sizeof(uint16);
-	sendb.push(extra);
-	sendb.push(uint8(name.length()));
-	sendb.push(name);
-	sendb.write(uint16(sendb.getDlim()), ofs);
+static bool wantsLobbyData(const Player& player, Code code, uint32 version) {
+	if (code == Code::glmessage)
+		return true;
+	if (!(player.caps & CAP_ROOM_DELTA))
+		return code != Code::rdelta;
+	return code == Code::rdelta && version > player.lobbyVer;	// the batch might already be in a room list the player got
+}
+
+static void sendLobby(const uint8* data, uint len, nsint except, uint8 channel, SlabSet<nsint>& errPfds) {
+	Code code = Code(data[0]);
+	bool roomData = code != Code::glmessage;
+	uint32 version = code == Code::rdelta ? read32(data + dataHeadSize) : 0;
 	for (auto& [pfd, player] : players)
-		if (player.partner == INVALID_SOCKET && !rooms.count(pfd)) {
+		if (player.channel == channel && pfd != except && inLobby(pfd, player) && wantsLobbyData(player, code, version)) {
 			try {
-				sendb.send(pfd, player.webs, false);
+				if (player.sendq.size() <= lobbyMark && !(player.stale && roomData)) {
+					sendPlayer(pfd, player, data, len, player.webs);
+					if (code == Code::rdelta)
+						player.lobbyVer = version;
+				} else if (roomData) {	// drop updates for players that can't keep up and resync them once they've caught up
+					player.stale = true;
+					markDirty(pfd, player);
+				}
 			} catch (const Error& err) {
 				errPfds.insert(pfd);
-				slog.err("failed to send room data ", uint(code), " of ", name, " to player ", pfd, ": ", err.what());
+				slog.err("failed to send lobby data ", uint(data[0]), " to player ", pfd, ": ", err.what());
 			}
 		}
+}
+
+static void recordRoomChange(uint8 channel, const string& name) {	// has to come after the change to lobby.rooms, because the batch gets the room's state from there
+	std::lock_guard lock(lobby.mutex);
+	Lobby::Channel& chan = lobby.channels[channel];
+	if (chan.changes.empty() && deltaDue == steady_clock::time_point())	// the worker that starts a batch sends it along with the other channels' pending changes
+		deltaDue = steady_clock::now() + std::chrono::milliseconds(deltaWindow);
+	chan.changes.insert(name);
+}
+
+static void resyncLobby(nsint pfd, Player& player) {
+	if (player.caps & CAP_ROOM_DELTA) {
+		vector<vector<uint8>> missed;
+		bool kept;
+		{
+			std::lock_guard lock(lobby.mutex);
+			const Lobby::Channel& chan = lobby.channels[player.channel];
+			uint32 behind = chan.version - player.lobbyVer;
+			if (kept = behind <= chan.batches.size(); kept)
+				missed.assign(chan.batches.end() - pdift(behind), chan.batches.end());
+		}
+		if (kept) {	// catching up with the missed batches is cheaper than a new room list
+			for (const vector<uint8>& it : missed) {
+				sendPlayer(pfd, player, it.data(), uint(it.size()), player.webs);
+				player.lobbyVer = read32(it.data() + dataHeadSize);
+			}
+			player.stale = false;
+			return;
+		}
+	}
+	sendRoomList(pfd, player, Code::rlist);
+}
+
+static void sendRoomData(Code code, uint8 channel, const string& name, initlist<uint8> extra, SlabSet<nsint>& errPfds) {
+	recordRoomChange(channel, name);
+	uint ofs = sendb.pushHead(code, 0) - sizeof(uint16);
+	sendb.push(extra);
+	sendb.push(uint8(name.length()));
+	sendb.push(name);
+	sendb.write(uint16(sendb.getDlim()), ofs);
+	sendLobby(sendb.getData(), sendb.getDlim(), INVALID_SOCKET, channel, errPfds);
+	postLobby(sendb.getData(), sendb.getDlim(), INVALID_SOCKET, channel);
 	sendb.clear();
 }
 
-static void sendRoomData(Code code, const string& name, initlist<uint8> extra = {}) {
-	uset<nsint> errPfds;
-	if (sendRoomData(code, name, extra, errPfds); !errPfds.empty())
+static void sendRoomData(Code code, uint8 channel, const string& name, initlist<uint8> extra = {}) {
+	SlabSet<nsint> errPfds;
+	if (sendRoomData(code, channel, name, extra, errPfds); !errPfds.empty())
 		throw PlayerError(std::move(errPfds));
 }
 
@@ -161,81 +686,170 @@ static void createRoom(const uint8* data, nsint pfd, Player& player) {
 	CncrnewCode code = CncrnewCode::ok;
 	if (name.length() > roomNameLimit)
 		code = CncrnewCode::length;
-	else if (rooms.size() >= maxRooms())
-		code = CncrnewCode::full;
-	else if (std::any_of(rooms.begin(), rooms.end(), [&name](const pair<const nsint, string>& it) -> bool { return it.second == name; }))
-		code = CncrnewCode::taken;
+	else {
+		std::lock_guard lock(lobby.mutex);
+		Lobby::Channel& chan = lobby.channels[player.channel];
+		if (lobby.rooms.size() >= maxRooms() || chan.listSize + sizeof(uint8) + name.length() > roomListMax)	// the channel's room list has to fit into one message
+			code = CncrnewCode::full;
+		else if (chan.roomNames.count(name))
+			code = CncrnewCode::taken;
+		else {
+			lobby.rooms.emplace(pfd, Lobby::Room{ name, INVALID_SOCKET, wid, player.channel });	// reserve the name before anyone else can take it
+			chan.roomNames.emplace(name, pfd);
+			chan.listSize += uint(sizeof(uint8) + name.length());
+			chan.list.reset();
+		}
+	}
 
 	try {
 		sendb.pushHead(Code::cnrnew);
 		sendb.push(uint8(code));
-		sendb.send(pfd, player.webs);
+		sendBuffer(pfd, player);
 	} catch (const Error& err) {
-		sendb.clear();
 		slog.err("failed to send host ", code == CncrnewCode::ok ? "accept" : "rejection", " to player ", pfd, ": ", err.what());
+		if (code == CncrnewCode::ok) {
+			std::lock_guard lock(lobby.mutex);
+			Lobby::Channel& chan = lobby.channels[player.channel];
+			lobby.rooms.erase(pfd);
+			chan.roomNames.erase(name);
+			chan.listSize -= uint(sizeof(uint8) + name.length());
+			chan.list.reset();
+		}
 		throw PlayerError{ pfd };
 	}
 	if (code == CncrnewCode::ok) {
-		umap<nsint, string>::iterator it = rooms.emplace(pfd, std::move(name)).first;
-		sendRoomData(Code::rnew, it->second);
+		SlabMap<nsint, Room>::iterator it = rooms.emplace(pfd, Room()).first;
+		it->second.name = std::move(name);
+		sendRoomData(Code::rnew, player.channel, it->second.name);
 	}
 }
 
-static void joinRoom(const uint8* data, nsint pfd, Player& player) {
-	string name = readName(data);
-	umap<nsint, string>::iterator room = std::find_if(rooms.begin(), rooms.end(), [&name](const pair<const nsint, string>& it) -> bool { return it.second == name; });
-	if (umap<nsint, Player>::iterator host = room != rooms.end() ? players.find(room->first) : players.end(); host != players.end() && host->second.partner == INVALID_SOCKET) {
+static void joinRoom(const string& name, nsint pfd, Player& player) {
+	nsint hfd = INVALID_SOCKET;
+	uint hwid = wid;
+	{
+		std::lock_guard lock(lobby.mutex);
+		const SlabMap<string, nsint>& names = lobby.channels[player.channel].roomNames;
+		if (SlabMap<string, nsint>::const_iterator it = names.find(name); it != names.end())
+			if (const Lobby::Room& room = lobby.rooms.at(it->second); room.guest == INVALID_SOCKET) {
+				hfd = it->second;
+				hwid = room.worker;
+			}
+	}
+	if (hwid != wid) {	// the host's worker handles the join after the player has been moved there
+		player.cproc = cprocHold;
+		migrations.emplace_back(pfd, hwid, name, vector<uint8>());
+		return;
+	}
+
+	if (PlayerMap::iterator host = players.find(hfd); host != players.end() && host->second.partner == INVALID_SOCKET) {
 		try {
+			startSession(hfd, host->second);	// the host answers the join request right away, which already counts for the session
 			sendb.pushHead(Code::hello);
-			sendb.send(room->first, host->second.webs);
+			relayBuffer(hfd, host->second);
 		} catch (const Error& err) {
-			slog.err("failed to send join request from player ", pfd, " to player ", room->first, ": ", err.what());
-			sendb.clear();
+			slog.err("failed to send join request from player ", pfd, " to player ", hfd, ": ", err.what());
 			try {
 				sendb.pushHead(Code::cnjoin, Com::dataHeadSize + 1);
 				sendb.push(uint8(false));
-				sendb.send(pfd, player.webs);
+				sendBuffer(pfd, player);
 			} catch (const Error& e) {
-				sendb.clear();
 				slog.err("failed to send join rejection to player ", pfd, ": ", e.what());
-				throw PlayerError{ pfd, room->first };
+				throw PlayerError{ pfd, hfd };
 			}
-			throw PlayerError{ room->first };
+			throw PlayerError{ hfd };
 		}
-		player.partner = room->first;
+		player.partner = hfd;
 		host->second.partner = pfd;
-		sendRoomData(Code::ropen, name, { uint8(false) });
+		setRoomGuest(hfd, pfd);
+		try {
+			startSession(pfd, player);
+		} catch (const Error& err) {
+			slog.err("failed to send resume token to player ", pfd, ": ", err.what());
+			throw PlayerError{ pfd };
+		}
+		sendRoomData(Code::ropen, player.channel, name, { uint8(false) });
 	} else {
 		try {
 			sendb.pushHead(Code::cnjoin, Com::dataHeadSize + 1);
 			sendb.push(uint8(false));
-			sendb.send(pfd, player.webs);
+			sendBuffer(pfd, player);
 		} catch (const Error& err) {
-			sendb.clear();
 			slog.err("failed to send join rejection to player ", pfd, ": ", err.what());
 			throw PlayerError{ pfd };
 		}
 	}
 }
 
+static void catchUp(nsint pfd, Player& player, Room& room) {	// queues the messages of the watched room that the spectator hasn't got yet until it falls behind
+	if (player.watchPos >= room.log.size() || player.sendq.size() > lobbyMark)
+		return;
+	do {
+		SpectatorFrame& frame = room.log[player.watchPos];
+		if (player.webs && !frame.webs) {	// not compressed, since every player has its own compression context
+			uint8 head[wsHeadMax];
+			vector<uint8> wsf(head, head + writeWsHead(head, uint(frame.raw->size())));
+			wsf.insert(wsf.end(), frame.raw->begin(), frame.raw->end());
+			frame.webs = std::make_shared<const vector<uint8>>(std::move(wsf));
+		}
+		player.sendq.pushShared(player.webs ? frame.webs : frame.raw);	// the queue doesn't get over the mark by more than one message, so it's never full
+		Stats::add(workers[wid].stats.frames, 1);
+	} while (++player.watchPos < room.log.size() && player.sendq.size() <= lobbyMark);
+	markDirty(pfd, player);
+}
+
+static void dismissSpectators(Room& room, SlabSet<nsint>& errPfds) {	// sends the spectators back to the lobby when the room's game ends
+	for (nsint sfd : room.spectators) {
+		Player& spec = players.at(sfd);
+		spec.watched = INVALID_SOCKET;
+		spec.active = polled;
+		try {
+			sendRoomList(sfd, spec, Code::kick);
+		} catch (const Error& err) {
+			slog.err("failed to send room list to spectator ", sfd, ": ", err.what());
+			errPfds.insert(sfd);
+		}
+	}
+	room.spectators.clear();
+	room.log.clear();
+	room.logBytes = 0;
+	room.watchable = false;
+}
+
 static void leaveRoom(nsint pfd, Player& player, Code listCode = Code::rlist) {	// use Code::version to not send a room list
-	uset<nsint> errPfds;
-	umap<nsint, Player>::iterator partner = players.find(player.partner);
-	if (umap<nsint, string>::iterator room = rooms.find(pfd); room == rooms.end()) {	// is a guest
+	SlabSet<nsint> errPfds;
+	PlayerMap::iterator partner = players.find(player.partner);
+	dropToken(player);
+	if (partner != players.end())
+		dropToken(partner->second);
+	if (SlabMap<nsint, Room>::iterator room = rooms.find(pfd); room == rooms.end()) {	// is a guest
 		room = rooms.find(partner->first);
-		sendRoomData(Code::ropen, room->second, { uint8(true) }, errPfds);
+		dismissSpectators(room->second, errPfds);
+		setRoomGuest(room->first, INVALID_SOCKET);
+		sendRoomData(Code::ropen, player.channel, room->second.name, { uint8(true) }, errPfds);
 	} else if (partner == players.end()) {	// is a host without guest
-		sendRoomData(Code::rerase, room->second, {}, errPfds);
+		{
+			std::lock_guard lock(lobby.mutex);
+			Lobby::Channel& chan = lobby.channels[player.channel];
+			lobby.rooms.erase(pfd);
+			chan.roomNames.erase(room->second.name);
+			chan.listSize -= uint(sizeof(uint8) + room->second.name.length());
+			chan.list.reset();
+		}
+		sendRoomData(Code::rerase, player.channel, room->second.name, {}, errPfds);
 		rooms.erase(room);
 	} else {	// is host with guest
-		sendRoomData(Code::ropen, room->second, { uint8(true) }, errPfds);
-		rekeyRoom(room, partner->first);
+		dismissSpectators(room->second, errPfds);
+		rekeyRoom(room, partner->first, INVALID_SOCKET);
+		sendRoomData(Code::ropen, player.channel, rooms.at(partner->first).name, { uint8(true) }, errPfds);
 	}
 
 	if (partner != players.end()) {
-		try {
+		if (partner->second.cproc == cprocSuspended)
+			errPfds.insert(partner->first);	// there's nothing to come back to
+		else try {
 			sendb.pushHead(Code::leave);
-			sendb.send(partner->first, partner->second.webs);
+			sendBuffer(partner->first, partner->second);
 		} catch (const Error& err) {
 			slog.err("failed to send leave info from player ", pfd, " to player ", partner->first, ": ", err.what());
 			errPfds.insert(partner->first);
@@ -243,7 +857,10 @@ static void leaveRoom(nsint pfd, Player& player, Code listCode = Code::rlist) {
 		player.partner = partner->second.partner = INVALID_SOCKET;
 	}
 
-	if (listCode != Code::version) {
+	if (player.cproc == cprocSuspended)	// got kicked
+		errPfds.insert(pfd);
+	else if (listCode != Code::version) {
+		player.active = polled;
 		try {
 			sendRoomList(pfd, player, listCode);
 		} catch (const Error& err) {
@@ -256,86 +873,499 @@ static void leaveRoom(nsint pfd, Player& player, Code listCode = Code::rlist) {
 }
 
 static void transferHost(nsint pfd, Player& player) {
-	umap<nsint, Player>::iterator partner = players.find(player.partner);
-	rekeyRoom(pfd, partner->first);
+	PlayerMap::iterator partner = players.find(player.partner);
+	rekeyRoom(pfd, partner->first, pfd);
 	try {
 		sendb.pushHead(Code::thost);
-		sendb.send(partner->first, partner->second.webs);
+		relayBuffer(partner->first, partner->second);
 	} catch (const Error& err) {
 		slog.err("failed to send host info from player ", pfd, " to player ", partner->first, ": ", err.what());
 		throw PlayerError{ pfd, partner->first };	// host will have already changed its UI, so kick both
 	}
 }
 
-static void globalMessage(uint8* data, nsint pfd, Player& player) {
-	uset<nsint> errPfds;
-	for (auto& [fd, pl] : players)
-		if (fd != pfd && pl.partner == INVALID_SOCKET && !rooms.count(fd)) {
-			try {
-				player.recvb.redirect(fd, data, pl.webs);
-			} catch (const Error& err) {
-				errPfds.insert(fd);
-				slog.err("failed to send global message to player ", fd, ": ", err.what());
-			}
-		}
+static void countRelay(Code code, uint len) {
+	Stats& stats = workers[wid].stats;
+	Stats::add(stats.relayedMsgs[uint8(code)], 1);
+	Stats::add(stats.relayedBytes[uint8(code)], len);
+}
+
+static void globalMessage(const uint8* data, nsint pfd, const Player& player) {
+	SlabSet<nsint> errPfds;
+	uint len = read16(data + 1);
+	countRelay(Code::glmessage, len);
+	sendLobby(data, len, pfd, player.channel, errPfds);
+	postLobby(data, len, pfd, player.channel);
 	if (!errPfds.empty())
 		throw PlayerError(std::move(errPfds));
 }
 
+static void switchChannel(const uint8* data, nsint pfd, Player& player) {
+	string name = readName(data);
+	bool found = false;
+	if (inLobby(pfd, player)) {	// a room stays in the channel it was created in
+		std::lock_guard lock(lobby.mutex);
+		if (vector<Lobby::Channel>::iterator chan = std::find_if(lobby.channels.begin(), lobby.channels.end(), [&name](const Lobby::Channel& it) -> bool { return it.name == name; }); chan != lobby.channels.end()) {
+			--lobby.channels[player.channel].players;
+			++chan->players;
+			player.channel = uint8(chan - lobby.channels.begin());
+			found = true;
+		}
+	}
+
+	try {
+		if (found)
+			sendRoomList(pfd, player, Code::channel, { uint8(true) });
+		else {
+			sendb.pushHead(Code::channel, dataHeadSize + 1);
+			sendb.push(uint8(false));
+			sendBuffer(pfd, player);
+		}
+	} catch (const Error& err) {
+		slog.err("failed to send channel info to player ", pfd, ": ", err.what());
+		throw PlayerError{ pfd };
+	}
+}
+
+static void sendChannels(nsint pfd, Player& player) {
+	uint ofs = sendb.pushHead(Code::channels, 0) - sizeof(uint16);
+	{
+		std::lock_guard lock(lobby.mutex);
+		sendb.push(uint8(lobby.channels.size()));
+		for (const Lobby::Channel& it : lobby.channels) {
+			sendb.push({ uint32(it.roomNames.size()), uint32(it.players) });
+			sendb.push(uint8(it.name.length()));
+			sendb.push(it.name);
+		}
+	}
+	sendb.write(uint16(sendb.getDlim()), ofs);
+	try {
+		sendBuffer(pfd, player);
+	} catch (const Error& err) {
+		slog.err("failed to send channel summary to player ", pfd, ": ", err.what());
+		throw PlayerError{ pfd };
+	}
+}
+
+static void stopWatching(nsint pfd, Player& player, Code listCode = Code::rlist) {	// use Code::version to not send a room list
+	vector<nsint>& specs = rooms.at(player.watched).spectators;
+	*std::find(specs.begin(), specs.end(), pfd) = specs.back();
+	specs.pop_back();
+	player.watched = INVALID_SOCKET;
+	if (listCode != Code::version) {
+		player.active = polled;
+		try {
+			sendRoomList(pfd, player, listCode);
+		} catch (const Error& err) {
+			slog.err("failed to send room list to player ", pfd, ": ", err.what());
+			throw PlayerError{ pfd };
+		}
+	}
+}
+
+static void watchRoom(const uint8* data, nsint pfd, Player& player) {
+	nsint hfd = INVALID_SOCKET;
+	uint hwid = wid;
+	if (spectatorLimit && inLobby(pfd, player)) {
+		string name = readName(data + dataHeadSize);
+		std::lock_guard lock(lobby.mutex);
+		const SlabMap<string, nsint>& names = lobby.channels[player.channel].roomNames;
+		if (SlabMap<string, nsint>::const_iterator it = names.find(name); it != names.end()) {
+			hfd = it->second;
+			hwid = lobby.rooms.at(hfd).worker;
+		}
+	}
+	if (hwid != wid) {	// the host's worker handles the request after the player has been moved there
+		player.cproc = cprocHold;
+		migrations.emplace_back(pfd, hwid, string(), vector<uint8>(data, data + read16(data + 1)));
+		return;
+	}
+
+	SlabMap<nsint, Room>::iterator room = rooms.find(hfd);
+	bool ok = room != rooms.end() && room->second.watchable && room->second.spectators.size() < spectatorLimit;
+	try {
+		sendb.pushHead(Code::watch, dataHeadSize + 1);
+		sendb.push(uint8(ok));
+		sendBuffer(pfd, player);
+	} catch (const Error& err) {
+		slog.err("failed to send watch ", ok ? "accept" : "rejection", " to player ", pfd, ": ", err.what());
+		throw PlayerError{ pfd };
+	}
+	if (ok) {
+		room->second.spectators.push_back(pfd);
+		player.watched = hfd;
+		player.watchPos = 0;
+		catchUp(pfd, player, room->second);
+	}
+}
+
+static void spectateMessage(const uint8* data, nsint pfd, const Player& player) {	// after it was relayed to the partner
+	SlabMap<nsint, Room>::iterator host = rooms.find(pfd);
+	bool fromHost = host != rooms.end();
+	Room& room = fromHost ? host->second : rooms.at(player.partner);
+	if (Code(data[0]) == Code::start) {	// a new game
+		room.log.clear();
+		room.logBytes = 0;
+		room.watchable = true;
+		for (nsint it : room.spectators)
+			players.at(it).watchPos = 0;
+	}
+	if (!room.watchable)
+		return;
+
+	uint len = read16(data + 1);
+	if (uint flen = dataHeadSize + 1 + len; flen > UINT16_MAX || room.logBytes + flen > queueLimit) {	// a spectator couldn't get the whole game anymore
+		SlabSet<nsint> errPfds;
+		dismissSpectators(room, errPfds);
+		disconnectPlayers(std::move(errPfds));
+		return;
+	}
+	vector<uint8> frame(dataHeadSize + 1 + len);
+	frame[0] = uint8(Code::spectate);
+	write16(frame.data() + 1, uint16(frame.size()));
+	frame[dataHeadSize] = fromHost;
+	std::copy_n(data, len, frame.begin() + dataHeadSize + 1);
+	room.logBytes += uint(frame.size());
+	room.log.push_back(SpectatorFrame{ std::make_shared<const vector<uint8>>(std::move(frame)), nullptr });
+	if (!room.spectators.empty()) {
+		Stats::add(workers[wid].stats.spectated, 1);
+		for (nsint it : room.spectators)
+			catchUp(it, players.at(it), room);
+	}
+}
+
+static bool suspendPlayer(nsint pfd, Player& player) {	// keeps the room of a disconnected player with a token and returns whether it did
+	PlayerMap::iterator partner = players.find(player.partner);
+	if (!player.token || player.cproc != cprocPlayer || partner == players.end() || !partner->second.cproc)
+		return false;
+	poller.del(pfd);	// the socket stays open until the player is gone, so that its number can't be taken while the room refers to it
+	player.cproc = cprocSuspended;
+	player.recvb.clear();
+	player.sendq.clear();
+	player.relayed = steady_clock::time_point();
+	player.timer = timers.schedule(pfd, polled + resumeGrace);
+	Stats::add(workers[wid].stats.suspends, 1);
+	slog.out("player ", pfd, " suspended");
+	return true;
+}
+
+static void resumeSession(const uint8* data, nsint pfd, Player& player) {
+	uint64 token = read64(data + dataHeadSize);
+	uint32 got = read32(data + dataHeadSize + sizeof(uint64));
+	if (uint owner = uint(token % maxWorkers); owner != wid && owner < workerCnt && inLobby(pfd, player)) {	// the session's worker handles it after the player has been moved there
+		player.cproc = cprocHold;
+		migrations.emplace_back(pfd, owner, string(), vector<uint8>(data, data + codeSizes.at(Code::resume)));
+		return;
+	}
+
+	SlabMap<uint64, nsint>::iterator sit = token ? sessions.find(token) : sessions.end();
+	PlayerMap::iterator old = sit != sessions.end() ? players.find(sit->second) : players.end();
+	if (old == players.end() || !inLobby(pfd, player) || got > old->second.relayCnt || got < old->second.relayCnt - replaySize(old->second) || (old->second.cproc != cprocSuspended && !suspendPlayer(old->first, old->second))) {	// the old connection might not have noticed the disconnect yet
+		Stats::add(workers[wid].stats.resumeRejects, 1);
+		slog.out("player ", pfd, " failed to resume a session");
+		try {
+			sendb.pushHead(Code::resume);
+			sendb.push({ uint64(0) });
+			sendb.push(uint32(0));
+			sendBuffer(pfd, player);
+		} catch (const Error& err) {
+			slog.err("failed to send resume rejection to player ", pfd, ": ", err.what());
+			throw PlayerError{ pfd };
+		}
+		return;
+	}
+
+	auto& [sfd, prev] = *old;
+	PlayerMap::iterator partner = players.find(prev.partner);
+	{
+		std::lock_guard lock(lobby.mutex);
+		--lobby.channels[player.channel].players;	// the old connection is still counted
+		if (player.name)
+			lobby.names.erase(*player.name);
+	}
+	player.name = prev.name;
+	player.channel = prev.channel;
+	player.partner = partner->first;
+	player.replay = std::move(prev.replay);
+	player.replayBytes = prev.replayBytes;
+	player.relayCnt = prev.relayCnt;
+	player.recvCnt = prev.recvCnt;
+	partner->second.partner = pfd;
+	if (rooms.count(sfd))
+		rekeyRoom(sfd, pfd, partner->first);
+	else
+		setRoomGuest(partner->first, pfd);
+	sessions.erase(sit);
+	closeSocketV(sfd);
+	--playerCnt;
+	slog.out("player ", sfd, " resumed as player ", pfd);
+	players.erase(old);
+	Stats::add(workers[wid].stats.resumes, 1);
+
+	try {
+		player.token = newToken(pfd);
+		sendToken(pfd, player);
+		for (sizet i = got - (player.relayCnt - replaySize(player)); i < replaySize(player); ++i)
+			sendPlayer(pfd, player, (*player.replay)[i].data(), uint((*player.replay)[i].size()), player.webs);
+	} catch (const Error& err) {
+		slog.err("failed to send missed messages to player ", pfd, ": ", err.what());
+		throw PlayerError{ pfd };
+	}
+}
+
 static void redirectData(uint8* data, nsint pfd, Player& player) {
 	if (Code(data[0]) < Code::hello || Code(data[0]) > Code::message) {
 		slog.err("invalid net code ", uint(data[0]), " from player ", pfd, " of size ", read16(data + 1));
 		throw PlayerError{ pfd };
 	}
-	umap<nsint, Player>::iterator partner = players.find(player.partner);
+	PlayerMap::iterator partner = players.find(player.partner);
 	if (partner == players.end()) {
 		slog.err("data with code ", uint(data[0]), " from player ", pfd, " of size ", read16(data + 1), " to invalid partner ", player.partner);
 		throw PlayerError{ pfd };
 	}
 
 	try {
-		player.recvb.redirect(partner->first, data, partner->second.webs);
+		sendRelayed(partner->first, partner->second, data, read16(data + 1));
+		countRelay(Code(data[0]), read16(data + 1));
 	} catch (const Error& err) {
 		slog.err("failed to send data with code ", uint(data[0]), " of size ", read16(data + 1), " from player ", pfd, " to player ", partner->first, ": ", err.what());
 		throw PlayerError{ partner->first };
 	}
+	if (spectated(Code(data[0])))
+		spectateMessage(data, pfd, player);
 }
 
-static void connectPlayer(vector<pollfd>& pfds) {
-	if (players.size() >= maxPlayers) {
-		sendRejection(pfds[0].fd);
-		slog.out("rejected incoming connection");
-	} else try {
-		pfds.push_back({ acceptSocket(pfds[0].fd), POLLIN | POLLRDHUP, 0 });
-		players.emplace(pfds.back().fd, Player());
-		slog.out("player ", pfds.back().fd, " connected");
-	} catch (const Error& err) {
-		slog.err(err.what());
+#ifdef __linux__
+static bool loggedMessage(Code code, nsint pfd, const Player& player) {	// whether spectateMessage needs the message
+	if (!spectated(code))
+		return false;
+	if (code == Code::start)
+		return true;
+	SlabMap<nsint, Room>::iterator room = rooms.find(pfd);
+	return (room != rooms.end() ? room->second : rooms.at(player.partner)).watchable;
+}
+
+static void readPipe(uint8* data, uint len) {	// gets back what's left in the pipe after a splice
+	for (uint ofs = 0; ofs < len;)
+		if (long cnt = read(splicePipe[0], data + ofs, len - ofs); cnt > 0)
+			ofs += uint(cnt);
+		else if (!cnt || errno != EINTR)
+			break;
+}
+
+static bool recvRest(nsint pfd, uint8* data, uint len) {	// gets the rest of a message that a splice didn't take, which the socket already has
+	for (uint ofs = 0; ofs < len;)
+		if (long cnt = recv(pfd, data + ofs, len - ofs, MSG_DONTWAIT); cnt > 0)
+			ofs += uint(cnt);
+		else if (!cnt || errno != EINTR)
+			return false;
+	return true;
+}
+
+static void closeSplicePipe() {
+	for (int& it : splicePipe)
+		if (it != -1) {
+			close(it);
+			it = -1;
+		}
+}
+
+static bool spliceMessages(nsint pfd, Player& player) {	// moves whole messages for the partner from socket to socket without copying them and returns false if the rest has to be received the normal way
+	uint8 head[dataHeadSize];
+	for (long hlen; (hlen = recv(pfd, head, sizeof(head), MSG_PEEK | MSG_DONTWAIT)) != 0;) {
+		if (hlen != long(sizeof(head)))
+			return hlen < 0 && wouldBlock();
+		Code code = Code(head[0]);
+		uint len = read16(head + 1);
+		int avail;
+		PlayerMap::iterator partner = players.find(player.partner);
+		if (code < Code::hello || code > Code::message || len < spliceMin || len > Buffer::maxMessage || ioctl(pfd, FIONREAD, &avail) || uint(avail) < len || partner == players.end() || partner->second.cproc != cprocPlayer || partner->second.webs || !partner->second.sendq.empty())	// control codes and partners with queued data go the normal way
+			return false;
+		auto& [dfd, dst] = *partner;
+		bool logged = loggedMessage(code, pfd, player);
+		bool copied = dst.token || logged;
+		if (copied) {	// the message also has to be kept, which needs a copy after all
+			spliceCopy.resize(len);
+			if (recv(pfd, spliceCopy.data(), len, MSG_PEEK | MSG_DONTWAIT) != long(len))
+				return false;
+		}
+
+		Stats& stats = workers[wid].stats;
+		if (long cnt = splice(pfd, nullptr, splicePipe[1], nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK); cnt == long(len)) {
+			long sent = splice(splicePipe[0], nullptr, dfd, nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (sent < 0 && !wouldBlock()) {
+				spliceCopy.resize(len);
+				readPipe(spliceCopy.data(), len);
+				slog.err("failed to splice data with code ", uint(code), " of size ", len, " from player ", pfd, " to player ", dfd);
+				throw PlayerError{ dfd };
+			}
+			if (uint left = len - uint(std::max(sent, 0l))) {	// the partner's socket buffer is full, so the rest waits in its queue
+				uint ofs = copied ? len : 0;	// behind the copy that's still needed
+				spliceCopy.resize(ofs + left);
+				readPipe(spliceCopy.data() + ofs, left);
+				try {
+					sendPlayer(dfd, dst, spliceCopy.data() + ofs, left, false);
+				} catch (const Error& err) {
+					slog.err("failed to send data with code ", uint(code), " of size ", len, " from player ", pfd, " to player ", dfd, ": ", err.what());
+					throw PlayerError{ dfd };
+				}
+				if (dst.relayed == steady_clock::time_point())
+					dst.relayed = polled;
+			} else
+				stats.relayLatency.observe(std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - polled).count());
+			keepRelayed(dst, spliceCopy.data(), len);
+			Stats::add(stats.splicedMsgs, 1);
+			Stats::add(stats.splicedBytes, len);
+		} else {	// the socket gave less than it announced, so the message gets copied after all
+			uint got = uint(std::max(cnt, 0l));
+			spliceCopy.resize(len);
+			readPipe(spliceCopy.data(), got);	// the same bytes a copy already holds
+			if (!recvRest(pfd, spliceCopy.data() + got, len - got)) {
+				slog.err("failed to receive data with code ", uint(code), " of size ", len, " from player ", pfd);
+				throw PlayerError{ pfd };
+			}
+			try {
+				sendRelayed(dfd, dst, spliceCopy.data(), len);
+			} catch (const Error& err) {
+				slog.err("failed to send data with code ", uint(code), " of size ", len, " from player ", pfd, " to player ", dfd, ": ", err.what());
+				throw PlayerError{ dfd };
+			}
+		}
+
+		player.active = polled;
+		if (player.token)
+			++player.recvCnt;
+		countRelay(code, len);
+		if (logged)
+			spectateMessage(spliceCopy.data(), pfd, player);
+	}
+	return false;	// let the normal way see that the connection closed
+}
+#endif
+
+static void connectPlayers() {
+	for (nsint fd; (fd = accept(workers[wid].server, nullptr, nullptr)) != INVALID_SOCKET;) {	// the listening socket is non-blocking, so accept until the backlog is empty
+		if (playerCnt >= maxPlayers) {
+			Stats::add(workers[wid].stats.rejects, 1);
+			sendFull(fd);
+			slog.out("rejected incoming connection");
+		} else if (noblockSocket(fd, true)) {	// accepted sockets don't inherit the listener's mode on some systems
+			closeSocketV(fd);
+			slog.err(msgIoctlFail);
+		} else {
+			if (heartbeat.count() && keepaliveSocket(fd, uint(heartbeat.count())))
+				slog.err("failed to enable keepalive for player ", fd);
+			PlayerMap::iterator it = players.emplace(fd, Player()).first;
+			try {
+				poller.add(fd, &*it, true);
+				it->second.heard = polled;
+				it->second.timer = timers.schedule(fd, polled + handshakeTimeout);
+				++playerCnt;
+				Stats::add(workers[wid].stats.accepts, 1);
+				slog.out("player ", fd, " connected");
+			} catch (const Error& err) {
+				players.erase(it);
+				closeSocketV(fd);
+				slog.err(err.what());
+			}
+		}
 	}
+	if (!wouldBlock())
+		slog.err(msgAcceptFail);
 }
 
-static void disconnectPlayers(uint& icur, vector<pollfd>& pfds, const uset<nsint>& dfds) {
-	for (nsint fd : dfds) {
-		vector<pollfd>::iterator pit = std::find_if(pfds.begin() + 1, pfds.end(), [fd](const pollfd& it) -> bool { return it.fd == fd; });
-		if (pit <= pfds.begin() + icur)
-			--icur;
+static void disconnectPlayers(SlabSet<nsint> dfds) {
+	while (!dfds.empty()) {
+		nsint fd = *dfds.begin();
+		dfds.erase(dfds.begin());
+		if (PlayerMap::iterator player = players.find(fd); player != players.end()) {
+			if (suspendPlayer(player->first, player->second))
+				continue;
+			dropToken(player->second);
+			if (player->second.watched != INVALID_SOCKET)
+				stopWatching(player->first, player->second, Code::version);
+			if (player->second.partner != INVALID_SOCKET || rooms.count(player->first)) {
+				try {
+					leaveRoom(player->first, player->second, Code::version);
+				} catch (const PlayerError& err) {
+					for (nsint efd : err.pfds)
+						if (efd != fd)
+							dfds.insert(efd);
+				}
+			}
+			if (bool counted = player->second.cproc != cprocValidate; counted || player->second.name) {
+				std::lock_guard lock(lobby.mutex);
+				if (player->second.name)
+					lobby.names.erase(*player->second.name);
+				if (counted)
+					--lobby.channels[player->second.channel].players;
+			}
+			player->second.cproc = nullptr;	// marks the player as dropped for pending events
+			dropped.push_back(players.extract(player));
+		}
+	}
+}
 
-		if (umap<nsint, Player>::iterator player = players.find(fd); player != players.end()) {
-			if (player->second.partner != INVALID_SOCKET || rooms.count(player->first))
-				leaveRoom(player->first, player->second, Code::version);
-			players.erase(player);
+static void closeDropped() {
+	for (PlayerMap::node_type& it : dropped) {
+		try {
+			it.mapped().sendq.flush(it.key());	// try to get out what's left, like a websocket close response
+		} catch (const Error&) {}
+		poller.del(it.key());
+		closeSocketV(it.key());
+		--playerCnt;
+		slog.out("player ", it.key(), " disconnected");
+	}
+	dropped.clear();
+}
+
+static void migratePlayers() {
+	for (auto& [pfd, id, room, request] : migrations)
+		if (PlayerMap::iterator it = players.find(pfd); it != players.end() && it->second.cproc == cprocHold) {
+			poller.del(pfd);
+			post(id, Post{ Post::Type::migrate, INVALID_SOCKET, 0, std::move(request), std::move(room), players.extract(it) });
+			slog.out("player ", pfd, " moved to worker ", id);
 		}
-		closeSocketV(fd);
-		if (pit != pfds.end())
-			pfds.erase(pit);
-		slog.out("player ", fd, " disconnected");
+	migrations.clear();
+}
+
+static void adoptPlayer(PlayerMap::node_type&& node, const string& room, const vector<uint8>& request) {
+	nsint pfd = node.key();
+	PlayerMap::iterator it = players.insert(std::move(node)).position;
+	Player& player = it->second;
+	try {
+		poller.add(pfd, &*it, true);
+		player.timer = timers.schedule(pfd, polled);	// the old worker's timer is gone
+		player.dirty = false;
+		if (!player.sendq.empty())
+			markDirty(pfd, player);
+		player.cproc = cprocPlayer;
+		if (request.empty())
+			joinRoom(room, pfd, player);
+		else if (Code(request[0]) == Code::resume)
+			resumeSession(request.data(), pfd, player);
+		else
+			watchRoom(request.data(), pfd, player);
+		while (player.cproc(pfd, player));	// data that arrived before the move
+	} catch (const PlayerError& err) {
+		disconnectPlayers(err.pfds);
+	} catch (const Error& err) {
+		slog.err("failed to move player ", pfd, " to worker ", wid, ": ", err.what());
+		disconnectPlayers({ pfd });
 	}
 }
 
+static void rejectFrame(nsint pfd, const FrameError& err) {
+	Stats::add(workers[wid].stats.frameRejects, 1);
+	slog.out("player ", pfd, " sent data over the size limit: ", err.what());
+	throw PlayerError{ pfd };
+}
+
 bool cprocValidate(nsint pfd, Player& player) {
 	try {
-		bool nameClash;
-		switch (player.recvb.recvConn(pfd, player.webs, nameClash, [](const string& name) -> bool { return std::any_of(players.begin(), players.end(), [name](const pair<const nsint, Player>& it) -> bool { return it.second.name == name; }); })) {
+		bool nameClash, webs = player.webs;
+		WsDeflateParams deflate = WsDeflate::limits;
+		switch (player.recvb.recvConn(pfd, player.webs, nameClash, [](const string& name) -> bool { std::lock_guard lock(lobby.mutex); return lobby.names.count(name); }, deflateMin && !webs ? &deflate : nullptr, inflateFrame, &player.caps)) {
 		case Buffer::Init::wait:
 			return false;
 		case Buffer::Init::connect:
@@ -345,7 +1375,12 @@ bool cprocValidate(nsint pfd, Player& player) {
 			sendVersionRejection(pfd, player.webs);
 		case Buffer::Init::error:
 			throw PlayerError{ pfd };
+		case Buffer::Init::cont:
+			if (player.webs && !webs && deflateMin)
+				player.deflate.setParams(deflate);
 		}
+	} catch (const FrameError& err) {
+		rejectFrame(pfd, err);
 	} catch (const Error&) {
 		throw PlayerError{ pfd };
 	}
@@ -355,13 +1390,22 @@ bool cprocValidate(nsint pfd, Player& player) {
 bool cprocPlayer(nsint pfd, Player& player) {
 	uint8* data;
 	try {
-		if (data = player.recvb.recv(pfd, player.webs); !data)
+		if (data = player.recvb.recv(pfd, player.webs, sendControl, inflateFrame, recvPong); !data)
 			return false;
+	} catch (const FrameError& err) {
+		rejectFrame(pfd, err);
 	} catch (const Error&) {
 		throw PlayerError{ pfd };
 	}
+	player.active = polled;
+	if (player.token && replayable(Code(data[0])))
+		++player.recvCnt;
 
 	try {
+		if (player.watched != INVALID_SOCKET && Code(data[0]) != Code::leave && Code(data[0]) != Code::ping && Code(data[0]) != Code::channels) {
+			slog.err("invalid net code ", uint(data[0]), " from spectator ", pfd);
+			throw PlayerError{ pfd };
+		}
 		switch (Code(data[0])) {
 		case Code::rnew:
 			createRoom(data + dataHeadSize, pfd, player);
@@ -370,10 +1414,13 @@ bool cprocPlayer(nsint pfd, Player& player) {
 			globalMessage(data, pfd, player);
 			break;
 		case Code::join:
-			joinRoom(data + dataHeadSize, pfd, player);
+			joinRoom(readName(data + dataHeadSize), pfd, player);
 			break;
 		case Code::leave:
-			leaveRoom(pfd, player);
+			if (player.watched != INVALID_SOCKET)
+				stopWatching(pfd, player);
+			else
+				leaveRoom(pfd, player);
 			break;
 		case Code::thost:
 			transferHost(pfd, player);
@@ -381,6 +1428,24 @@ bool cprocPlayer(nsint pfd, Player& player) {
 		case Code::kick:
 			leaveRoom(player.partner, players.at(player.partner), Code::kick);
 			break;
+		case Code::channel:
+			switchChannel(data + dataHeadSize, pfd, player);
+			break;
+		case Code::channels:
+			sendChannels(pfd, player);
+			break;
+		case Code::ping:
+			if (read16(data + 1) == codeSizes.at(Code::ping))
+				recordRtt(pfd, player, read64(data + dataHeadSize));
+			break;
+		case Code::resume:
+			if (read16(data + 1) == codeSizes.at(Code::resume))
+				resumeSession(data, pfd, player);
+			break;
+		case Code::watch:
+			if (uint16 len = read16(data + 1); len > dataHeadSize && len > dataHeadSize + data[dataHeadSize])
+				watchRoom(data, pfd, player);
+			break;
 		default:
 			redirectData(data, pfd, player);
 		}
@@ -392,9 +1457,19 @@ bool cprocPlayer(nsint pfd, Player& player) {
 	return true;
 }
 
+bool cprocHold(nsint, Player&) {
+	return false;
+}
+
+bool cprocSuspended(nsint, Player&) {
+	return false;
+}
+
 #ifndef SERVICE
+static std::mutex printMutex;
+
 template <sizet S>
-void printTable(vector<array<string, S>>& table, const char* title, array<string, S>&& header) {
+void printTable(vector<array<string, S>>& table, const string& title, array<string, S>&& header) {
 	array<uint, S> lens{};
 	table[0] = std::move(header);
 	for (const array<string, S>& it : table)
@@ -402,6 +1477,7 @@ void printTable(vector<array<string, S>>& table, const char* title, array<string
 			if (it[i].length() > lens[i])
 				lens[i] = it[i].length();
 
+	std::lock_guard lock(printMutex);
 	std::cout << title << linend;
 	for (const array<string, S>& it : table) {
 		for (sizet i = 0; i < S; ++i)
@@ -411,6 +1487,18 @@ void printTable(vector<array<string, S>>& table, const char* title, array<string
 	std::cout << std::endl;
 }
 
+static string printMicros(uint usec) {
+	return usec ? toStr(usec / 1000) + '.' + toStr(usec / 100 % 10) + "ms" : string();
+}
+
+static void printPlayers() {
+	vector<array<string, 4>> table(players.size() + 1);
+	uint i = 1;
+	for (auto& [pfd, player] : players)
+		table[i++] = { toStr(pfd), player.partner != INVALID_SOCKET ? toStr(player.partner) : string(), player.watched != INVALID_SOCKET ? rooms.at(player.watched).name : string(), printMicros(player.rtt) };
+	printTable(table, workerCnt > 1 ? "Players of worker " + toStr(wid) + ':' : "Players:", { "SOCKET", "PARTNER", "WATCHING", "RTT" });
+}
+
 static void checkInput() {
 #ifdef _WIN32
 	if (!_kbhit())
@@ -425,21 +1513,39 @@ static void checkInput() {
 	int ch = toupper(getchar());
 #endif
 	switch (ch) {
-	case 'P': {
-		vector<array<string, 2>> table(players.size() + 1);
-		uint i = 1;
-		for (auto& [pfd, player] : players)
-			table[i++] = { toStr(pfd), player.partner != INVALID_SOCKET ? toStr(player.partner) : string() };
-		printTable(table, "Players:", { "SOCKET", "PARTNER" });
-		break; }
+	case 'P':
+		printPlayers();
+		for (uint i = 1; i < workerCnt; ++i)
+			post(i, Post{ Post::Type::dump, INVALID_SOCKET, 0, {}, string(), {} });
+		break;
 	case 'R': {
-		vector<array<string, 3>> table(rooms.size() + 1);
+		std::lock_guard lock(lobby.mutex);
+		vector<array<string, 5>> table(lobby.rooms.size() + 1);
 		uint i = 1;
-		for (auto& [host, name] : rooms) {
-			Player& player = players.at(host);
-			table[i++] = { name, toStr(host), player.partner != INVALID_SOCKET ? toStr(player.partner) : string() };
+		for (auto& [host, room] : lobby.rooms)
+			table[i++] = { room.name, toStr(host), room.guest != INVALID_SOCKET ? toStr(room.guest) : string(), lobby.channels[room.channel].name, printMicros(room.latency) };
+		printTable(table, "Rooms:", { "NAME", "HOST", "GUEST", "CHANNEL", "LATENCY" });
+		break; }
+	case 'S': {
+		vector<array<string, 6>> table(workerCnt + 1);
+		for (uint i = 0; i < workerCnt; ++i) {
+			ullong frames = workers[i].stats.frames.load(std::memory_order_relaxed);
+			ullong sends = workers[i].stats.sends.load(std::memory_order_relaxed);
+			ullong din = workers[i].stats.deflateIn.load(std::memory_order_relaxed);
+			ullong dout = workers[i].stats.deflateOut.load(std::memory_order_relaxed);
+			table[i+1] = { toStr(i), toStr(frames), toStr(sends), toStr(frames > sends ? frames - sends : 0), toStr(din), din ? toStr(dout * 100 / din) + '%' : string() };
 		}
-		printTable(table, "Rooms:", { "NAME", "HOST", "GUEST" });
+		printTable(table, "Send statistics:", { "WORKER", "MESSAGES", "SEND CALLS", "SAVED CALLS", "DEFLATED BYTES", "DEFLATE RATIO" });
+		break; }
+	case 'M': {
+		vector<array<string, 7>> table(workerCnt + 1);
+		for (uint i = 0; i < workerCnt; ++i) {
+			const Stats& stats = workers[i].stats;
+			ullong takes = stats.blockTakes.load(std::memory_order_relaxed);
+			ullong misses = stats.blockMisses.load(std::memory_order_relaxed);
+			table[i+1] = { toStr(i), toStr(stats.slabBytes.load(std::memory_order_relaxed)), toStr(stats.slabFree.load(std::memory_order_relaxed)), toStr(takes), takes ? toStr((takes - misses) * 100 / takes) + '%' : string(), toStr(stats.blockCached.load(std::memory_order_relaxed)), toStr(stats.blockTrimmed.load(std::memory_order_relaxed)) };
+		}
+		printTable(table, "Memory pools:", { "WORKER", "SLAB BYTES", "SLAB FREE", "BLOCKS TAKEN", "POOL HITS", "CACHED BYTES", "TRIMMED BYTES" });
 		break; }
 	case 'Q':
 		running = false;
@@ -450,48 +1556,829 @@ static void checkInput() {
 }
 #endif
 
+static void collectMetrics(string& out) {
+	ullong frames = 0, sends = 0, din = 0, dout = 0, accepts = 0, rejects = 0, hsTimeouts = 0, idleTimeouts = 0, hbTimeouts = 0, suspends = 0, resumes = 0, resumeRejects = 0, spectated = 0;
+	ullong splicedMsgs = 0, splicedBytes = 0, frameRejects = 0, bufferRejects = 0, blockTakes = 0, blockMisses = 0, blockTrimmed = 0, blockCached = 0, slabBytes = 0, slabFree = 0;
+	array<ullong, uint8(Code::message) + 1> msgs{}, bytes{};
+	Histogram::Total latency, depth, duration, rtt, roomLatency;
+	for (uint i = 0; i < workerCnt; ++i) {
+		const Stats& stats = workers[i].stats;
+		frames += stats.frames.load(std::memory_order_relaxed);
+		sends += stats.sends.load(std::memory_order_relaxed);
+		din += stats.deflateIn.load(std::memory_order_relaxed);
+		dout += stats.deflateOut.load(std::memory_order_relaxed);
+		accepts += stats.accepts.load(std::memory_order_relaxed);
+		rejects += stats.rejects.load(std::memory_order_relaxed);
+		hsTimeouts += stats.handshakeTimeouts.load(std::memory_order_relaxed);
+		idleTimeouts += stats.idleTimeouts.load(std::memory_order_relaxed);
+		hbTimeouts += stats.heartbeatTimeouts.load(std::memory_order_relaxed);
+		suspends += stats.suspends.load(std::memory_order_relaxed);
+		resumes += stats.resumes.load(std::memory_order_relaxed);
+		resumeRejects += stats.resumeRejects.load(std::memory_order_relaxed);
+		spectated += stats.spectated.load(std::memory_order_relaxed);
+		splicedMsgs += stats.splicedMsgs.load(std::memory_order_relaxed);
+		splicedBytes += stats.splicedBytes.load(std::memory_order_relaxed);
+		frameRejects += stats.frameRejects.load(std::memory_order_relaxed);
+		bufferRejects += stats.bufferRejects.load(std::memory_order_relaxed);
+		blockTakes += stats.blockTakes.load(std::memory_order_relaxed);
+		blockMisses += stats.blockMisses.load(std::memory_order_relaxed);
+		blockTrimmed += stats.blockTrimmed.load(std::memory_order_relaxed);
+		blockCached += stats.blockCached.load(std::memory_order_relaxed);
+		slabBytes += stats.slabBytes.load(std::memory_order_relaxed);
+		slabFree += stats.slabFree.load(std::memory_order_relaxed);
+		for (uint c = 0; c < msgs.size(); ++c) {
+			msgs[c] += stats.relayedMsgs[c].load(std::memory_order_relaxed);
+			bytes[c] += stats.relayedBytes[c].load(std::memory_order_relaxed);
+		}
+		stats.relayLatency.addTo(latency);
+		stats.queueDepth.addTo(depth);
+		stats.pollDuration.addTo(duration);
+		stats.rtt.addTo(rtt);
+		stats.roomLatency.addTo(roomLatency);
+	}
+	sizet roomCnt;
+	ullong batches = 0;
+	vector<tuple<string, sizet, uint>> chans;	// label, rooms, players
+	{
+		std::lock_guard lock(lobby.mutex);
+		roomCnt = lobby.rooms.size();
+		for (const Lobby::Channel& it : lobby.channels) {
+			batches += it.version;
+			chans.emplace_back("channel=\"" + it.name + '"', it.roomNames.size(), it.players);
+		}
+	}
+
+	MetricsServer::writeHead(out, "thrones_players", "gauge", "Connected players.");
+	MetricsServer::writeValue(out, "thrones_players", playerCnt);
+	MetricsServer::writeHead(out, "thrones_rooms", "gauge", "Active rooms.");
+	MetricsServer::writeValue(out, "thrones_rooms", roomCnt);
+	MetricsServer::writeHead(out, "thrones_room_batches_total", "counter", "Batches of room changes sent to the lobby.");
+	MetricsServer::writeValue(out, "thrones_room_batches_total", batches);
+	MetricsServer::writeHead(out, "thrones_channel_rooms", "gauge", "Active rooms per lobby channel.");
+	for (auto& [label, rcnt, pcnt] : chans)
+		MetricsServer::writeValue(out, "thrones_channel_rooms", rcnt, label.c_str());
+	MetricsServer::writeHead(out, "thrones_channel_players", "gauge", "Players per lobby channel, including the ones in rooms.");
+	for (auto& [label, rcnt, pcnt] : chans)
+		MetricsServer::writeValue(out, "thrones_channel_players", pcnt, label.c_str());
+	MetricsServer::writeHead(out, "thrones_accepts_total", "counter", "Accepted connections.");
+	MetricsServer::writeValue(out, "thrones_accepts_total", accepts);
+	MetricsServer::writeHead(out, "thrones_rejects_total", "counter", "Connections rejected because the server was full.");
+	MetricsServer::writeValue(out, "thrones_rejects_total", rejects);
+	MetricsServer::writeHead(out, "thrones_timeouts_total", "counter", "Connections closed by a timeout.");
+	MetricsServer::writeValue(out, "thrones_timeouts_total", hsTimeouts, "reason=\"handshake\"");
+	MetricsServer::writeValue(out, "thrones_timeouts_total", idleTimeouts, "reason=\"idle\"");
+	MetricsServer::writeValue(out, "thrones_timeouts_total", hbTimeouts, "reason=\"heartbeat\"");
+	MetricsServer::writeHead(out, "thrones_suspends_total", "counter", "Disconnected players whose room was kept for a resumption.");
+	MetricsServer::writeValue(out, "thrones_suspends_total", suspends);
+	MetricsServer::writeHead(out, "thrones_resumes_total", "counter", "Requests to get back into a room after reconnecting.");
+	MetricsServer::writeValue(out, "thrones_resumes_total", resumes, "result=\"ok\"");
+	MetricsServer::writeValue(out, "thrones_resumes_total", resumeRejects, "result=\"rejected\"");
+	MetricsServer::writeHead(out, "thrones_spectated_messages_total", "counter", "Messages between the players of a room that got shared with its spectators.");
+	MetricsServer::writeValue(out, "thrones_spectated_messages_total", spectated);
+	MetricsServer::writeHead(out, "thrones_relayed_messages_total", "counter", "Messages forwarded from one player to others.");
+	for (uint c = 0; c < msgs.size(); ++c)
+		if (Code(c) == Code::glmessage || Code(c) >= Code::hello)
+			MetricsServer::writeValue(out, "thrones_relayed_messages_total", msgs[c], codeLabels[c]);
+	MetricsServer::writeHead(out, "thrones_relayed_bytes_total", "counter", "Size of the forwarded messages.");
+	for (uint c = 0; c < bytes.size(); ++c)
+		if (Code(c) == Code::glmessage || Code(c) >= Code::hello)
+			MetricsServer::writeValue(out, "thrones_relayed_bytes_total", bytes[c], codeLabels[c]);
+	MetricsServer::writeHead(out, "thrones_spliced_messages_total", "counter", "Relayed messages that went from socket to socket without being copied.");
+	MetricsServer::writeValue(out, "thrones_spliced_messages_total", splicedMsgs);
+	MetricsServer::writeHead(out, "thrones_spliced_bytes_total", "counter", "Size of the spliced messages.");
+	MetricsServer::writeValue(out, "thrones_spliced_bytes_total", splicedBytes);
+	MetricsServer::writeHead(out, "thrones_rejected_frames_total", "counter", "Players who got disconnected for sending too much data at once.");
+	MetricsServer::writeValue(out, "thrones_rejected_frames_total", frameRejects, "reason=\"frame\"");
+	MetricsServer::writeValue(out, "thrones_rejected_frames_total", bufferRejects, "reason=\"buffer\"");
+	MetricsServer::writeHead(out, "thrones_queued_messages_total", "counter", "Messages queued for sending.");
+	MetricsServer::writeValue(out, "thrones_queued_messages_total", frames);
+	MetricsServer::writeHead(out, "thrones_send_calls_total", "counter", "Send calls needed to flush the queued messages.");
+	MetricsServer::writeValue(out, "thrones_send_calls_total", sends);
+	MetricsServer::writeHead(out, "thrones_deflate_input_bytes_total", "counter", "Size of messages before permessage-deflate.");
+	MetricsServer::writeValue(out, "thrones_deflate_input_bytes_total", din);
+	MetricsServer::writeHead(out, "thrones_deflate_output_bytes_total", "counter", "Size of messages after permessage-deflate.");
+	MetricsServer::writeValue(out, "thrones_deflate_output_bytes_total", dout);
+	MetricsServer::writeHead(out, "thrones_log_dropped_total", "counter", "Log lines dropped because the log writer couldn't keep up.");
+	MetricsServer::writeValue(out, "thrones_log_dropped_total", slog.dropped());
+	MetricsServer::writeHead(out, "thrones_slab_bytes", "gauge", "Memory of the chunks for players, rooms and other small objects.");
+	MetricsServer::writeValue(out, "thrones_slab_bytes", slabBytes - std::min(slabFree, slabBytes), "state=\"used\"");
+	MetricsServer::writeValue(out, "thrones_slab_bytes", std::min(slabFree, slabBytes), "state=\"free\"");
+	MetricsServer::writeHead(out, "thrones_block_pool_bytes", "gauge", "Free send and receive blocks kept by the workers.");
+	MetricsServer::writeValue(out, "thrones_block_pool_bytes", blockCached);
+	MetricsServer::writeHead(out, "thrones_block_takes_total", "counter", "Send and receive blocks that were needed.");
+	MetricsServer::writeValue(out, "thrones_block_takes_total", blockTakes - blockMisses, "source=\"pool\"");
+	MetricsServer::writeValue(out, "thrones_block_takes_total", blockMisses, "source=\"heap\"");
+	MetricsServer::writeHead(out, "thrones_block_trimmed_bytes_total", "counter", "Free blocks that were released after not being needed for a while.");
+	MetricsServer::writeValue(out, "thrones_block_trimmed_bytes_total", blockTrimmed);
+	MetricsServer::writeHistogram(out, "thrones_relay_latency_seconds", "Time from receiving a relayed message until it was sent.", latency, true);
+	MetricsServer::writeHistogram(out, "thrones_queue_depth_bytes", "Queued bytes of a player before a flush.", depth, false);
+	MetricsServer::writeHistogram(out, "thrones_poll_duration_seconds", "Time spent processing the events of a poll iteration.", duration, true);
+	MetricsServer::writeHistogram(out, "thrones_rtt_seconds", "Round trip times of pings to players.", rtt, true);
+	MetricsServer::writeHistogram(out, "thrones_room_latency_seconds", "Estimated time for a message from one player of a room to reach the other.", roomLatency, true);
+}
+
 static void eventExit(int) {
 	running = false;
 }
 
-static bool exec(vector<pollfd>& pfds) {
-	if (int rcp = poll(pfds.data(), ulong(pfds.size()), checkTimeout)) {
-		if (rcp < 0 || (pfds[0].revents & polleventsDisconnect)) {
-			slog.err(msgPollFail);
-			return running = false;
+static void recvPosts() {
+	Worker& wrk = workers[wid];
+#ifdef __linux__
+	uint64 cnt;
+	if (read(wrk.wakefd, &cnt, sizeof(cnt)) != sizeof(cnt) && !wouldBlock())
+		slog.err("failed to read wake event of worker ", wid);
+#endif
+	vector<Post> posts;
+	{
+		std::lock_guard lock(wrk.mutex);
+		posts.swap(wrk.inbox);
+	}
+	for (Post& it : posts)
+		switch (it.type) {
+		case Post::Type::lobby: {
+			SlabSet<nsint> errPfds;
+			sendLobby(it.data.data(), it.data.size(), it.except, it.channel, errPfds);
+			disconnectPlayers(std::move(errPfds));
+			break; }
+		case Post::Type::migrate:
+			adoptPlayer(std::move(it.player), it.room, it.data);
+			break;
+		case Post::Type::dump:
+#ifndef SERVICE
+			printPlayers();
+#endif
+			break;
+		}
+}
+
+static void sendRoomDelta() {
+	vector<pair<uint8, vector<uint8>>> msgs;	// channel, batch
+	deltaDue = steady_clock::time_point();
+	{
+		std::lock_guard lock(lobby.mutex);
+		for (uint8 c = 0; c < lobby.channels.size(); ++c) {
+			Lobby::Channel& chan = lobby.channels[c];
+			sizet first = msgs.size();
+			for (const string& name : chan.changes) {
+				uint8 flag = roomDeltaErased;	// only the current state of a room matters
+				if (SlabMap<string, nsint>::iterator it = chan.roomNames.find(name); it != chan.roomNames.end())
+					flag = lobby.rooms.at(it->second).guest == INVALID_SOCKET ? roomDeltaOpen : 0;
+				if (msgs.size() == first || msgs.back().second.size() + sizeof(uint8) + name.length() > UINT16_MAX) {
+					vector<uint8>& msg = msgs.emplace_back(c, vector<uint8>(dataHeadSize + sizeof(uint32))).second;
+					msg[0] = uint8(Code::rdelta);
+					write32(msg.data() + dataHeadSize, ++chan.version);
+				}
+				msgs.back().second.push_back(flag | uint8(name.length()));
+				msgs.back().second.insert(msgs.back().second.end(), name.begin(), name.end());
+			}
+			chan.changes.clear();
+			for (sizet i = first; i < msgs.size(); ++i) {
+				vector<uint8>& msg = msgs[i].second;
+				write16(msg.data() + 1, uint16(msg.size()));
+				if (workerCnt > 1)	// while locked and to this worker as well, so that every worker gets the batches in order
+					for (uint w = 0; w < workerCnt; ++w)
+						post(w, Post{ Post::Type::lobby, INVALID_SOCKET, c, msg, string(), {} });
+				chan.batches.push_back(msg);
+				if (chan.batches.size() > lobbyHistory)
+					chan.batches.pop_front();
+			}
 		}
+	}
+	if (workerCnt > 1)
+		return;
 
-		if (pfds[0].revents & POLLIN)
-			connectPlayer(pfds);
-		for (uint i = 1; i < pfds.size(); ++i) {
+	SlabSet<nsint> errPfds;
+	for (auto& [chan, msg] : msgs)
+		sendLobby(msg.data(), uint(msg.size()), INVALID_SOCKET, chan, errPfds);
+	disconnectPlayers(std::move(errPfds));
+}
+
+static steady_clock::time_point pingDue(const Player& player) {	// when to send the next ping if the last one got answered
+	steady_clock::time_point due = steady_clock::time_point::max();
+	if (heartbeat.count())
+		due = player.heard + heartbeat;
+	if (pingInterval.count())
+		due = std::min(due, player.pingSent + pingInterval);
+	return due;
+}
+
+static void checkTimer(nsint pfd, Player& player) {	// schedules the player's next timer or throws PlayerError if it has to go
+	Stats& stats = workers[wid].stats;
+	if (player.cproc == cprocValidate) {
+		Stats::add(stats.handshakeTimeouts, 1);
+		slog.out("player ", pfd, " didn't finish the handshake in time");
+		throw PlayerError{ pfd };
+	}
+	if (player.cproc == cprocSuspended) {
+		dropToken(player);
+		slog.out("player ", pfd, " didn't come back in time");
+		throw PlayerError{ pfd };
+	}
+
+	steady_clock::time_point next = steady_clock::time_point::max();
+	if (idleTimeout.count()) {
+		if (!inLobby(pfd, player))
+			next = polled + idleTimeout;	// check again later, since the idle time only counts in the lobby
+		else if (next = player.active + idleTimeout; polled >= next) {
+			Stats::add(stats.idleTimeouts, 1);
+			slog.out("player ", pfd, " was idle in the lobby for too long");
+			throw PlayerError{ pfd };
+		}
+	}
+	if (player.webs || (player.caps & CAP_PING)) {	// other raw connections only get probed by TCP keepalive
+		bool waiting = player.pinged && heartbeat.count();	// no new ping until the last one got answered or timed out
+		if (waiting && polled >= player.pingSent + heartbeat) {
+			Stats::add(stats.heartbeatTimeouts, 1);
+			slog.out("player ", pfd, " didn't answer a ping");
+			throw PlayerError{ pfd };
+		}
+		if (!waiting && polled >= pingDue(player)) {
+			sendPing(pfd, player);
+			waiting = heartbeat.count();
+		}
+		if (waiting) {
+			next = std::min(next, player.pingSent + heartbeat);
+			if (pingInterval.count() && polled < player.pingSent + pingInterval)
+				next = std::min(next, player.pingSent + pingInterval);	// to send the next ping on time if this one gets answered until then
+		} else
+			next = std::min(next, pingDue(player));
+	}
+	if (next != steady_clock::time_point::max())
+		player.timer = timers.schedule(pfd, next);
+}
+
+static void expireTimers() {
+	SlabSet<nsint> errPfds;
+	for (const TimerWheel::Timer& it : timers.advance(polled))
+		if (PlayerMap::iterator player = players.find(it.fd); player != players.end() && player->second.timer == it.id) {
 			try {
-				if (pfds[i].revents & POLLIN) {
-					Player& player = players.at(pfds[i].fd);
-					bool fin = player.recvb.recvData(pfds[i].fd);
-					while (player.cproc(pfds[i].fd, player));
-					if (fin)
-						throw PlayerError{ pfds[i].fd };
-				} else if (pfds[i].revents & polleventsDisconnect)
-					throw PlayerError{ pfds[i].fd };
+				checkTimer(player->first, player->second);
 			} catch (const PlayerError& err) {
-				disconnectPlayers(i, pfds, err.pfds);
-			} catch (...) {
-				slog.err("unexpected error during player ", pfds[i].fd, " iteration");
-				disconnectPlayers(i, pfds, { pfds[i].fd });
+				errPfds.insert(err.pfds.begin(), err.pfds.end());
+			} catch (const Error& err) {
+				slog.err("failed to send ping to player ", it.fd, ": ", err.what());
+				errPfds.insert(it.fd);
 			}
 		}
+	disconnectPlayers(std::move(errPfds));
+}
+
+static void trimPools() {
+	if (polled >= trimDue) {
+		BlockPool::trim();
+		trimDue = polled + std::chrono::seconds(trimInterval);
 	}
+	Stats& stats = workers[wid].stats;	// the pools are thread local, so their numbers get published for the metrics
+	const BlockPool::Stats& blocks = BlockPool::stats();
+	stats.blockTakes.store(blocks.takes, std::memory_order_relaxed);
+	stats.blockMisses.store(blocks.misses, std::memory_order_relaxed);
+	stats.blockTrimmed.store(blocks.trimmed, std::memory_order_relaxed);
+	stats.blockCached.store(blocks.cached, std::memory_order_relaxed);
+	stats.slabBytes.store(Slab::stats().chunkBytes, std::memory_order_relaxed);
+	stats.slabFree.store(Slab::stats().freeBytes, std::memory_order_relaxed);
+}
+
+static void flushPlayers() {
+	SlabSet<nsint> errPfds;
+	Stats& stats = workers[wid].stats;
+	do {
+		for (sizet i = 0; i < dirty.size(); ++i) {	// resent room lists can add more players
+			PlayerMap::iterator it = players.find(dirty[i]);
+			if (it == players.end() || it->second.cproc == cprocSuspended)
+				continue;
+			auto& [pfd, player] = *it;
+			player.dirty = false;
+			try {
+				stats.queueDepth.observe(player.sendq.size());
+				Stats::add(stats.sends, player.sendq.flush(pfd));
+				if (!player.sendq.empty())
+					poller.setOut(pfd, true);
+				else {
+					poller.setOut(pfd, false);
+					if (player.relayed != steady_clock::time_point()) {
+						stats.relayLatency.observe(std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - player.relayed).count());
+						player.relayed = steady_clock::time_point();
+					}
+					if (player.stale && inLobby(pfd, player))
+						resyncLobby(pfd, player);
+					else if (player.watched != INVALID_SOCKET)
+						catchUp(pfd, player, rooms.at(player.watched));
+				}
+			} catch (const Error& err) {
+				sendb.clear();
+				slog.err("failed to send queued data to player ", pfd, ": ", err.what());
+				errPfds.insert(pfd);
+			}
+		}
+		dirty.clear();
+		disconnectPlayers(std::move(errPfds));	// might queue leave infos for partners
+		errPfds.clear();
+	} while (!dirty.empty());
+}
+
+static nsint handedFd(nsint fd) {	// maps a socket of the previous server to this process
+	if (fd == INVALID_SOCKET)
+		return INVALID_SOCKET;
+	umap<nsint, nsint>::iterator it = handedFds.find(fd);
+	if (it == handedFds.end())
+		throw Error(msgHandoffData);
+	return it->second;
+}
+
+static void savePlayer(Snapshot& snap, nsint pfd, const Player& player) {
+	snap.push(pfd);
+	snap.push(player.recvb.save());
+	snap.push(player.sendq.save());
+	snap.push(player.deflate.getParams());
+	snap.push(player.deflate.getWindow());
+	snap.push(uint32(replaySize(player)));
+	if (player.replay)
+		for (const vector<uint8>& it : *player.replay)
+			snap.push(it);
+	snap.push(uint8(std::find(cprocs.begin(), cprocs.end(), player.cproc) - cprocs.begin()));
+	snap.push(player.name ? *player.name : string());
+	snap.push(player.partner);
+	snap.push(player.watched);
+	snap.push(player.relayed);	// the steady clock is shared by all processes on Linux
+	snap.push(player.heard);
+	snap.push(player.active);
+	snap.push(player.pingSent);
+	snap.push(player.token);
+	snap.push(player.rtt);
+	snap.push(player.replayBytes);
+	snap.push(player.relayCnt);
+	snap.push(player.recvCnt);
+	snap.push(player.watchPos);
+	snap.push(player.lobbyVer);
+	snap.push(player.channel);
+	snap.push(player.caps);
+	snap.push(player.webs);
+	snap.push(player.stale);
+	snap.push(player.pinged);
+}
+
+static PlayerMap::iterator loadPlayer(Snapshot& snap, PlayerMap& dst) {
+	nsint pfd = handedFd(snap.pop<nsint>());
+	PlayerMap::iterator it = dst.emplace(pfd, Player()).first;
+	Player& player = it->second;
+	player.recvb.load(snap.popBytes());
+	if (vector<uint8> queued = snap.popBytes(); !queued.empty())
+		player.sendq.pushRaw(queued.data(), uint(queued.size()));
+	player.deflate.setParams(snap.pop<WsDeflateParams>());
+	player.deflate.setWindow(snap.popBytes());
+	if (uint32 cnt = snap.pop<uint32>()) {
+		player.replay = std::make_unique<std::deque<vector<uint8>>>();
+		for (; cnt; --cnt)
+			player.replay->push_back(snap.popBytes());
+	}
+	if (uint8 cproc = snap.pop<uint8>(); cproc < cprocs.size())
+		player.cproc = cprocs[cproc];
+	else
+		throw Error(msgHandoffData);
+	if (string name = snap.popString(); !name.empty()) {
+		std::lock_guard lock(lobby.mutex);
+		if (SlabSet<string>::iterator nit = lobby.names.find(name); nit != lobby.names.end())
+			player.name = &*nit;
+		else
+			throw Error(msgHandoffData);
+	}
+	player.partner = handedFd(snap.pop<nsint>());
+	player.watched = handedFd(snap.pop<nsint>());
+	player.relayed = snap.pop<steady_clock::time_point>();
+	player.heard = snap.pop<steady_clock::time_point>();
+	player.active = snap.pop<steady_clock::time_point>();
+	player.pingSent = snap.pop<steady_clock::time_point>();
+	player.token = snap.pop<uint64>();
+	player.rtt = snap.pop<uint>();
+	player.replayBytes = snap.pop<uint>();
+	player.relayCnt = snap.pop<uint32>();
+	player.recvCnt = snap.pop<uint32>();
+	player.watchPos = snap.pop<uint32>();
+	player.lobbyVer = snap.pop<uint32>();
+	player.channel = snap.pop<uint8>();
+	player.caps = snap.pop<uint8>();
+	player.webs = snap.pop<bool>();
+	player.stale = snap.pop<bool>();
+	player.pinged = snap.pop<bool>();
+	++playerCnt;
+	return it;
+}
+
+static void saveWorker() {	// instead of closing the players' sockets in case a new server takes over
+	Snapshot& snap = workers[wid].shard;
+	snap.push(uint32(players.size()));
+	for (auto& [pfd, player] : players) {
+		savePlayer(snap, pfd, player);
+		workers[wid].shardFds.push_back(pfd);
+	}
+	snap.push(uint32(rooms.size()));
+	for (auto& [host, room] : rooms) {
+		snap.push(host);
+		snap.push(room.name);
+		snap.push(uint32(room.spectators.size()));
+		for (nsint it : room.spectators)
+			snap.push(it);
+		snap.push(uint32(room.log.size()));
+		for (const SpectatorFrame& it : room.log)
+			snap.push(*it.raw);
+		snap.push(room.logBytes);
+		snap.push(room.watchable);
+	}
+}
+
+static void savePosts(uint id) {	// after all workers stopped, since they might still post to each other until then
+	Worker& wrk = workers[id];
+	wrk.shard.push(uint32(wrk.inbox.size()));
+	for (const Post& it : wrk.inbox) {
+		wrk.shard.push(it.type);
+		wrk.shard.push(it.except);
+		wrk.shard.push(it.channel);
+		wrk.shard.push(it.data);
+		wrk.shard.push(it.room);
+		wrk.shard.push(bool(it.player));
+		if (it.player) {
+			savePlayer(wrk.shard, it.player.key(), it.player.mapped());
+			wrk.shardFds.push_back(it.player.key());
+		}
+	}
+}
+
+static void loadWorker() {
+	Snapshot& snap = workers[wid].shard;
+	for (uint32 i = snap.pop<uint32>(); i; --i) {
+		PlayerMap::iterator it = loadPlayer(snap, players);
+		auto& [pfd, player] = *it;
+		if (player.cproc != cprocSuspended)
+			poller.add(pfd, &*it, true);
+		player.timer = timers.schedule(pfd, player.cproc == cprocValidate ? polled + handshakeTimeout : player.cproc == cprocSuspended ? polled + resumeGrace : polled);	// timeouts start over
+		if (!player.sendq.empty())
+			markDirty(pfd, player);
+		if (player.token)
+			sessions.emplace(player.token, pfd);
+	}
+	for (uint32 i = snap.pop<uint32>(); i; --i) {
+		Room& room = rooms[handedFd(snap.pop<nsint>())];
+		room.name = snap.popString();
+		for (uint32 j = snap.pop<uint32>(); j; --j)
+			room.spectators.push_back(handedFd(snap.pop<nsint>()));
+		for (uint32 j = snap.pop<uint32>(); j; --j)
+			room.log.push_back(SpectatorFrame{ std::make_shared<const vector<uint8>>(snap.popBytes()), nullptr });
+		room.logBytes = snap.pop<uint>();
+		room.watchable = snap.pop<bool>();
+	}
+	for (uint32 i = snap.pop<uint32>(); i; --i) {	// posts that hadn't been received yet
+		Post msg{ snap.pop<Post::Type>(), handedFd(snap.pop<nsint>()), snap.pop<uint8>(), snap.popBytes(), snap.popString(), {} };
+		if (msg.type > Post::Type::dump)
+			throw Error(msgHandoffData);
+		if (snap.pop<bool>()) {
+			PlayerMap node;
+			loadPlayer(snap, node);
+			msg.player = node.extract(node.begin());
+		}
+		post(wid, std::move(msg));
+	}
+	workers[wid].shard = Snapshot();
+}
+
+static void saveLobby(Snapshot& snap) {
+	snap.push(uint32(lobby.names.size()));
+	for (const string& it : lobby.names)
+		snap.push(it);
+	snap.push(uint32(lobby.channels.size()));
+	for (const Lobby::Channel& chan : lobby.channels) {
+		snap.push(chan.name);
+		snap.push(uint32(chan.changes.size()));
+		for (const string& it : chan.changes)
+			snap.push(it);
+		snap.push(uint32(chan.batches.size()));
+		for (const vector<uint8>& it : chan.batches)
+			snap.push(it);
+		snap.push(chan.version);
+		snap.push(chan.players);
+	}
+	snap.push(uint32(lobby.rooms.size()));
+	for (auto& [host, room] : lobby.rooms) {
+		snap.push(host);
+		snap.push(room.name);
+		snap.push(room.guest);
+		snap.push(room.worker);
+		snap.push(room.channel);
+		snap.push(room.latency);
+	}
+}
+
+static void loadLobby(Snapshot& snap) {
+	for (uint32 i = snap.pop<uint32>(); i; --i)
+		lobby.names.insert(snap.popString());
+	if (uint32 cnt = snap.pop<uint32>(); cnt && cnt <= maxChannels)
+		lobby.channels.resize(cnt);
+	else
+		throw Error(msgHandoffData);
+	for (Lobby::Channel& chan : lobby.channels) {
+		chan.name = snap.popString();
+		for (uint32 i = snap.pop<uint32>(); i; --i)
+			chan.changes.insert(snap.popString());
+		for (uint32 i = snap.pop<uint32>(); i; --i)
+			chan.batches.push_back(snap.popBytes());
+		chan.version = snap.pop<uint32>();
+		chan.players = snap.pop<uint>();
+	}
+	for (uint32 i = snap.pop<uint32>(); i; --i) {
+		nsint host = handedFd(snap.pop<nsint>());
+		Lobby::Room& room = lobby.rooms[host];
+		room.name = snap.popString();
+		room.guest = handedFd(snap.pop<nsint>());
+		room.worker = snap.pop<uint>();
+		room.channel = snap.pop<uint8>();
+		room.latency = snap.pop<uint>();
+		if (room.worker >= workerCnt || room.channel >= lobby.channels.size())
+			throw Error(msgHandoffData);
+		Lobby::Channel& chan = lobby.channels[room.channel];
+		chan.roomNames.emplace(room.name, host);
+		chan.listSize += uint(sizeof(uint8) + room.name.length());
+	}
+}
+
+static void handOver() {	// sends the listening sockets, the players' sockets and the state of the stopped workers to the new server
+	Snapshot snap;
+	vector<nsint> fds(workerCnt);
+	for (uint i = 0; i < workerCnt; ++i) {
+		fds[i] = workers[i].server;
+		savePosts(i);
+	}
+	for (uint i = 0; i < workerCnt; ++i)
+		fds.insert(fds.end(), workers[i].shardFds.begin(), workers[i].shardFds.end());
+	snap.push(uint32(workerCnt));
+	snap.push(uint32(fds.size()));
+	for (nsint it : fds)
+		snap.push(it);
+	saveLobby(snap);
+	for (uint i = 0; i < workerCnt; ++i)
+		snap.push(workers[i].shard.getData());
+	nsint conn = handoffConn;
+	handoffConn = INVALID_SOCKET;
+	handoff.send(conn, snap.getData(), fds);
+	slog.out("handed over ", fds.size() - workerCnt, " players to the new server");
+}
+
+static void loadServer(vector<uint8>&& state, const vector<nsint>& fds) {	// takes over what the previous server sent with handOver
+	Snapshot snap(std::move(state));
+	workerCnt = snap.pop<uint32>();
+	uint32 cnt = snap.pop<uint32>();
+	if (!workerCnt || workerCnt > maxWorkers || cnt < workerCnt || cnt != fds.size())
+		throw Error(msgHandoffData);
+	for (uint32 i = 0; i < cnt; ++i)
+		handedFds.emplace(snap.pop<nsint>(), fds[i]);
+	workers = std::make_unique<Worker[]>(workerCnt);
+	for (uint i = 0; i < workerCnt; ++i)
+		workers[i].server = fds[i];
+	loadLobby(snap);
+	for (uint i = 0; i < workerCnt; ++i)
+		workers[i].shard = Snapshot(snap.popBytes());
+	slog.out("took over ", cnt - workerCnt, " players from the previous server");
+}
+
+static void dropHandoffRequest() {
+	poller.del(handoffPending);
+	closeSocket(handoffPending);
+}
+
+static void recvHandoffRequest() {	// the workers only stop once the new server has shown that it's compatible
+	try {
+		if (!handoff.recvRequest(handoffPending))
+			return;
+		poller.del(handoffPending);
+		handoffConn = handoffPending;
+		handoffPending = INVALID_SOCKET;
+		running = false;
+		slog.out("new server is taking over");
+	} catch (const Error& err) {
+		slog.err(err.what());
+		dropHandoffRequest();
+	}
+}
+
+static void acceptHandoff() {
+	try {
+		if (nsint conn = handoff.accept(); conn != INVALID_SOCKET) {
+			if (handoffConn != INVALID_SOCKET || handoffPending != INVALID_SOCKET) {
+				closeSocketV(conn);	// only one new server can take over
+				return;
+			}
+			handoffPending = conn;
+			handoffDue = polled + std::chrono::seconds(handoffRequestTimeout);
+			poller.add(conn, &handoffPending);
+		}
+	} catch (const Error& err) {
+		slog.err(err.what());
+	}
+}
+
+static int pollTimeout() {
+	steady_clock::time_point now = steady_clock::now();
+	int timeout = timers.timeout(now);
+	if (timeout < 0 || timeout > int(checkTimeout))
+		timeout = int(checkTimeout);
+	if (deltaDue != steady_clock::time_point())
+		timeout = std::min(timeout, int(std::clamp(llong(std::chrono::ceil<std::chrono::milliseconds>(deltaDue - now).count()), 0ll, llong(checkTimeout))));
+	return timeout;
+}
+
+static bool exec() {
+	const vector<Poller::Ready>& ready = poller.wait(pollTimeout());
+	polled = steady_clock::now();
+	for (const Poller::Ready& it : ready) {
+		if (it.udata == &handoff) {
+			acceptHandoff();
+			continue;
+		}
+		if (it.udata == &handoffPending) {
+			recvHandoffRequest();
+			continue;
+		}
+		if (!it.udata) {	// only the listening socket has no player
+			if (it.events & Poller::EV_DISCONNECT) {
+				slog.err(msgPollFail);
+				return running = false;
+			}
+			connectPlayers();
+			continue;
+		}
+		if (it.udata == &workers[wid]) {
+			recvPosts();
+			continue;
+		}
+
+		auto& [pfd, player] = *static_cast<pair<const nsint, Player>*>(it.udata);
+		if (!player.cproc || player.cproc == cprocSuspended)	// events from before the player got dropped or suspended
+			continue;
+		try {
+			if ((it.events & Poller::EV_OUT) && !player.sendq.empty())
+				markDirty(pfd, player);
+			if (it.events & Poller::EV_IN) {
+				player.heard = polled;
+				player.pinged = false;
+#ifdef __linux__
+				if (splicePipe[0] != -1 && player.cproc == cprocPlayer && !player.webs && player.partner != INVALID_SOCKET && !player.recvb.getDlim() && spliceMessages(pfd, player))
+					continue;
+#endif
+				bool fin, full;
+				do {	// a capped buffer has to be processed before the rest can be read from the socket
+					fin = player.recvb.recvData(pfd, true);
+					full = player.recvb.capped();
+					while (player.cproc(pfd, player));
+				} while (!fin && full && !player.recvb.capped() && (player.cproc == cprocPlayer || player.cproc == cprocValidate));
+				if (player.recvb.capped() && (player.cproc == cprocPlayer || player.cproc == cprocValidate)) {	// an incomplete message can't be that big
+					Stats::add(workers[wid].stats.bufferRejects, 1);
+					slog.out("player ", pfd, " exceeded the receive limit");
+					throw PlayerError{ pfd };
+				}
+				player.recvb.release();	// unless a message is incomplete
+				if (fin)
+					throw PlayerError{ pfd };
+			} else if (it.events & Poller::EV_DISCONNECT)
+				throw PlayerError{ pfd };
+		} catch (const PlayerError& err) {
+			disconnectPlayers(err.pfds);
+		} catch (...) {
+			slog.err("unexpected error during player ", pfd, " iteration");
+			disconnectPlayers({ pfd });
+		}
+	}
+	expireTimers();
+	if (!wid && handoffPending != INVALID_SOCKET && polled >= handoffDue) {
+		slog.err("new server didn't send its handoff version in time");
+		dropHandoffRequest();
+	}
+	if (deltaDue != steady_clock::time_point() && steady_clock::now() >= deltaDue)
+		sendRoomDelta();
+	flushPlayers();
+	migratePlayers();
+	closeDropped();
+	trimPools();
+	if (!ready.empty())
+		workers[wid].stats.pollDuration.observe(std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - polled).count());
 #ifndef SERVICE
-	checkInput();
+	if (!wid)
+		checkInput();
 #endif
 	return running;
 }
 
-static int cleanup(const vector<pollfd>& pfds, int rc) {
+static void startWorker(uint id) {
+	wid = id;
+	randGen.seed(generateRandomSeed());
+	poller.start();
+	polled = steady_clock::now();
+	timers.start(polled);
+	trimDue = polled + std::chrono::seconds(trimInterval);
+	poller.add(workers[wid].server, nullptr);
+	if (workers[wid].wakefd != -1)
+		poller.add(workers[wid].wakefd, &workers[wid]);
+#ifdef __linux__
+	if (spliceMin && (pipe2(splicePipe.data(), O_NONBLOCK | O_CLOEXEC) || fcntl(splicePipe[1], F_SETPIPE_SZ, UINT16_MAX + 1) <= UINT16_MAX)) {	// a whole message has to fit
+		slog.err("failed to create a splice pipe for worker ", wid);
+		closeSplicePipe();
+	}
+#endif
+	if (!workers[wid].shard.getData().empty())
+		loadWorker();
+	if (!wid && handoff.getListener() != INVALID_SOCKET) {
+		poller.add(handoff.getListener(), &handoff);
+		if (std::any_of(lobby.channels.begin(), lobby.channels.end(), [](const Lobby::Channel& it) -> bool { return !it.changes.empty(); }))
+			deltaDue = polled + std::chrono::milliseconds(deltaWindow);	// the batch that the previous server didn't get to send
+	}
+}
+
+static void closeWorker() {
+	if (handoff.getListener() != INVALID_SOCKET)
+		saveWorker();	// the sockets get closed after the state has been handed over or not
+	else
+		for (auto& [pfd, player] : players) {
+			closeSocketV(pfd);
+			slog.out("socket ", pfd, " closed");
+		}
+	players.clear();
+	poller.end();
+#ifdef __linux__
+	closeSplicePipe();
+#endif
+}
+
+static void runWorker(uint id) {
+	try {
+		startWorker(id);
+		while (exec());
+	} catch (const std::runtime_error& err) {
+		slog.err("runtime error in worker ", id, ": ", err.what());
+		running = false;
+	} catch (...) {
+		slog.err("unknown error in worker ", id);
+		running = false;
+	}
+	closeWorker();
+}
+
+static string addChannels(const string& list) {	// returns the names of all channels besides the default one for the log
+	for (sizet pos = 0, end; pos < list.length(); pos = end + 1) {
+		end = std::min(list.find(',', pos), list.length());
+		string name = list.substr(pos, end - pos);
+		if (name.empty() || std::any_of(lobby.channels.begin(), lobby.channels.end(), [&name](const Lobby::Channel& it) -> bool { return it.name == name; }))
+			continue;
+		if (name.length() > roomNameLimit || std::any_of(name.begin(), name.end(), [](char c) -> bool { return uint8(c) < ' ' || c == '"' || c == '\\'; }))	// the name is used as a metrics label
+			slog.err("invalid channel name: ", name);
+		else if (lobby.channels.size() >= maxChannels) {
+			slog.err("channel limit of ", maxChannels, " reached");
+			break;
+		} else
+			lobby.channels.emplace_back().name = std::move(name);
+	}
+	string names;
+	for (sizet i = 1; i < lobby.channels.size(); ++i)	// including the ones that were taken over
+		names += (i > 1 ? ", " : "") + lobby.channels[i].name;
+	return names;
+}
+
+static int cleanup(int rc) {
 	slog.out("exiting with code ", rc);
-	for (vector<pollfd>::const_reverse_iterator it = pfds.rbegin(); it != pfds.rend(); ++it) {
-		closeSocketV(it->fd);
-		slog.out("socket ", it->fd, " closed");
+	running = false;
+	metrics.end();
+	for (uint i = 1; workers && i < workerCnt; ++i)
+		if (workers[i].thread.joinable())
+			workers[i].thread.join();
+	closeWorker();
+	if (handoff.getListener() != INVALID_SOCKET) {
+		bool handedOver = false;
+		if (handoffConn != INVALID_SOCKET) {
+			try {
+				if (rc != EXIT_SUCCESS)
+					throw Error("Not handing over after an error");
+				handOver();
+				handedOver = true;
+			} catch (const Error& err) {
+				if (handoffConn != INVALID_SOCKET)
+					closeSocketV(handoffConn);
+				slog.err("handoff failed: ", err.what());
+			}
+		}
+		for (uint i = 0; workers && i < workerCnt; ++i)
+			for (nsint it : workers[i].shardFds) {
+				closeSocketV(it);
+				slog.out("socket ", it, " closed");
+			}
+		if (handoffPending != INVALID_SOCKET)
+			closeSocket(handoffPending);
+		handoff.close(handedOver);
+	}
+	for (uint i = 0; workers && i < workerCnt; ++i) {
+		if (workers[i].server != INVALID_SOCKET) {
+			closeSocketV(workers[i].server);
+			slog.out("socket ", workers[i].server, " closed");
+		}
+#ifdef __linux__
+		if (workers[i].wakefd != -1)
+			close(workers[i].wakefd);
+#endif
 	}
 	slog.end();
 #ifdef _WIN32
@@ -507,14 +2394,14 @@ int main(int argc, char** argv) {
 #endif
 #ifndef _WIN32
 	signal(SIGQUIT, eventExit);
+	signal(SIGPIPE, SIG_IGN);	// a closed socket is handled by the failed send
 #endif
 	signal(SIGINT, eventExit);
 	signal(SIGABRT, eventExit);
 	signal(SIGTERM, eventExit);
 
-	vector<pollfd> pfds = { { INVALID_SOCKET, POLLIN | POLLRDHUP, 0 } };	// first element is server
 	try {
-		Arguments args(argc, argv, { arg4, arg6, argVerbose }, { argPort, argMaxPlayers, argLog, argMaxLogs });
+		Arguments args(argc, argv, { arg4, arg6, argVerbose }, { argPort, argMaxPlayers, argLog, argMaxLogs, argWorkers, argLobbyMark, argQueueLimit, argDeflateMin, argMaxMessage, argMetrics, argDeltaWindow, argChannels, argHandshakeTimeout, argHeartbeat, argIdleTimeout, argPingInterval, argResumeGrace, argReplayLimit, argSpectators, argHandoff, argSplice, argRecvLimit });
 		const char* maxLogs = args.getOpt(argMaxLogs);
 		slog.start(args.hasFlag(argVerbose), args.getOpt(argLog), maxLogs ? sstoul(maxLogs) : Log::defaultMaxLogfiles);
 
@@ -522,12 +2409,74 @@ int main(int argc, char** argv) {
 		if (!port)
 			port = defaultPort;
 		const char* playerLim = args.getOpt(argMaxPlayers);
-		maxPlayers = playerLim ? std::min(sstoull(playerLim), ullong(maxPlayersLimit)) : defaultMaxPlayers;
+		maxPlayers = playerLim ? uint(std::min(sstoull(playerLim), ullong(UINT32_MAX))) : defaultMaxPlayers;
 		int family = AF_UNSPEC;
 		if (args.hasFlag(arg4) && !args.hasFlag(arg6))
 			family = AF_INET;
 		else if (args.hasFlag(arg6) && !args.hasFlag(arg4))
 			family = AF_INET6;
+		if (const char* qlim = args.getOpt(argQueueLimit))
+			queueLimit = std::max(uint(sstoul(qlim)), 1u);
+		const char* lmark = args.getOpt(argLobbyMark);
+		lobbyMark = std::min(lmark ? uint(sstoul(lmark)) : defaultLobbyMark, queueLimit);
+		if (const char* mmsg = args.getOpt(argMaxMessage))
+			Buffer::maxMessage = std::clamp(uint(sstoul(mmsg)), uint(dataHeadSize), uint(UINT16_MAX));	// no message can be bigger than its 16 bit size field allows
+		const char* rcap = args.getOpt(argRecvLimit);
+		Buffer::maxBuffered = std::max(rcap ? uint(sstoul(rcap)) : defaultRecvLimit, Buffer::maxMessage * 2);	// room for a whole message and the beginning of the next one
+		if (const char* dwin = args.getOpt(argDeltaWindow))
+			deltaWindow = std::min(uint(sstoul(dwin)), checkTimeout);
+		if (const char* hto = args.getOpt(argHandshakeTimeout))
+			handshakeTimeout = std::chrono::seconds(std::clamp(uint(sstoul(hto)), 1u, maxTimeout));
+		if (const char* hbeat = args.getOpt(argHeartbeat))
+			heartbeat = std::chrono::seconds(std::min(uint(sstoul(hbeat)), maxTimeout));
+		if (const char* ito = args.getOpt(argIdleTimeout))
+			idleTimeout = std::chrono::seconds(std::min(uint(sstoul(ito)), maxTimeout));
+		if (const char* pint = args.getOpt(argPingInterval))
+			pingInterval = std::chrono::seconds(std::min(uint(sstoul(pint)), maxTimeout));
+		if (const char* grace = args.getOpt(argResumeGrace))
+			resumeGrace = std::chrono::seconds(std::min(uint(sstoul(grace)), maxTimeout));
+		if (const char* rlim = args.getOpt(argReplayLimit))
+			replayLimit = std::min(uint(sstoul(rlim)), queueLimit);
+		if (const char* slim = args.getOpt(argSpectators))
+			spectatorLimit = uint(std::min(sstoull(slim), ullong(maxPlayers)));
+		if (const char* smin = args.getOpt(argSplice)) {
+#ifdef __linux__
+			if (ulong len = sstoul(smin))
+				spliceMin = uint(std::clamp(len, ulong(dataHeadSize), ulong(UINT16_MAX)));
+#else
+			slog.err("splice isn't supported on this system");
+#endif
+		}
+		if (const char* dmin = args.getOpt(argDeflateMin)) {
+			if (WsDeflate::supported)
+				deflateMin = uint(sstoul(dmin));
+			else
+				slog.err("permessage-deflate isn't supported by this build");
+		}
+		if (const char* wcnt = args.getOpt(argWorkers)) {
+#if defined(__linux__) && defined(SO_REUSEPORT)
+			workerCnt = std::clamp(uint(sstoul(wcnt)), 1u, maxWorkers);
+			if (!sstoul(wcnt))
+				workerCnt = std::clamp(std::thread::hardware_concurrency(), 1u, maxWorkers);
+#else
+			slog.err("multiple workers aren't supported on this system");
+#endif
+		}
+		if (ullong files = ullong(maxPlayers) + workerCnt * (spliceMin ? 5 : 3) + spareFiles; raiseFileLimit(uint(std::min(files, ullong(UINT32_MAX)))) < files)	// a listener, poller, wakeup and maybe a pipe per worker
+			slog.err("the open file limit is too low for ", maxPlayers, " players");
+		bool takenOver = false;
+		if (const char* hfile = args.getOpt(argHandoff)) {
+			vector<uint8> state;
+			vector<nsint> fds;
+			if (!Handoff::supported)
+				slog.err("handoffs aren't supported on this system");
+			else if (takenOver = handoff.receive(hfile, state, fds); takenOver)
+				loadServer(std::move(state), fds);	// with the previous server's workers and channels
+		}
+		if (!takenOver)
+			lobby.channels.emplace_back();
+		const char* chans = args.getOpt(argChannels);
+		string chanNames = addChannels(chans ? chans : "");
 
 #ifdef _WIN32
 		DWORD pid = GetCurrentProcessId();
@@ -536,25 +2485,43 @@ int main(int argc, char** argv) {
 #else
 		pid_t pid = getpid();
 #endif
-		pfds[0].fd = bindSocket(port, family);
-		slog.out(linend, "Thrones Server v", commonVersion, linend, "PID: ", pid, linend, "port: ", port, linend, "family: ", family == AF_INET ? "AF_INET" : family == AF_INET6 ? "AF_INET6" : "AF_UNSPEC", linend, "player limit: ", maxPlayers, linend, "room limit: ", maxRooms(), linend);
-		randGen.seed(generateRandomSeed());
+		if (!takenOver)
+			workers = std::make_unique<Worker[]>(workerCnt);
+		for (uint i = 0; i < workerCnt; ++i) {
+			if (!takenOver) {
+				workers[i].server = bindSocket(port, family, workerCnt > 1);
+				if (noblockSocket(workers[i].server, true))
+					throw Error(msgIoctlFail);
+			}
+#ifdef __linux__
+			if (workerCnt > 1 && (workers[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+				throw Error(msgPollFail);
+#endif
+		}
+		if (Handoff::supported && args.getOpt(argHandoff))
+			handoff.listen();
+		if (const char* maddr = args.getOpt(argMetrics))
+			metrics.start(maddr, collectMetrics);
+		startWorker(0);
+		slog.out(linend, "Thrones Server v", commonVersion, linend, "PID: ", pid, linend, "port: ", port, linend, "family: ", family == AF_INET ? "AF_INET" : family == AF_INET6 ? "AF_INET6" : "AF_UNSPEC", linend, "player limit: ", maxPlayers, linend, "room limit: ", maxRooms(), linend, "workers: ", workerCnt, linend, "queue limits: ", lobbyMark, " / ", queueLimit, linend, "message limit: ", Buffer::maxMessage, linend, "receive limit: ", Buffer::maxBuffered, linend, "room batch window: ", deltaWindow, "ms", linend, "timeouts: handshake ", handshakeTimeout.count(), "s, heartbeat ", heartbeat.count() ? toStr(heartbeat.count()) + 's' : string("off"), ", lobby idle ", idleTimeout.count() ? toStr(idleTimeout.count()) + 's' : string("off"), linend, "ping interval: ", pingInterval.count() ? toStr(pingInterval.count()) + 's' : string("off"), linend, "resume grace: ", resumeGrace.count() ? toStr(resumeGrace.count()) + "s with " + toStr(replayLimit) + " bytes of replay" : string("off"), linend, "spectators: ", spectatorLimit ? "up to " + toStr(spectatorLimit) + " per room" : string("off"), linend, "splice relay: ", spliceMin ? "from " + toStr(spliceMin) + " bytes" : string("off"), linend, "channels: ", !chanNames.empty() ? chanNames : string("default only"), linend, "permessage-deflate: ", deflateMin ? "from " + toStr(deflateMin) + " bytes" : string("off"), linend, "metrics: ", !metrics.address().empty() ? metrics.address() : string("off"), linend, "handoff: ", handoff.getListener() != INVALID_SOCKET ? args.getOpt(argHandoff) : "off", linend);
+		for (uint i = 1; i < workerCnt; ++i)
+			workers[i].thread = std::thread(runWorker, i);
 	} catch (const Error& err) {
 		slog.err(err.what());
-		return cleanup(pfds, EXIT_FAILURE);
+		return cleanup(EXIT_FAILURE);
 	}
 
 #if !defined(_WIN32) && !defined(SERVICE)
 	Terminal term;	// here to set and reset the terminal
 #endif
 	try {
-		while (exec(pfds));
+		while (exec());
 	} catch (const std::runtime_error& err) {
 		slog.err("runtime error: ", err.what());
-		return cleanup(pfds, EXIT_FAILURE);
+		return cleanup(EXIT_FAILURE);
 	} catch (...) {
 		slog.err("unknown error");
-		return cleanup(pfds, EXIT_FAILURE);
+		return cleanup(EXIT_FAILURE);
 	}
-	return cleanup(pfds, EXIT_SUCCESS);
+	return cleanup(EXIT_SUCCESS);
 }
@@ -0,0 +1,33 @@
+#include "slab.h"
+
+// SLAB
+
+thread_local Slab::Pool Slab::pool;
+
+void* Slab::take(sizet size) {
+	sizet cls = (size - 1) / align;
+	if (Slot* slot = pool.freeSlots[cls]) {
+		pool.freeSlots[cls] = slot->next;
+		pool.stats.freeBytes -= (cls + 1) * align;
+		return slot;
+	}
+	size = (cls + 1) * align;
+	if (sizet(pool.chunkEnd - pool.chunkPos) < size) {	// the old chunk's rest is smaller than maxSlot and gets wasted
+		pool.stats.freeBytes += chunkSize - (pool.chunkEnd - pool.chunkPos);
+		pool.chunkPos = static_cast<uint8*>(::operator new(chunkSize));
+		pool.chunkEnd = pool.chunkPos + chunkSize;
+		pool.stats.chunkBytes += chunkSize;
+	}
+	void* ptr = pool.chunkPos;
+	pool.chunkPos += size;
+	pool.stats.freeBytes -= size;
+	return ptr;
+}
+
+void Slab::give(void* ptr, sizet size) noexcept {
+	sizet cls = (size - 1) / align;
+	Slot* slot = static_cast<Slot*>(ptr);
+	slot->next = pool.freeSlots[cls];
+	pool.freeSlots[cls] = slot;
+	pool.stats.freeBytes += (cls + 1) * align;
+}
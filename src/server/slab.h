@@ -0,0 +1,88 @@
+#pragma once
+
+#include "server.h"
+
+// size classed free lists that small objects like the nodes of hash tables and their bucket arrays are carved from in big chunks instead of asking malloc for every one of them
+// freed slots go to a list of the thread that frees them and the chunks are never returned, so objects can move between threads and the memory of a burst of connections gets reused by the next one instead of fragmenting the heap
+class Slab {
+public:
+	static constexpr sizet align = 16;	// granularity of the size classes
+	static constexpr sizet maxSlot = 512;	// bigger allocations are left to operator new
+	static constexpr sizet chunkSize = 64 * 1024;	// bytes that get allocated at once
+
+	struct Stats {
+		sizet chunkBytes = 0;	// memory of the chunks that the thread allocated
+		sizet freeBytes = 0;	// size of the slots in the thread's free lists and the unused rest of its current chunk
+	};
+
+private:
+	struct Slot {
+		Slot* next;
+	};
+
+	struct Pool {
+		array<Slot*, maxSlot / align> freeSlots{};	// list of freed slots per size class
+		uint8* chunkPos = nullptr;	// unused rest of the current chunk
+		uint8* chunkEnd = nullptr;
+		Stats stats;
+	};
+	static thread_local Pool pool;	// trivially destructible, so that objects can still be freed while the thread's other variables get destroyed
+
+public:
+	static void* take(sizet size);	// size mustn't be 0 or bigger than maxSlot
+	static void give(void* ptr, sizet size) noexcept;
+	static const Stats& stats();
+};
+
+inline const Slab::Stats& Slab::stats() {
+	return pool.stats;
+}
+
+// allocator for node based containers that takes its memory from the slab
+template <class T>
+class SlabAllocator {
+public:
+	using value_type = T;
+
+	SlabAllocator() = default;
+	template <class U> SlabAllocator(const SlabAllocator<U>&) noexcept {}
+
+	T* allocate(sizet n);
+	void deallocate(T* ptr, sizet n) noexcept;
+private:
+	static bool pooled(sizet n);
+};
+
+template <class T>
+T* SlabAllocator<T>::allocate(sizet n) {
+	return static_cast<T*>(pooled(n) ? Slab::take(n * sizeof(T)) : ::operator new(n * sizeof(T)));
+}
+
+template <class T>
+void SlabAllocator<T>::deallocate(T* ptr, sizet n) noexcept {
+	if (pooled(n))
+		Slab::give(ptr, n * sizeof(T));
+	else
+		::operator delete(ptr);
+}
+
+template <class T>
+bool SlabAllocator<T>::pooled(sizet n) {
+	return alignof(T) <= Slab::align && n && n <= Slab::maxSlot / sizeof(T);
+}
+
+template <class T, class U>
+bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&) {
+	return true;
+}
+
+template <class T, class U>
+bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&) {
+	return false;
+}
+
+template <class K, class V>
+using SlabMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, SlabAllocator<pair<const K, V>>>;
+
+template <class T>
+using SlabSet = std::unordered_set<T, std::hash<T>, std::equal_to<T>, SlabAllocator<T>>;
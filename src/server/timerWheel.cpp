@@ -0,0 +1,52 @@
+#include "timerWheel.h"
+
+// TIMER WHEEL
+
+void TimerWheel::start(clock::time_point now) {
+	origin = now;
+	cur = 0;
+}
+
+uint32 TimerWheel::schedule(nsint fd, clock::time_point when) {
+	if (!++lastId)
+		++lastId;
+	uint64 due = when > origin ? uint64((when - origin + tick - clock::duration(1)) / tick) : 0;	// round up to never expire early
+	insert(Entry{ Timer{ fd, lastId }, std::clamp(due, cur + 1, cur + maxDelay) });
+	++cnt;
+	return lastId;
+}
+
+const vector<TimerWheel::Timer>& TimerWheel::advance(clock::time_point now) {
+	drain(expired);
+	for (uint64 end = now > origin ? uint64((now - origin) / tick) : 0; cur < end;) {
+		++cur;
+		for (uint level = levelCnt - 1; level; --level)	// a level's slot gets spread over the lower levels when they wrap around to it
+			if (!(cur & ((uint64(1) << slotBits * level) - 1))) {
+				vector<Entry>& slot = slots[level][(cur >> slotBits * level) & (slotCnt - 1)];
+				vector<Entry> moving;
+				moving.swap(slot);
+				for (const Entry& it : moving)
+					insert(it);
+			}
+
+		vector<Entry>& slot = slots[0][cur & (slotCnt - 1)];
+		for (const Entry& it : slot)
+			expired.push_back(it.timer);
+		cnt -= uint(slot.size());
+		drain(slot);
+	}
+	return expired;
+}
+
+int TimerWheel::timeout(clock::time_point now) const {
+	if (!cnt)
+		return -1;
+	clock::time_point next = origin + tick * llong(cur + 1);
+	return next > now ? int(std::chrono::ceil<std::chrono::milliseconds>(next - now).count()) : 0;
+}
+
+void TimerWheel::insert(const Entry& ent) {
+	uint level = 0;	// the highest digit in which the due tick differs from the current one
+	for (uint64 diff = ent.due ^ cur; level + 1 < levelCnt && diff >> slotBits * (level + 1); ++level);
+	slots[level][(ent.due >> slotBits * level) & (slotCnt - 1)].push_back(ent);
+}
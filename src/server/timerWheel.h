@@ -0,0 +1,59 @@
+#pragma once
+
+#include "server.h"
+#include <chrono>
+
+// hierarchical timing wheel for deadlines of sockets, where scheduling and expiring a timer costs O(1) and replaced timers aren't removed but expire without effect
+class TimerWheel {
+public:
+	using clock = std::chrono::steady_clock;
+
+	struct Timer {
+		nsint fd;
+		uint32 id;	// has to match the socket's current timer to be valid
+	};
+
+	static constexpr clock::duration tick = std::chrono::milliseconds(250);
+private:
+	static constexpr uint slotBits = 6;
+	static constexpr uint slotCnt = 1 << slotBits;
+	static constexpr uint levelCnt = 4;
+	static constexpr uint keepEntries = 256;	// a drained list keeps its memory up to this size, so that a burst of connections doesn't leave every slot oversized
+public:
+	static constexpr uint64 maxDelay = (1 << slotBits * (levelCnt - 1)) - 1;	// in ticks, which is about 18 hours, and later timers get clamped to it
+private:
+
+	struct Entry {
+		Timer timer;
+		uint64 due;	// tick
+	};
+
+	array<array<vector<Entry>, slotCnt>, levelCnt> slots;	// a level's slot holds the entries whose due tick has its index as the level's digit
+	vector<Timer> expired;
+	clock::time_point origin;
+	uint64 cur = 0;	// last processed tick
+	uint cnt = 0;
+	uint32 lastId = 0;
+
+public:
+	void start(clock::time_point now);
+	uint32 schedule(nsint fd, clock::time_point when);	// returns the new timer's id, which is never 0
+	const vector<Timer>& advance(clock::time_point now);	// returns the timers that expired since the last call
+	int timeout(clock::time_point now) const;	// milliseconds until the next tick or -1 if there's nothing to wait for
+	uint size() const;
+private:
+	void insert(const Entry& ent);
+	template <class T> static void drain(vector<T>& list);
+};
+
+template <class T>
+void TimerWheel::drain(vector<T>& list) {
+	if (list.capacity() > keepEntries)
+		vector<T>().swap(list);
+	else
+		list.clear();
+}
+
+inline uint TimerWheel::size() const {
+	return cnt;
+}
@@ -0,0 +1,164 @@
+#include "wsDeflate.h"
+#ifdef WS_DEFLATE
+#include <zlib.h>
+#endif
+
+constexpr uint8 deflateTail[] = { 0x00, 0x00, 0xFF, 0xFF };
+constexpr char msgDeflateFail[] = "Failed to initialize zlib";
+
+static thread_local vector<uint8> zbuf;
+
+// WS DEFLATE
+
+#ifdef WS_DEFLATE
+WsDeflate::Streams::Streams(const Com::WsDeflateParams& prm) :
+	params(prm)
+{}
+
+WsDeflate::Streams::~Streams() {
+	if (def)
+		deflateEnd(def.get());
+	if (inf)
+		inflateEnd(inf.get());
+}
+
+WsDeflate::WsDeflate() = default;
+
+WsDeflate::WsDeflate(WsDeflate&& wd) = default;
+
+WsDeflate::~WsDeflate() = default;
+
+const vector<uint8>& WsDeflate::deflate(const uint8* data, uint len) {
+	if (!streams)
+		throw Com::Error(msgDeflateFail);
+	const Com::WsDeflateParams& params = streams->params;
+	uptr<z_stream>& def = streams->def;
+	if (!def) {
+		def = std::make_unique<z_stream>();
+		if (deflateInit2(def.get(), level, Z_DEFLATED, -params.serverWindow, memLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+			def.reset();
+			throw Com::Error(msgDeflateFail);
+		}
+	}
+
+	def->next_in = const_cast<uint8*>(data);
+	def->avail_in = len;
+	zbuf.resize(deflateBound(def.get(), len) + sizeof(deflateTail) * 2);	// a sync flush adds an empty block
+	uint olen = 0;
+	do {
+		if (olen == zbuf.size())
+			zbuf.resize(zbuf.size() * 2);
+		def->next_out = zbuf.data() + olen;
+		def->avail_out = uint(zbuf.size()) - olen;
+		if (int rc = ::deflate(def.get(), Z_SYNC_FLUSH); rc != Z_OK && rc != Z_BUF_ERROR)
+			throw Com::Error(Com::msgProtocolError);
+		olen = uint(zbuf.size()) - def->avail_out;
+	} while (!def->avail_out);
+	zbuf.resize(olen - sizeof(deflateTail));
+
+	if (params.serverNoContext)
+		deflateReset(def.get());
+	return zbuf;
+}
+
+const vector<uint8>& WsDeflate::inflate(const uint8* data, uint len) {
+	if (!streams)
+		throw Com::Error(Com::msgProtocolError);
+	startInflate();
+	z_stream* inf = streams->inf.get();
+
+	inf->next_in = const_cast<uint8*>(data);
+	inf->avail_in = len;
+	uint olim = Com::Buffer::maxMessage + 1;	// one byte more than allowed is enough to tell that a message is too big
+	zbuf.resize(std::clamp(len * 4, 256u, olim));
+	uint olen = 0;
+	for (bool tail = false;;) {
+		if (!inf->avail_in && !tail) {
+			inf->next_in = const_cast<uint8*>(deflateTail);
+			inf->avail_in = sizeof(deflateTail);
+			tail = true;
+		}
+		if (olen == zbuf.size()) {
+			if (zbuf.size() >= olim)	// stop inflating before the message outgrows the limit
+				throw Com::FrameError(Com::msgFrameTooBig);
+			zbuf.resize(std::min(zbuf.size() * 2, sizet(olim)));
+		}
+		inf->next_out = zbuf.data() + olen;
+		inf->avail_out = uint(zbuf.size()) - olen;
+		int rc = ::inflate(inf, Z_SYNC_FLUSH);
+		olen = uint(zbuf.size()) - inf->avail_out;
+		if (rc == Z_STREAM_END) {	// a final block ends the stream, so the next message starts a new one
+			inflateReset(inf);
+			break;
+		}
+		if (rc != Z_OK && rc != Z_BUF_ERROR)
+			throw Com::Error(Com::msgProtocolError);
+		if (tail && !inf->avail_in && inf->avail_out)
+			break;
+	}
+	zbuf.resize(olen);
+	return zbuf;
+}
+
+void WsDeflate::startInflate() {
+	if (!streams)
+		throw Com::Error(msgDeflateFail);
+	if (uptr<z_stream>& inf = streams->inf; !inf) {
+		inf = std::make_unique<z_stream>();
+		if (inflateInit2(inf.get(), -streams->params.clientWindow) != Z_OK) {
+			inf.reset();
+			throw Com::Error(msgDeflateFail);
+		}
+	}
+}
+
+vector<uint8> WsDeflate::getWindow() const {
+	if (!streams || !streams->inf)
+		return vector<uint8>();
+	vector<uint8> win(sizet(1) << streams->params.clientWindow);
+	uInt len = 0;
+	if (inflateGetDictionary(streams->inf.get(), win.data(), &len) != Z_OK)
+		throw Com::Error(msgDeflateFail);
+	win.resize(len);
+	return win;
+}
+
+void WsDeflate::setWindow(const vector<uint8>& win) {
+	if (win.empty())
+		return;
+	startInflate();
+	if (inflateSetDictionary(streams->inf.get(), win.data(), uInt(win.size())) != Z_OK)	// a raw stream takes a dictionary at any time
+		throw Com::Error(msgDeflateFail);
+}
+#else
+struct z_stream_s {};
+
+WsDeflate::Streams::Streams(const Com::WsDeflateParams& prm) :
+	params(prm)
+{}
+
+WsDeflate::Streams::~Streams() = default;
+
+WsDeflate::WsDeflate() = default;
+
+WsDeflate::WsDeflate(WsDeflate&& wd) = default;
+
+WsDeflate::~WsDeflate() = default;
+
+const vector<uint8>& WsDeflate::deflate(const uint8*, uint) {
+	throw Com::Error(msgDeflateFail);
+}
+
+const vector<uint8>& WsDeflate::inflate(const uint8*, uint) {
+	throw Com::Error(Com::msgProtocolError);
+}
+
+vector<uint8> WsDeflate::getWindow() const {
+	return vector<uint8>();
+}
+
+void WsDeflate::setWindow(const vector<uint8>& win) {
+	if (!win.empty())
+		throw Com::Error(msgDeflateFail);
+}
+#endif
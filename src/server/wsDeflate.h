@@ -0,0 +1,58 @@
+#pragma once
+
+#include "server.h"
+
+struct z_stream_s;
+
+// permessage-deflate streams of a websocket connection, which only get allocated once they're needed
+class WsDeflate {
+public:
+#ifdef WS_DEFLATE
+	static constexpr bool supported = true;
+#else
+	static constexpr bool supported = false;	// built without zlib
+#endif
+	static constexpr Com::WsDeflateParams limits = { 12, 12, false };	// clients can decompress any window smaller than what they allow and have to accept a smaller window if they offer to limit theirs
+private:
+	static constexpr int level = 3;
+	static constexpr int memLevel = 5;	// together with the window that's about 32 KiB for a compressor
+	static constexpr Com::WsDeflateParams off = {};
+
+	struct Streams {
+		Com::WsDeflateParams params;
+		uptr<z_stream_s> def;
+		uptr<z_stream_s> inf;
+
+		Streams(const Com::WsDeflateParams& prm);
+		~Streams();
+	};
+
+	uptr<Streams> streams;	// null unless permessage-deflate has been negotiated
+
+public:
+	WsDeflate();
+	WsDeflate(WsDeflate&& wd);
+	~WsDeflate();
+
+	bool enabled() const;
+	const Com::WsDeflateParams& getParams() const;
+	void setParams(const Com::WsDeflateParams& prm);
+	vector<uint8> getWindow() const;	// history of the decompressor, which the client's next messages can refer to
+	void setWindow(const vector<uint8>& win);	// continues the decompression of another connection's stream, while the compressor can start over since the client doesn't mind
+	const vector<uint8>& deflate(const uint8* data, uint len);	// compresses a message without the trailing 0x0000FFFF into a buffer that's shared by the thread
+	const vector<uint8>& inflate(const uint8* data, uint len);	// decompresses a message into the same buffer or throws Error
+private:
+	void startInflate();
+};
+
+inline bool WsDeflate::enabled() const {
+	return bool(streams);
+}
+
+inline const Com::WsDeflateParams& WsDeflate::getParams() const {
+	return streams ? streams->params : off;
+}
+
+inline void WsDeflate::setParams(const Com::WsDeflateParams& prm) {
+	streams = prm.serverWindow ? std::make_unique<Streams>(prm) : nullptr;
+}
@@ -0,0 +1,312 @@
+#include "server/server.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+using std::chrono::steady_clock;
+
+// BUFFER
+
+// the receiving part of Com::Buffer before the read cursor, which grows in fixed steps and moves the rest after every message
+class OldBuffer {
+private:
+	static constexpr uint sizeStep = 512;
+
+	uptr<uint8[]> data = std::make_unique<uint8[]>(sizeStep);
+	uint size = sizeStep;
+	uint dlim = 0;
+
+public:
+	uint8* recv() {
+		return dlim >= Com::dataHeadSize && dlim >= Com::read16(&data[1]) ? data.get() : nullptr;
+	}
+
+	void clearCur() {
+		eraseFront(Com::read16(&data[1]));
+	}
+
+	bool recvData(nsint socket) {
+		for (long len;; dlim += len) {
+			if (dlim >= size)
+				resize(dlim);
+			if (len = ::recv(socket, &data[dlim], size - dlim, MSG_DONTWAIT); len <= 0)
+				return !len;
+		}
+	}
+
+private:
+	void eraseFront(uint len) {
+		if (dlim -= len; size - dlim <= sizeStep)
+			std::copy_n(&data[len], dlim, data.get());
+		else
+			resize(dlim, len);
+	}
+
+	void resize(uint lim, uint ofs = 0) {
+		uint nsiz = (lim / sizeStep + 1) * sizeStep;
+		uptr<uint8[]> ndat = std::make_unique<uint8[]>(nsiz);
+		std::copy_n(&data[ofs], dlim, ndat.get());
+		data = std::move(ndat);
+		size = nsiz;
+	}
+};
+
+static uint8* recvMessage(OldBuffer& buf, nsint) {
+	return buf.recv();
+}
+
+static uint8* recvMessage(Com::Buffer& buf, nsint socket) {
+	return buf.recv(socket, false);
+}
+
+static void clearMessage(OldBuffer& buf) {
+	buf.clearCur();
+}
+
+static void clearMessage(Com::Buffer& buf) {
+	buf.clearCur(false);
+}
+
+// sends bursts of messages through a socket pair and processes them like the server does after every poll event
+template <class B>
+double benchBuffer(uint msgSize, uint burstSize, uint bursts) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		throw std::runtime_error("failed to create socket pair");
+	int sbuf = int(burstSize);
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sbuf, sizeof(sbuf));
+	setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &sbuf, sizeof(sbuf));
+
+	vector<uint8> burst(burstSize / msgSize * msgSize);
+	for (uint i = 0; i < burst.size(); i += msgSize) {
+		burst[i] = uint8(Com::Code::message);
+		Com::write16(&burst[i+1], uint16(msgSize));
+	}
+
+	B buf;
+	ullong checksum = 0;
+	steady_clock::duration time{};
+	for (uint i = 0; i < bursts; ++i) {
+		for (uint ofs = 0; ofs < burst.size();) {	// fill as much as the socket takes, then process it
+			long len = send(fds[0], burst.data() + ofs, burst.size() - ofs, MSG_DONTWAIT);
+			if (len <= 0 && ofs == 0)
+				throw std::runtime_error("failed to send");
+			if (len > 0)
+				ofs += uint(len);
+
+			steady_clock::time_point start = steady_clock::now();
+			buf.recvData(fds[1]);
+			for (uint8* msg; (msg = recvMessage(buf, fds[1])); clearMessage(buf))
+				checksum += msg[0];
+			time += steady_clock::now() - start;
+		}
+	}
+	close(fds[0]);
+	close(fds[1]);
+	if (checksum != ullong(burst.size() / msgSize) * bursts * uint8(Com::Code::message))
+		throw std::runtime_error("lost messages");
+	return std::chrono::duration<double, std::milli>(time).count();
+}
+
+static void benchBuffers() {
+	std::cout << "Buffer (ms for receiving and processing bursts of messages)" << std::endl;
+	std::cout << std::setw(10) << "message" << std::setw(10) << "burst" << std::setw(10) << "old" << std::setw(10) << "new" << std::endl;
+	for (auto [msgSize, burstSize, bursts] : { tuple(8u, 4096u, 2000u), tuple(8u, 131072u, 100u), tuple(200u, 131072u, 100u), tuple(8000u, 131072u, 100u), tuple(8000u, 1048576u, 20u) }) {
+		double otime = benchBuffer<OldBuffer>(msgSize, burstSize, bursts);
+		double ntime = benchBuffer<Com::Buffer>(msgSize, burstSize, bursts);
+		std::cout << std::setw(10) << msgSize << std::setw(10) << burstSize << std::setw(10) << std::fixed << std::setprecision(2) << otime << std::setw(10) << ntime << std::endl;
+	}
+}
+
+// UNMASK
+
+static double benchUnmaskCall(Com::UnmaskCall call, uint len, uint rounds) {
+	const uint8 mask[4] = { 0x37, 0xFA, 0x21, 0x3D };
+	vector<uint8> data(len + 1);
+	steady_clock::time_point start = steady_clock::now();
+	for (uint i = 0; i < rounds; ++i)
+		call(data.data() + 1, len, mask);	// payloads usually start at an odd offset after the frame head
+	double time = std::chrono::duration<double, std::milli>(steady_clock::now() - start).count();
+	if (rounds % 2 && data[1] != mask[0])
+		throw std::runtime_error("wrong unmask result");
+	return time;
+}
+
+static void unmaskBytes(uint8* data, uint len, const uint8* mask) {
+	for (uint i = 0; i < len; ++i)
+		data[i] ^= mask[i % sizeof(uint32)];
+}
+
+static void benchUnmask() {
+	vector<pair<const char*, Com::UnmaskCall>> calls = Com::unmaskCalls();
+	calls.insert(calls.begin(), pair("bytes", unmaskBytes));
+	std::cout << "Unmask (ms for 1 GiB of payloads)" << std::endl << std::setw(10) << "payload";
+	for (auto [name, call] : calls)
+		std::cout << std::setw(10) << name;
+	std::cout << std::endl;
+	for (uint len : { 16u, 125u, 1400u, 65535u }) {
+		std::cout << std::setw(10) << len;
+		for (auto [name, call] : calls)
+			std::cout << std::setw(10) << std::fixed << std::setprecision(2) << benchUnmaskCall(call, len, (1u << 30) / len | 1);
+		std::cout << std::endl;
+	}
+}
+
+// WEBSOCKET KEY
+
+// SHA-1 and base64 before the block based versions, which hash and append one byte at a time
+static uint32 rol(uint32 value, uint8 bits) {
+	return (value << bits) | (value >> (32 - bits));
+}
+
+static uint32 blk0(uint8* block, uint i) {
+	uint32 num = readMem<uint32>(block + i * sizeof(uint32));
+	num = (rol(num, 24) & 0xFF00FF00) | (rol(num, 8) & 0x00FF00FF);
+	writeMem(block + i * sizeof(uint32), num);
+	return num;
+}
+
+static uint32 blk(uint8* block, uint i) {
+	uint32 num = rol(readMem<uint32>(block + ((i + 13) & 15) * sizeof(uint32)) ^ readMem<uint32>(block + ((i + 8) & 15) * sizeof(uint32)) ^ readMem<uint32>(block + ((i + 2) & 15) * sizeof(uint32)) ^ readMem<uint32>(block + (i & 15) * sizeof(uint32)), 1);
+	writeMem(block + (i & 15) * sizeof(uint32), num);
+	return num;
+}
+
+static void sha1Transform(uint32* state, uint8* buffer) {
+	array<uint32, 5> scop = { state[0], state[1], state[2], state[3], state[4] };
+	for (uint i = 0; i < 80; ++i) {
+		if (i < 16)
+			scop[4] += ((scop[1] & (scop[2] ^ scop[3])) ^ scop[3]) + blk0(buffer, i) + 0x5A827999 + rol(scop[0], 5);
+		else if (i < 20)
+			scop[4] += ((scop[1] & (scop[2] ^ scop[3])) ^ scop[3]) + blk(buffer, i) + 0x5A827999 + rol(scop[0], 5);
+		else if (i < 40)
+			scop[4] += (scop[1] ^ scop[2] ^ scop[3]) + blk(buffer, i) + 0x6ED9EBA1 + rol(scop[0], 5);
+		else if (i < 60)
+			scop[4] += (((scop[1] | scop[2]) & scop[3]) | (scop[1] & scop[2])) + blk(buffer, i) + 0x8F1BBCDC + rol(scop[0], 5);
+		else
+			scop[4] += (scop[1] ^ scop[2] ^ scop[3]) + blk(buffer, i) + 0xCA62C1D6 + rol(scop[0], 5);
+		scop[1] = rol(scop[1], 30);
+		std::rotate(scop.begin(), scop.end() - 1, scop.end());
+	}
+	for (uint i = 0; i < 5; ++i)
+		state[i] += scop[i];
+}
+
+static void sha1Update(uint32* state, uint32* count, uint8* buffer, uint8* data, uint32 len) {
+	uint32 j = count[0];
+	if (count[0] += len << 3; count[0] < j)
+		++count[1];
+	count[1] += len >> 29;
+	j = (j >> 3) & 63;
+
+	uint32 i;
+	if (j + len > 63) {
+		i = 64 - j;
+		std::copy_n(data, i, buffer + j);
+		sha1Transform(state, buffer);
+		for (; i + 63 < len; i += 64)
+			sha1Transform(state, data + i);
+		j = 0;
+	} else
+		i = 0;
+	std::copy_n(data + i, len - i, buffer + j);
+}
+
+static string oldDigestSha1(string str) {
+	uint32 state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint32 count[2] = { 0, 0 };
+	uint8 buffer[64];
+	for (sizet i = 0; i < str.length(); ++i)
+		sha1Update(state, count, buffer, reinterpret_cast<uint8*>(str.data()) + i, 1);
+
+	uint8 finalcount[8];
+	for (uint i = 0; i < 8; ++i)
+		finalcount[i] = (count[i<4] >> ((3 - (i & 3)) * 8)) & 255;
+
+	uint8 c = 0x80;
+	sha1Update(state, count, buffer, &c, 1);
+	while ((count[0] & 504) != 448) {
+		c = 0;
+		sha1Update(state, count, buffer, &c, 1);
+	}
+	sha1Update(state, count, buffer, finalcount, 8);
+
+	str.resize(20);
+	for (sizet i = 0; i < str.length(); ++i)
+		str[i] = char((state[i >> 2] >> ((3 - (i & 3)) * 8)) & 255);
+	return str;
+}
+
+static string oldEncodeBase64(const string& str) {
+	constexpr char b64charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	string ret;
+	uint8 arr3[3], arr4[4];
+	uint i = 0;
+	for (char ch : str) {
+		arr3[i++] = ch;
+		if (i == 3) {
+			arr4[0] = (arr3[0] & 0xFC) >> 2;
+			arr4[1] = ((arr3[0] & 0x03) << 4) + ((arr3[1] & 0xF0) >> 4);
+			arr4[2] = ((arr3[1] & 0x0F) << 2) + ((arr3[2] & 0xC0) >> 6);
+			arr4[3] = arr3[2] & 0x3F;
+
+			for (i = 0; i < 4 ; ++i)
+				ret += b64charset[arr4[i]];
+			i = 0;
+		}
+	}
+	if (i) {
+		for (uint j = i; j < 3; ++j)
+			arr3[j] = '\0';
+		arr4[0] = (arr3[0] & 0xFC) >> 2;
+		arr4[1] = ((arr3[0] & 0x03) << 4) + ((arr3[1] & 0xF0) >> 4);
+		arr4[2] = ((arr3[1] & 0x0F) << 2) + ((arr3[2] & 0xC0) >> 6);
+
+		for (uint j = 0; j < i + 1; ++j)
+			ret += b64charset[arr4[j]];
+		while (i++ < 3)
+			ret += '=';
+	}
+	return ret;
+}
+
+static void benchWsKey() {
+	std::cout << "WebSocket key (ms for hashing and encoding 256 MiB of input)" << std::endl;
+	std::cout << std::setw(10) << "input" << std::setw(10) << "old" << std::setw(10) << "new" << std::endl;
+	for (uint len : { 60u, 1024u, 65536u }) {
+		string input(len, 'k');
+		uint rounds = (256u << 20) / len;
+		sizet checksum = 0;
+		steady_clock::time_point start = steady_clock::now();
+		for (uint i = 0; i < rounds; ++i)
+			checksum += oldEncodeBase64(oldDigestSha1(input))[0];
+		double otime = std::chrono::duration<double, std::milli>(steady_clock::now() - start).count();
+
+		start = steady_clock::now();
+		for (uint i = 0; i < rounds; ++i) {
+			Com::Sha1 sha;
+			sha.update(input.data(), input.length());
+			uint8 digest[Com::Sha1::digestSize];
+			sha.finish(digest);
+			char accept[Com::base64Size(Com::Sha1::digestSize)];
+			Com::encodeBase64(digest, Com::Sha1::digestSize, accept);
+			checksum -= accept[0];
+		}
+		double ntime = std::chrono::duration<double, std::milli>(steady_clock::now() - start).count();
+		if (checksum)
+			throw std::runtime_error("different digests");
+		std::cout << std::setw(10) << len << std::setw(10) << std::fixed << std::setprecision(2) << otime << std::setw(10) << ntime << std::endl;
+	}
+}
+
+int main() {
+	try {
+		benchBuffers();
+		benchUnmask();
+		benchWsKey();
+	} catch (const std::runtime_error& err) {
+		std::cerr << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
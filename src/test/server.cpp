@@ -8,6 +8,28 @@ static void testWsKey() {
 	assertEqual(Com::encodeBase64(Com::digestSha1("Iv8io/9s+lYFgZWcXczP8Q==258EAFA5-E914-47DA-95CA-C5AB0DC85B11")), "hsBlbuDTkk24srzEOTBUlZAlC2g=");
 }
 
+static void testSha1() {
+	assertEqual(Com::encodeBase64(Com::digestSha1("")), "2jmj7l5rSw0yVb/vlWAYkK/YBwk=");
+	assertEqual(Com::encodeBase64(Com::digestSha1("The quick brown fox jumps over the lazy dog")), "L9ThxnotKPzthJ7hu3bnORuT6xI=");
+
+	string data(1000000, 'a');
+	Com::Sha1 sha;
+	for (sizet i = 0, step = 1; i < data.length(); i += step, step = step % 130 + 7)	// chunks that straddle block boundaries
+		sha.update(data.data() + i, std::min(step, data.length() - i));
+	string digest(Com::Sha1::digestSize, '\0');
+	sha.finish(reinterpret_cast<uint8*>(digest.data()));
+	assertEqual(Com::encodeBase64(digest), "NKqXPNTE2qT2Husr260nMWU0AW8=");
+}
+
+static void testBase64() {
+	assertEqual(Com::encodeBase64(""), "");
+	assertEqual(Com::encodeBase64("f"), "Zg==");
+	assertEqual(Com::encodeBase64("fo"), "Zm8=");
+	assertEqual(Com::encodeBase64("foo"), "Zm9v");
+	assertEqual(Com::encodeBase64("foob"), "Zm9vYg==");
+	assertEqual(Com::encodeBase64("\xFB\xFF\xBF"), "+/+/");
+}
+
 static void testReadCom() {
 	uint8 mem[] = { 0x10, 0x20, 0x40, 0x80, 0x01, 0x02, 0x04, 0x08 };
 	assertEqual(Com::read16(mem), 0x1020u);
@@ -39,6 +61,16 @@ static void testReadName() {
 	assertEqual(Com::readName(word), "hello");
 }
 
+static void testWriteWsHead() {
+	uint8 mem[Com::wsHeadMax], small[] = { 0x82, 5 }, medium[] = { 0x82, 126, 0x01, 0x2C }, large[] = { 0x82, 127, 0, 0, 0, 0, 0, 0x01, 0x11, 0x70 };
+	assertEqual(Com::writeWsHead(mem, 5), 2u);
+	assertMemory(mem, small, 2);
+	assertEqual(Com::writeWsHead(mem, 300), 4u);
+	assertMemory(mem, medium, 4);
+	assertEqual(Com::writeWsHead(mem, 70000), 10u);
+	assertMemory(mem, large, 10);
+}
+
 static void testBufferPush() {
 	Com::Buffer b;
 	b.pushHead(Com::Code(-1), 19);
@@ -74,13 +106,421 @@ static void testBufferWrite() {
 	assertMemory(&c[0], exp, 6);
 }
 
+static void testBufferRelease() {
+	Com::Buffer b;
+	assertEqual(b.getData(), nullptr);
+	b.pushHead(Com::Code(-1), 8);
+	const uint8* block = b.getData();
+	assertTrue(block != nullptr);
+	b.clear();
+	assertEqual(b.getData(), nullptr);	// a small block goes back to the pool
+
+	Com::Buffer c;
+	c.pushHead(Com::Code(-1), 8);
+	assertEqual(c.getData(), block);
+	c.release();
+	assertEqual(c.getData(), block);	// data is left
+	c.push(vector<uint8>(2000));
+	c.clear();
+	assertTrue(c.getData() != nullptr);	// a grown block is kept until it's released
+	c.release();
+	assertEqual(c.getData(), nullptr);
+}
+
+static void testBlockPool() {
+	assertEqual(Com::BlockPool::blockSize(1), Com::BlockPool::minSize);
+	assertEqual(Com::BlockPool::blockSize(3000), 4096u);
+	assertEqual(Com::BlockPool::blockSize(Com::BlockPool::maxSize + 1), Com::BlockPool::maxSize + 1);
+
+	Com::BlockPool::trim();
+	Com::BlockPool::trim();	// drop what the other tests left
+	Com::BlockPool::Stats start = Com::BlockPool::stats();
+	uptr<uint8[]> blk = Com::BlockPool::take(1024);
+	const uint8* ptr = blk.get();
+	Com::BlockPool::give(std::move(blk), 1024);
+	assertEqual(Com::BlockPool::stats().cached, start.cached + 1024);
+	blk = Com::BlockPool::take(1024);
+	assertEqual(blk.get(), ptr);
+	assertEqual(Com::BlockPool::stats().misses, start.misses + 1);
+	Com::BlockPool::give(std::move(blk), 1024);
+
+	Com::BlockPool::trim();
+	assertEqual(Com::BlockPool::stats().cached, start.cached + 1024);	// was taken since the last trim
+	Com::BlockPool::trim();
+	assertEqual(Com::BlockPool::stats().cached, start.cached);
+	assertEqual(Com::BlockPool::stats().trimmed, start.trimmed + 1024);
+}
+
+static void testBufferRecv() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	vector<uint8> msgs;
+	for (uint i = 0; i < 2000; ++i) {	// more than fits into the buffer and the spill space at once
+		uint16 len = Com::dataHeadSize + i % 300;
+		msgs.resize(msgs.size() + len, uint8(i));
+		msgs[msgs.size()-len] = uint8(Com::Code::message);
+		Com::write16(&msgs[msgs.size()-len+1], len);
+	}
+
+	Com::Buffer b;
+	uint cnt = 0;
+	for (uint ofs = 0; ofs < msgs.size();) {
+		long len = send(fds[0], msgs.data() + ofs, std::min(msgs.size() - ofs, sizet(50000)), MSG_DONTWAIT);
+		if (len > 0)
+			ofs += uint(len);
+		assertFalse(b.recvData(fds[1]));
+		for (uint8* data; (data = b.recv(fds[1], false)); b.clearCur(false), ++cnt) {
+			assertEqual(Com::read16(data + 1), Com::dataHeadSize + cnt % 300);
+			if (Com::read16(data + 1) > Com::dataHeadSize)
+				assertEqual(data[Com::dataHeadSize], uint8(cnt));
+		}
+	}
+	assertEqual(cnt, 2000u);
+	assertEqual(b.getDlim(), 0u);
+
+	close(fds[0]);
+	assertTrue(b.recvData(fds[1]));
+	close(fds[1]);
+}
+
+static void testBufferRecvUnmasked() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	uint8 msg[Com::dataHeadSize + 4] = { uint8(Com::Code::message), 0, 0, 1, 2, 3, 4 };
+	Com::write16(msg + 1, sizeof(msg));
+	uint8 frame[Com::wsHeadMax + sizeof(msg)];
+	uint hlen = Com::writeWsHead(frame, sizeof(msg));
+	std::copy_n(msg, sizeof(msg), frame + hlen);
+
+	Com::Buffer b;	// what a client gets from a server
+	for (uint i = 0; i < hlen + sizeof(msg) - 1; ++i) {	// the payload is only complete with the last byte
+		assertEqual(send(fds[0], frame + i, 1, 0), 1l);
+		assertFalse(b.recvData(fds[1]));
+		assertEqual(b.recv(fds[1], true), nullptr);
+	}
+	assertEqual(send(fds[0], frame + hlen + sizeof(msg) - 1, 1, 0), 1l);
+	assertFalse(b.recvData(fds[1]));
+	uint8* data = b.recv(fds[1], true);
+	assertNotEqual(data, nullptr);
+	assertMemory(data, msg, sizeof(msg));
+	b.clearCur(true);
+	assertEqual(b.getDlim(), 0u);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testRecvVersion() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	auto connect = [&fds](const string& load) -> uint8 {
+		vector<uint8> msg(Com::dataHeadSize + load.length());
+		msg[0] = uint8(Com::Code::version);
+		Com::write16(msg.data() + 1, uint16(msg.size()));
+		std::copy(load.begin(), load.end(), msg.begin() + Com::dataHeadSize);
+		assertEqual(send(fds[0], msg.data(), msg.size(), 0), long(msg.size()));
+		Com::Buffer b;
+		b.recvData(fds[1]);
+		bool webs = false, nameError;
+		uint8 caps = 0xFF;
+		assertTrue(b.recvConn(fds[1], webs, nameError, [](const string&) -> bool { return false; }, nullptr, nullptr, &caps) == Com::Buffer::Init::connect);
+		assertFalse(nameError);
+		assertEqual(b.getDlim(), 0u);
+		return caps;
+	};
+	string version = char(strlen(Com::commonVersion)) + string(Com::commonVersion);
+	assertEqual(connect(version + "\4name"), Com::CAP_NONE);	// older clients send no capabilities
+	assertEqual(connect(version + "\4name" + char(Com::CAP_ROOM_DELTA)), Com::CAP_ROOM_DELTA);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testDeflateOffer() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	auto handshake = [&fds](const string& extensions, Com::WsDeflateParams& params) -> string {
+		string request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n" + extensions + "Sec-WebSocket-Version: 13\r\n\r\n";
+		assertEqual(send(fds[0], request.data(), request.length(), 0), long(request.length()));
+		Com::Buffer b;
+		b.recvData(fds[1]);
+		bool webs = false, nameError;
+		assertTrue(b.recvConn(fds[1], webs, nameError, [](const string&) -> bool { return false; }, &params) == Com::Buffer::Init::cont);
+		assertTrue(webs);
+		char response[512];
+		long len = recv(fds[0], response, sizeof(response), 0);
+		return string(response, std::max(len, 0l));
+	};
+
+	Com::WsDeflateParams params = { 12, 12, false };
+	string response = handshake("Sec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=10; client_max_window_bits\r\n", params);
+	assertNotEqual(response.find("\r\nSec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=10; client_max_window_bits=12\r\n"), string::npos);
+	assertEqual(params.serverWindow, 10);
+	assertEqual(params.clientWindow, 12);
+	assertFalse(params.serverNoContext);
+
+	params = { 12, 12, false };
+	response = handshake("Sec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=8, permessage-deflate; server_no_context_takeover\r\n", params);
+	assertNotEqual(response.find("\r\nSec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover\r\n"), string::npos);
+	assertEqual(params.serverWindow, 12);
+	assertEqual(params.clientWindow, 15);
+	assertTrue(params.serverNoContext);
+
+	params = { 12, 12, false };
+	response = handshake("", params);
+	assertEqual(response.find("Sec-WebSocket-Extensions"), string::npos);
+	assertEqual(params.serverWindow, 0);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testBufferInflate() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	const uint8 frames[] = {
+		0xC2, 0x83, 0x11, 0x22, 0x33, 0x44, 'a' ^ 0x11, 'b' ^ 0x22, 'c' ^ 0x33,	// "compressed" masked frame
+		0x82, 0x84, 0, 0, 0, 0, uint8(Com::Code::message), 0, 4, 'd'	// uncompressed masked frame behind it
+	};
+	assertEqual(send(fds[0], frames, sizeof(frames), 0), long(sizeof(frames)));
+	Com::InflateCall inflate = [](nsint, const uint8* data, uint len) -> const vector<uint8>& {	// repeats the unmasked payload 100 times so that the frame grows
+		static vector<uint8> load;
+		load.assign(Com::dataHeadSize, uint8(Com::Code::message));
+		Com::write16(&load[1], uint16(Com::dataHeadSize + len * 100));
+		for (uint i = 0; i < 100; ++i)
+			load.insert(load.end(), data, data + len);
+		return load;
+	};
+
+	Com::Buffer b;
+	b.recvData(fds[1]);
+	try {
+		b.recv(fds[1], true);
+		assertTrue(false);
+	} catch (const Com::Error&) {}
+
+	uint8* data = b.recv(fds[1], true, nullptr, inflate);
+	assertTrue(data != nullptr);
+	assertEqual(Com::read16(data + 1), Com::dataHeadSize + 300u);
+	assertEqual(string(reinterpret_cast<char*>(data + Com::dataHeadSize), 6), "abcabc");
+	b.clearCur(true);
+	data = b.recv(fds[1], true, nullptr, inflate);
+	assertTrue(data != nullptr);
+	assertEqual(Com::read16(data + 1), 4u);
+	assertEqual(data[Com::dataHeadSize], 'd');
+	b.clearCur(true);
+	assertEqual(b.getDlim(), 0u);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testBufferFragments() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	auto pushFrame = [](vector<uint8>& frames, uint8 code, const uint8* load, uint len) {
+		uint8 head[Com::wsHeadMax];
+		uint hlen = Com::writeWsHead(head, len);
+		head[0] = code;
+		head[1] |= 0x80;
+		uint8 mask[sizeof(uint32)] = { uint8(len), 0x5A, uint8(code), 0xC3 };
+		frames.insert(frames.end(), head, head + hlen);
+		frames.insert(frames.end(), mask, mask + sizeof(mask));
+		for (uint i = 0; i < len; ++i)
+			frames.push_back(load[i] ^ mask[i % sizeof(uint32)]);
+	};
+
+	vector<uint8> msg(Com::dataHeadSize + 20000), frames;
+	msg[0] = uint8(Com::Code::message);
+	Com::write16(&msg[1], uint16(msg.size()));
+	for (uint i = Com::dataHeadSize; i < msg.size(); ++i)
+		msg[i] = uint8(i * 13);
+	pushFrame(frames, 0x02, msg.data(), 1);
+	pushFrame(frames, 0x89, reinterpret_cast<const uint8*>("hey"), 3);
+	pushFrame(frames, 0x8A, reinterpret_cast<const uint8*>("hi"), 2);	// pongs to the server's pings don't get a reply, but their payload gets passed on
+	pushFrame(frames, 0x00, msg.data() + 1, 5000);
+	pushFrame(frames, 0x00, msg.data() + 5001, 300);
+	pushFrame(frames, 0x80, msg.data() + 5301, uint(msg.size()) - 5301);
+	uint8 empty[Com::dataHeadSize] = { uint8(Com::Code::message) };
+	Com::write16(empty + 1, Com::dataHeadSize);
+	pushFrame(frames, 0x8A, nullptr, 0);
+	pushFrame(frames, 0x82, empty, Com::dataHeadSize);	// an empty message behind it
+
+	Com::Buffer b;
+	uint cnt = 0;
+	static string pongs;
+	Com::PongCall pongCall = [](nsint, const uint8* data, uint len) { pongs += string(reinterpret_cast<const char*>(data), len) + ';'; };
+	for (uint ofs = 0; ofs < frames.size(); ofs += 1000) {	// arrive in pieces
+		assertEqual(send(fds[0], frames.data() + ofs, std::min(frames.size() - ofs, sizet(1000)), 0), long(std::min(frames.size() - ofs, sizet(1000))));
+		b.recvData(fds[1]);
+		for (uint8* data; (data = b.recv(fds[1], true, nullptr, nullptr, pongCall)); b.clearCur(true), ++cnt)
+			if (!cnt)
+				assertMemory(data, msg.data(), msg.size());
+			else
+				assertEqual(Com::read16(data + 1), Com::dataHeadSize);
+	}
+	assertEqual(cnt, 2u);
+	assertEqual(b.getDlim(), 0u);
+	assertEqual(pongs, string("hi;;"));
+
+	uint8 pong[5];
+	assertEqual(recv(fds[0], pong, sizeof(pong), MSG_DONTWAIT), long(sizeof(pong)));
+	assertEqual(pong[0], 0x8A);
+	assertEqual(pong[1], 3);
+	assertEqual(string(reinterpret_cast<char*>(pong + 2), 3), "hey");
+	assertEqual(recv(fds[0], pong, sizeof(pong), MSG_DONTWAIT), -1l);
+
+	frames.clear();	// a half received fragmented message continues after being handed over to another buffer
+	pushFrame(frames, 0x02, msg.data(), 7000);
+	pushFrame(frames, 0x00, msg.data() + 7000, 3000);
+	uint half = uint(frames.size()) - 1000;
+	pushFrame(frames, 0x80, msg.data() + 10000, uint(msg.size()) - 10000);
+	assertEqual(send(fds[0], frames.data(), half, 0), long(half));
+	b.recvData(fds[1]);
+	assertEqual(b.recv(fds[1], true), nullptr);
+	Com::Buffer c;
+	c.load(b.save());
+	assertEqual(send(fds[0], frames.data() + half, frames.size() - half, 0), long(frames.size() - half));
+	c.recvData(fds[1]);
+	uint8* data = c.recv(fds[1], true);
+	assertNotEqual(data, nullptr);
+	assertMemory(data, msg.data(), msg.size());
+	c.clearCur(true);
+	assertEqual(c.getDlim(), 0u);
+	try {
+		c.load(vector<uint8>(8));
+		assertTrue(false);
+	} catch (const Com::Error&) {}
+
+	frames.clear();	// too big with the next fragment
+	msg.resize(60000);
+	pushFrame(frames, 0x02, msg.data(), 60000);
+	pushFrame(frames, 0x80, msg.data(), 6000);
+	assertEqual(send(fds[0], frames.data(), frames.size(), 0), long(frames.size()));
+	b.recvData(fds[1]);
+	try {
+		b.recv(fds[1], true);
+		assertTrue(false);
+	} catch (const Com::Error&) {}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testBufferControlRun() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	constexpr uint pongCnt = 200000;	// deep enough to overflow the stack if every frame took a call
+	uint8 pong[Com::wsHeadMin + sizeof(uint32)] = { 0x8A, 0x80 };
+	uint8 msg[Com::dataHeadSize] = { uint8(Com::Code::message) };
+	Com::write16(msg + 1, Com::dataHeadSize);
+	uint8 frame[Com::wsHeadMax + sizeof(msg)];
+	uint hlen = Com::writeWsHead(frame, sizeof(msg));
+	std::copy_n(msg, sizeof(msg), frame + hlen);
+	vector<uint8> state(sizeof(uint32) * 3);	// a saved buffer without a fragmented message
+	for (uint i = 0; i < pongCnt; ++i)
+		state.insert(state.end(), pong, pong + sizeof(pong));
+	state.insert(state.end(), frame, frame + hlen + sizeof(msg));
+
+	Com::Buffer b;
+	b.load(state);
+	uint8* data = b.recv(fds[1], true);
+	assertNotEqual(data, nullptr);
+	assertMemory(data, msg, sizeof(msg));
+	b.clearCur(true);
+	assertEqual(b.getDlim(), 0u);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testBufferLimits() {
+	int fds[2];
+	assertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	uint8 head[Com::dataHeadSize] = { uint8(Com::Code::move), 0, 0 };	// shorter than its own head
+	assertEqual(send(fds[0], head, sizeof(head), 0), long(sizeof(head)));
+	Com::Buffer b;
+	b.recvData(fds[1]);
+	try {
+		b.recv(fds[1], false);
+		assertTrue(false);
+	} catch (const Com::FrameError&) {
+		assertTrue(false);
+	} catch (const Com::Error&) {}
+
+	uint maxMessage = Com::Buffer::maxMessage, maxBuffered = Com::Buffer::maxBuffered;
+	Com::Buffer::maxMessage = 1000;
+	Com::write16(head + 1, 1001);	// rejected before the rest arrives
+	assertEqual(send(fds[0], head, sizeof(head), 0), long(sizeof(head)));
+	Com::Buffer c;
+	c.recvData(fds[1]);
+	try {
+		c.recv(fds[1], false);
+		assertTrue(false);
+	} catch (const Com::FrameError&) {}
+
+	uint8 ping[2 + sizeof(uint16)] = { 0x89, 126, 0, Com::wsControlMax + 1 };	// too big for a control frame
+	assertEqual(send(fds[0], ping, sizeof(ping), 0), long(sizeof(ping)));
+	Com::Buffer d;
+	d.recvData(fds[1]);
+	try {
+		d.recv(fds[1], true);
+		assertTrue(false);
+	} catch (const Com::FrameError&) {}
+
+	Com::Buffer::maxBuffered = 5000;	// the rest stays in the socket until there's room
+	vector<uint8> data(12000, 7);
+	assertEqual(send(fds[0], data.data(), data.size(), 0), long(data.size()));
+	Com::Buffer e;
+	assertFalse(e.recvData(fds[1], true));
+	assertEqual(e.getDlim(), 5000u);
+	assertTrue(e.capped());
+	e.clear();
+	assertFalse(e.recvData(fds[1], true));
+	assertEqual(e.getDlim(), 5000u);
+	e.clear();
+	assertFalse(e.recvData(fds[1], true));
+	assertEqual(e.getDlim(), 2000u);
+	assertFalse(e.capped());
+	Com::Buffer::maxMessage = maxMessage;
+	Com::Buffer::maxBuffered = maxBuffered;
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void testUnmask() {
+	constexpr uint maxOfs = 32, maxLen = 300;
+	const uint8 mask[4] = { 0x37, 0xFA, 0x21, 0x3D };
+	uint8 src[maxOfs + maxLen], exp[maxOfs + maxLen], res[maxOfs + maxLen];
+	for (uint i = 0; i < sizeof(src); ++i)
+		src[i] = uint8(i * 7 + 3);
+	for (auto [name, call] : Com::unmaskCalls())
+		for (uint ofs = 0; ofs < maxOfs; ++ofs)
+			for (uint len = 0; len <= maxLen; ++len) {
+				std::copy_n(src, sizeof(src), exp);
+				for (uint i = 0; i < len; ++i)
+					exp[ofs+i] ^= mask[i % sizeof(uint32)];
+				std::copy_n(src, sizeof(src), res);
+				call(res + ofs, len, mask);
+				assertMemory(res, exp, sizeof(res));
+			}
+}
+
 void testServer() {
 	puts("Running Server tests...");
 	testWsKey();
+	testSha1();
+	testBase64();
 	testReadCom();
 	testWriteCom();
 	testReadText();
 	testReadName();
+	testWriteWsHead();
 	testBufferPush();
 	testBufferWrite();
+	testBufferRelease();
+	testBlockPool();
+	testBufferRecv();
+	testBufferRecvUnmasked();
+	testRecvVersion();
+	testDeflateOffer();
+	testBufferInflate();
+	testBufferFragments();
+	testBufferControlRun();
+	testBufferLimits();
+	testUnmask();
 }
@@ -371,6 +371,7 @@ struct Settings {
 	string address;
 	string port;
 	string playerName;
+	string channel;	// lobby channel on a server, empty for the default one
 	string lastConfig;
 	string versionLookupUrl;
 	string versionLookupRegex;
@@ -249,7 +249,10 @@ DateTime::DateTime(uint8 second, uint8 minute, uint8 dhour, uint8 mday, uint8 ym
 {}
 
 DateTime DateTime::now() {
-	time_t rawt = time(nullptr);
+	return fromTime(time(nullptr));
+}
+
+DateTime DateTime::fromTime(time_t rawt) {
 	struct tm* tim = localtime(&rawt);
 	return DateTime(tim->tm_sec, tim->tm_min, tim->tm_hour, tim->tm_mday, tim->tm_mon + 1, tim->tm_year + 1900, tim->tm_wday ? tim->tm_wday : 7);
 }
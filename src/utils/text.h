@@ -1,6 +1,7 @@
 #pragma once
 
 #include "alias.h"
+#include <ctime>
 #include <sstream>
 
 #ifdef _WIN32
@@ -300,6 +301,7 @@ struct DateTime {
 	DateTime(uint8 second, uint8 minute, uint8 dhour, uint8 mday, uint8 ymonth, uint16 tyear, uint8 weekDay);
 
 	static DateTime now();
+	static DateTime fromTime(time_t rawt);
 	string timeString(char ts = '-') const;
 	string dateString(char ds = '-') const;
 	string toString(char ts = '-', char sep = '_', char ds = '-') const;
@@ -0,0 +1,56 @@
+import re
+import subprocess
+import sys
+import time
+
+# holds idle connections to a server with the load generator and checks how much memory the server needs for each of them
+# usage: idle.py <server> <loadgen> [connections] [bytes per connection]
+
+port = '39799'
+addresses = 4	# every destination only has about 28000 local ports
+connectRate = 5000
+settleTime = 5	# seconds to keep all connections after they're up
+
+def residentBytes(pid):
+	with open(f'/proc/{pid}/status', 'r') as fh:
+		for line in fh:
+			if line.startswith('VmRSS:'):
+				return int(line.split()[1]) * 1024
+	return 0
+
+if __name__ == '__main__':
+	if len(sys.argv) < 3:
+		print('usage:', sys.argv[0], '<server> <loadgen> [connections] [bytes per connection]')
+		sys.exit(1)
+	conns = int(sys.argv[3]) if len(sys.argv) > 3 else 100000
+	budget = int(sys.argv[4]) if len(sys.argv) > 4 else 384	# as documented: about 256 for a player, 64 for its generated name and the rest for pool and timer slack
+	duration = conns // connectRate + settleTime * 2
+
+	server = subprocess.Popen([sys.argv[1], '-p', port, '-4', '-c', str(conns)], stdout=subprocess.DEVNULL)
+	time.sleep(1)
+	base = residentBytes(server.pid)
+	hosts = ','.join(f'127.0.0.{i}' for i in range(1, addresses + 1))
+	loadgen = subprocess.Popen([sys.argv[2], '-p', port, '-4', '-a', hosts, '-n', str(conns), '-l', '-c', str(connectRate), '-t', str(duration)], stdout=subprocess.PIPE, text=True)
+	peak = 0
+	held = 0
+	for line in loadgen.stdout:
+		if m := re.match(r'(\d+)s: (\d+) online', line):
+			print(line, end='')
+			if int(m.group(2)) == conns:
+				peak = max(peak, residentBytes(server.pid))
+				held += 1
+		elif line.startswith('idle bots'):
+			print(line, end='')
+	rc = loadgen.wait()
+	server.terminate()
+	server.wait()
+
+	if not held:
+		print('not all connections got online')
+		sys.exit(1)
+	used = (peak - base) / conns
+	print(f'server memory: {base // 1024} KiB at the start, {peak // 1024} KiB with {conns} connections, {used:.0f} bytes per connection')
+	if used > budget:
+		print(f'over the budget of {budget} bytes')
+		sys.exit(1)
+	sys.exit(rc)
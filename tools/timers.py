@@ -0,0 +1,112 @@
+import os
+import re
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+# checks that the timers of a player start with the handshake instead of after the handshake timeout
+# usage: timers.py <server>
+
+port = 39798
+handshakeTimeout = 10	# long enough that nothing should have to wait for it
+pingInterval = 1
+idleTimeout = 3
+slack = 1	# seconds a timer may be late
+
+codePing = 27
+capPing = 2
+
+def readVersion():
+	with open(os.path.join(os.path.dirname(__file__), '..', 'src', 'server', 'server.h'), 'r') as fh:
+		return re.search(r'commonVersion\[\] = "([^"]+)"', fh.read()).group(1).encode()
+
+def hello(caps):
+	ver = readVersion()
+	load = bytes([len(ver)]) + ver + b'\0' + bytes([caps])
+	return bytes([0]) + struct.pack('>H', 3 + len(load)) + load
+
+def connect(webs):
+	sock = socket.create_connection(('127.0.0.1', port))
+	if webs:
+		sock.sendall(b'GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n')
+		head = b''
+		while not head.endswith(b'\r\n\r\n'):
+			head += sock.recv(1)
+		msg = hello(0)
+		sock.sendall(bytes([0x82, 0x80 | len(msg)]) + bytes(4) + msg)	# a zero mask leaves the payload as it is
+	else:
+		sock.sendall(hello(capPing))
+	return sock
+
+def firstPing(sock, webs, limit):	# returns the seconds until the first ping or None
+	start = time.time()
+	buf = b''
+	while time.time() - start < limit:
+		sock.settimeout(limit - (time.time() - start))
+		try:
+			data = sock.recv(65536)
+		except socket.timeout:
+			return None
+		if not data:
+			return None
+		buf += data
+		while True:
+			if webs:
+				if len(buf) < 2:
+					break
+				plen = buf[1] & 0x7F
+				hlen = 2 if plen < 126 else 4
+				if len(buf) < hlen:
+					break
+				if plen == 126:
+					plen = struct.unpack('>H', buf[2:4])[0]
+				if len(buf) < hlen + plen:
+					break
+				if buf[0] & 0xF == 9:
+					return time.time() - start
+				buf = buf[hlen+plen:]
+			else:
+				if len(buf) < 3 or len(buf) < struct.unpack('>H', buf[1:3])[0]:
+					break
+				if buf[0] == codePing:
+					return time.time() - start
+				buf = buf[struct.unpack('>H', buf[1:3])[0]:]
+	return None
+
+def closedAfter(sock, limit):	# returns the seconds until the server closed the connection or None
+	start = time.time()
+	sock.settimeout(limit)
+	try:
+		while sock.recv(65536):
+			pass
+	except socket.timeout:
+		return None
+	except ConnectionResetError:
+		pass
+	return time.time() - start
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		print('usage:', sys.argv[0], '<server>')
+		sys.exit(1)
+	server = subprocess.Popen([sys.argv[1], '-p', str(port), '-4', '-t', str(handshakeTimeout), '-r', str(pingInterval), '-i', str(idleTimeout)], stdout=subprocess.DEVNULL)
+	time.sleep(1)
+	fails = 0
+	try:
+		for webs in (False, True):
+			wait = firstPing(connect(webs), webs, handshakeTimeout)
+			print(f'first ping to a {"browser" if webs else "game"} client after', 'none' if wait is None else f'{wait:.1f}s')
+			if wait is None or wait > pingInterval + slack:
+				fails += 1
+		idle = socket.create_connection(('127.0.0.1', port))
+		idle.sendall(hello(0))
+		wait = closedAfter(idle, handshakeTimeout)
+		print('idle player disconnected after', 'none' if wait is None else f'{wait:.1f}s')
+		if wait is None or wait > idleTimeout + slack:
+			fails += 1
+	finally:
+		server.terminate()
+		server.wait()
+	sys.exit(1 if fails else 0)